@@ -0,0 +1,253 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+#include <tomlex/shared_value.hpp>
+#include <tomlex/tomlex.hpp>
+
+namespace {
+
+// s = "${x}/${x}/.../${x}" with n interpolations of the same key
+toml::value make_repeated_interpolation(std::int64_t n) {
+	std::string s;
+	for (std::int64_t i = 0; i < n; i++) {
+		s += i == 0 ? "${x}" : "/${x}";
+	}
+	toml::value cfg = toml::table{};
+	cfg["x"] = "abc";
+	cfg["s"] = s;
+	return cfg;
+}
+
+// s = "--k0=${k0} --k1=${k1} ..." with n interpolations of distinct keys
+toml::value make_distinct_interpolation(std::int64_t n) {
+	std::string s;
+	toml::value cfg = toml::table{};
+	for (std::int64_t i = 0; i < n; i++) {
+		const auto key = "k" + std::to_string(i);
+		s += " --" + key + "=${" + key + "}";
+		cfg[key] = i;
+	}
+	cfg["s"] = s;
+	return cfg;
+}
+
+void BM_interpolation_repeated(benchmark::State& state) {
+	const auto cfg = make_repeated_interpolation(state.range(0));
+	for (auto _ : state) {
+		auto resolved = tomlex::detail::find_from_root(cfg, "s");
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_interpolation_repeated)->RangeMultiplier(10)->Range(1, 1000);
+
+void BM_interpolation_distinct(benchmark::State& state) {
+	const auto cfg = make_distinct_interpolation(state.range(0));
+	for (auto _ : state) {
+		auto resolved = tomlex::detail::find_from_root(cfg, "s");
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_interpolation_distinct)->RangeMultiplier(10)->Range(1, 1000);
+
+// n runs of a sweep template: run{i} = {name = "${prefix}_${lr}_{i}", dir = "${root}/${run{i}.name}"}
+toml::value make_sweep_template(std::int64_t n) {
+	toml::value cfg = toml::table{};
+	cfg["prefix"] = "exp";
+	cfg["root"] = "/data/out";
+	cfg["lr"] = 0.5;
+	for (std::int64_t i = 0; i < n; i++) {
+		const auto key = "run" + std::to_string(i);
+		toml::value run = toml::table{};
+		run["name"] = "${prefix}_${lr}_" + std::to_string(i);
+		run["dir"] = "${root}/${" + key + ".name}";
+		cfg[key] = run;
+	}
+	return cfg;
+}
+
+void BM_sweep_resolve(benchmark::State& state) {
+	const auto cfg = make_sweep_template(state.range(0));
+	const toml::value overrides = toml::table{{"lr", 0.25}};
+	for (auto _ : state) {
+		auto resolved = tomlex::resolve(tomlex::merge(toml::value(cfg), toml::value(overrides)));
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_sweep_resolve)->RangeMultiplier(10)->Range(1, 1000);
+
+void BM_sweep_compiled(benchmark::State& state) {
+	const auto tmpl = tomlex::compile(make_sweep_template(state.range(0)));
+	const toml::value overrides = toml::table{{"lr", 0.25}};
+	for (auto _ : state) {
+		auto resolved = tmpl.resolve(overrides);
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_sweep_compiled)->RangeMultiplier(10)->Range(1, 1000);
+
+// n sections whose values call a resolver that sums 1..args, e.g. s3 = {v = "${sum: 100000}"}
+toml::value make_sections(std::int64_t n) {
+	static const bool registered = [] {
+		tomlex::register_resolver("sum", [](toml::value&& args) -> toml::value {
+			std::int64_t ret = 0;
+			for (std::int64_t i = 1; i <= args.as_integer(); i++) {
+				benchmark::DoNotOptimize(ret += i);
+			}
+			return ret;
+		});
+		return true;
+	}();
+	(void)registered;
+	toml::value cfg = toml::table{};
+	for (std::int64_t i = 0; i < n; i++) {
+		toml::value section = toml::table{};
+		section["v"] = "${sum: 100000}";
+		section["first"] = i == 0 ? "none" : "${s0.name}";
+		section["name"] = "s" + std::to_string(i);
+		cfg["s" + std::to_string(i)] = section;
+	}
+	return cfg;
+}
+
+void BM_sections_serial(benchmark::State& state) {
+	const auto cfg = make_sections(state.range(0));
+	for (auto _ : state) {
+		auto resolved = tomlex::resolve(toml::value(cfg));
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_sections_serial)->Arg(64)->UseRealTime();
+
+void BM_sections_parallel(benchmark::State& state) {
+	const auto cfg = make_sections(64);
+	const unsigned threads = static_cast<unsigned>(state.range(0));
+	for (auto _ : state) {
+		auto resolved = tomlex::resolve(toml::value(cfg), tomlex::parallel{threads});
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * 64);
+}
+BENCHMARK(BM_sections_parallel)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+
+void BM_resolver_argument(benchmark::State& state) {
+	toml::array big;
+	for (std::int64_t i = 0; i < state.range(0); i++) {
+		big.push_back(i);
+	}
+	toml::value cfg = toml::table{};
+	cfg["big"] = big;
+	cfg["s"] = "${no_op: ${big}}";
+	static const bool registered = [] {
+		tomlex::register_resolver("no_op", [](toml::value&& args) { return std::move(args); });
+		return true;
+	}();
+	(void)registered;
+	for (auto _ : state) {
+		auto resolved = tomlex::detail::find_from_root(cfg, "s");
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_resolver_argument)->RangeMultiplier(10)->Range(10, 100000);
+
+// 100 values that call the same resolver with the same argument; range(0) != 0 registers it as pure
+void BM_repeated_resolver_call(benchmark::State& state) {
+	tomlex::context<> ctx;
+	ctx.register_resolver(
+		"sum",
+		[](toml::value&& args) -> toml::value {
+			std::int64_t ret = 0;
+			for (std::int64_t i = 1; i <= args.as_integer(); i++) {
+				benchmark::DoNotOptimize(ret += i);
+			}
+			return ret;
+		},
+		state.range(0) != 0 ? tomlex::pure : tomlex::impure);
+	toml::value cfg = toml::table{};
+	for (int i = 0; i < 100; i++) {
+		cfg["v" + std::to_string(i)] = "${sum: 10000}";
+	}
+	for (auto _ : state) {
+		auto resolved = tomlex::resolve(toml::value(cfg), ctx);
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * 100);
+}
+BENCHMARK(BM_repeated_resolver_call)->Arg(0)->Arg(1);
+
+// a table of 10000 entries aliased by range(0) sections: s3 = {table = "${table}"}
+template <typename Value>
+void BM_aliased_table(benchmark::State& state) {
+	Value cfg = typename Value::table_type{};
+	Value table = typename Value::table_type{};
+	for (int i = 0; i < 10000; i++) {
+		table["k" + std::to_string(i)] = i;
+	}
+	cfg["table"] = table;
+	for (std::int64_t i = 0; i < state.range(0); i++) {
+		Value section = typename Value::table_type{};
+		section["table"] = "${table}";
+		cfg["s" + std::to_string(i)] = section;
+	}
+	const tomlex::context<Value> ctx;
+	for (auto _ : state) {
+		auto resolved = tomlex::resolve(Value(cfg), ctx);
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_TEMPLATE(BM_aliased_table, toml::value)->RangeMultiplier(10)->Range(1, 100);
+BENCHMARK_TEMPLATE(BM_aliased_table, tomlex::shared_value)->RangeMultiplier(10)->Range(1, 100);
+
+// a mix of the values given to CLI overrides and resolver arguments
+const std::vector<std::string>& value_mix() {
+	static const std::vector<std::string> values = {
+		"10", "-3", "0x1F", "1.5", "1e-3", "inf", "true", "false", "'abc'", "\"abc\"", "42",
+		"1000000", "0.25", "nan", "1979-05-27", "07:32:00", "1979-05-27T07:32:00Z",
+	};
+	return values;
+}
+
+// range(0) != 0: lexers picked from the first bytes, otherwise all lexers in order
+void BM_guess_value_type(benchmark::State& state) {
+	std::vector<toml::detail::location> locs;
+	for (auto const& value : value_mix()) {
+		locs.emplace_back(value, value);
+	}
+	const bool classify = state.range(0) != 0;
+	for (auto _ : state) {
+		for (auto const& loc : locs) {
+			auto type = classify ? tomlex::detail::guess_number_type_strict(loc)
+								 : tomlex::detail::guess_number_type_with(
+									   loc, tomlex::detail::all_lexer_steps);
+			benchmark::DoNotOptimize(type);
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(locs.size()));
+}
+BENCHMARK(BM_guess_value_type)->Arg(0)->Arg(1);
+
+// range(0) != 0: to_toml_value, otherwise the toml11 lexers and parsers only
+void BM_to_toml_value(benchmark::State& state) {
+	const bool fast = state.range(0) != 0;
+	for (auto _ : state) {
+		for (auto const& value : value_mix()) {
+			if (fast) {
+				benchmark::DoNotOptimize(tomlex::detail::to_toml_value<toml::value>(value));
+			} else {
+				toml::detail::location loc(value, value);
+				benchmark::DoNotOptimize(tomlex::detail::parse_value_strict<toml::value>(loc));
+			}
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * static_cast<std::int64_t>(value_mix().size()));
+}
+BENCHMARK(BM_to_toml_value)->Arg(0)->Arg(1);
+
+}  // namespace
@@ -0,0 +1,449 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <tomlex/snapshot.hpp>
+#include <tomlex/tomlex.hpp>
+#include <tomlex/watcher.hpp>
+#include <vector>
+
+namespace {
+
+// synthetic configs, written as toml text so that parse and resolve see the same input
+
+// n keys in a table per 100 keys; every 100 / density-th value interpolates the first one
+std::string make_flat(std::int64_t n, std::int64_t density = 10) {
+	std::ostringstream oss;
+	oss << "base = \"abc\"\n";
+	for (std::int64_t i = 0; i < n; i++) {
+		if (i % 100 == 0) {
+			oss << "[t" << i / 100 << "]\n";
+		}
+		oss << "k" << i << " = ";
+		if (density > 0 && i % (100 / density) == 0) {
+			oss << "\"${base}/" << i << "\"\n";
+		} else {
+			oss << i << "\n";
+		}
+	}
+	return oss.str();
+}
+
+// tables nested depth levels deep, each with a few values; the last one references the first
+std::string make_nested(std::int64_t depth) {
+	std::ostringstream oss;
+	std::string path = "d0";
+	for (std::int64_t i = 0; i < depth; i++) {
+		if (i > 0) {
+			path += ".d" + std::to_string(i);
+		}
+		oss << "[" << path << "]\n"
+			<< "x = " << i << "\n"
+			<< "name = \"level" << i << "\"\n"
+			<< "ref = \"${d0.name}_" << i << "\"\n";
+	}
+	oss << "[last]\nref = \"${" << path << ".name}\"\n";
+	return oss.str();
+}
+
+// k0 = 0, k1 = "${k0}", ..., each key references the previous one
+std::string make_chain(std::int64_t length) {
+	std::ostringstream oss;
+	oss << "k0 = 0\n";
+	for (std::int64_t i = 1; i < length; i++) {
+		oss << "k" << i << " = \"${k" << i - 1 << "}\"\n";
+	}
+	return oss.str();
+}
+
+// n values that call resolvers, with literal and nested arguments
+std::string make_resolver_heavy(std::int64_t n) {
+	std::ostringstream oss;
+	oss << "xs = [1, 2, 3, 4]\n";
+	for (std::int64_t i = 0; i < n; i++) {
+		switch (i % 3) {
+			case 0:
+				oss << "v" << i << " = \"${add: [" << i << ", 1, 2]}\"\n";
+				break;
+			case 1:
+				oss << "v" << i << " = \"${add: ${xs}}\"\n";
+				break;
+			default:
+				oss << "v" << i << " = \"${no_op: ${v" << i - 1 << "}}_" << i << "\"\n";
+				break;
+		}
+	}
+	return oss.str();
+}
+
+toml::value parse_text(std::string const& text) {
+	std::istringstream iss(text);
+	return toml::parse(iss, "synthetic.toml");
+}
+
+tomlex::context<> const& resolver_context() {
+	static const tomlex::context<> ctx = [] {
+		tomlex::context<> ctx;
+		ctx.register_resolver("no_op", [](toml::value&& args) { return std::move(args); });
+		ctx.register_resolver("add", [](toml::value&& args) -> toml::value {
+			std::int64_t ret = 0;
+			for (auto const& item : args.as_array()) {
+				ret += item.as_integer();
+			}
+			return ret;
+		});
+		return ctx;
+	}();
+	return ctx;
+}
+
+// a file in the temporary directory, removed when the benchmark ends
+class temp_file {
+   public:
+	explicit temp_file(std::string const& text)
+		: path_((std::filesystem::temp_directory_path() / "tomlex_bench.toml").string()) {
+		std::ofstream(path_, std::ios::binary) << text;
+	}
+	~temp_file() { std::remove(path_.c_str()); }
+	std::string const& path() const { return path_; }
+
+   private:
+	std::string path_;
+};
+
+void resolve_loop(benchmark::State& state, std::string const& text) {
+	const auto cfg = parse_text(text);
+	for (auto _ : state) {
+		auto resolved = tomlex::resolve(toml::value(cfg), resolver_context());
+		benchmark::DoNotOptimize(resolved);
+	}
+	state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(text.size()));
+}
+
+void BM_parse_keys(benchmark::State& state) {
+	const auto text = make_flat(state.range(0));
+	const temp_file file(text);
+	for (auto _ : state) {
+		auto cfg = tomlex::parse(file.path(), resolver_context());
+		benchmark::DoNotOptimize(cfg);
+	}
+	state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(text.size()));
+}
+BENCHMARK(BM_parse_keys)->RangeMultiplier(10)->Range(10, 10000);
+
+// same as BM_parse_keys; arg 1 drops the source regions of the result
+void BM_parse_regions(benchmark::State& state) {
+	const auto text = make_flat(state.range(0));
+	const temp_file file(text);
+	const auto regions =
+		state.range(1) ? tomlex::source_regions::drop : tomlex::source_regions::keep;
+	for (auto _ : state) {
+		auto cfg = tomlex::parse(file.path(), resolver_context(), regions);
+		benchmark::DoNotOptimize(cfg);
+	}
+	state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(text.size()));
+}
+BENCHMARK(BM_parse_regions)->ArgsProduct({{10, 1000, 10000}, {0, 1}});
+
+void BM_compact(benchmark::State& state) {
+	const auto cfg = tomlex::resolve(parse_text(make_flat(state.range(0))), resolver_context());
+	for (auto _ : state) {
+		state.PauseTiming();
+		auto copied = cfg;
+		state.ResumeTiming();
+		benchmark::DoNotOptimize(tomlex::compact(copied));
+	}
+}
+BENCHMARK(BM_compact)->RangeMultiplier(10)->Range(10, 10000);
+
+// startup from a snapshot of the same config as BM_parse_keys
+void BM_snapshot_load(benchmark::State& state) {
+	const auto text = make_flat(state.range(0));
+	const temp_file file(text);
+	const auto snapshot = file.path() + ".snapshot";
+	tomlex::save_snapshot(tomlex::parse(file.path(), resolver_context()), snapshot);
+	for (auto _ : state) {
+		auto cfg = tomlex::load_snapshot(snapshot);
+		benchmark::DoNotOptimize(cfg);
+	}
+	std::remove(snapshot.c_str());
+	state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(text.size()));
+}
+BENCHMARK(BM_snapshot_load)->RangeMultiplier(10)->Range(10, 10000);
+
+void BM_resolve_keys(benchmark::State& state) { resolve_loop(state, make_flat(state.range(0))); }
+BENCHMARK(BM_resolve_keys)->RangeMultiplier(10)->Range(10, 10000);
+
+// range(0): interpolated values per 100 keys
+void BM_resolve_density(benchmark::State& state) {
+	resolve_loop(state, make_flat(1000, state.range(0)));
+}
+BENCHMARK(BM_resolve_density)->Arg(0)->Arg(1)->Arg(10)->Arg(50)->Arg(100);
+
+// baseline of BM_resolve_density/0: copies the config and visits every value
+std::size_t count_strings(toml::value const& val) {
+	if (val.is_table()) {
+		std::size_t n = 0;
+		for (auto const& [k, v] : val.as_table()) {
+			n += count_strings(v);
+		}
+		return n;
+	}
+	if (val.is_array()) {
+		std::size_t n = 0;
+		for (auto const& v : val.as_array()) {
+			n += count_strings(v);
+		}
+		return n;
+	}
+	return val.is_string() ? 1 : 0;
+}
+
+void BM_tree_walk(benchmark::State& state) {
+	const auto text = make_flat(1000, 0);
+	const auto cfg = parse_text(text);
+	for (auto _ : state) {
+		toml::value copied(cfg);
+		benchmark::DoNotOptimize(count_strings(copied));
+		benchmark::DoNotOptimize(copied);
+	}
+	state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(text.size()));
+}
+BENCHMARK(BM_tree_walk);
+
+void BM_resolve_depth(benchmark::State& state) { resolve_loop(state, make_nested(state.range(0))); }
+BENCHMARK(BM_resolve_depth)->RangeMultiplier(4)->Range(1, 256);
+
+void BM_resolve_chain(benchmark::State& state) { resolve_loop(state, make_chain(state.range(0))); }
+BENCHMARK(BM_resolve_chain)->RangeMultiplier(4)->Range(4, 1024);
+
+// one section of range(0) keys read from a lazy_config, against BM_resolve_keys
+void BM_lazy_section(benchmark::State& state) {
+	const auto cfg = parse_text(make_flat(state.range(0)));
+	for (auto _ : state) {
+		state.PauseTiming();
+		auto copied = cfg;
+		state.ResumeTiming();
+		tomlex::lazy_config<> lazy(std::move(copied), resolver_context());
+		benchmark::DoNotOptimize(lazy["t1"]);
+	}
+}
+BENCHMARK(BM_lazy_section)->RangeMultiplier(10)->Range(1000, 10000);
+
+// a section that is already resolved
+void BM_lazy_cached(benchmark::State& state) {
+	tomlex::lazy_config<> lazy(parse_text(make_flat(1000)), resolver_context());
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(lazy.find("t1", "k110"));
+	}
+}
+BENCHMARK(BM_lazy_cached);
+
+// a reload of a config of range(0) keys where one value changed, against BM_resolve_keys
+void BM_reload_incremental(benchmark::State& state) {
+	auto cfg = parse_text(make_flat(state.range(0)));
+	auto const& ctx = resolver_context();
+	tomlex::detail::incremental_resolver<toml::value> resolver(ctx.resolvers(), ctx.max_depth());
+	resolver.resolve(cfg);
+	std::int64_t i = 0;
+	for (auto _ : state) {
+		cfg["t0"]["k1"] = ++i;
+		auto resolved = resolver.resolve(cfg);
+		benchmark::DoNotOptimize(resolved);
+	}
+}
+BENCHMARK(BM_reload_incremental)->RangeMultiplier(10)->Range(1000, 10000);
+
+void BM_resolve_resolvers(benchmark::State& state) {
+	resolve_loop(state, make_resolver_heavy(state.range(0)));
+}
+BENCHMARK(BM_resolve_resolvers)->RangeMultiplier(10)->Range(10, 10000);
+
+void BM_merge(benchmark::State& state) {
+	const auto base = parse_text(make_flat(state.range(0)));
+	const auto overwrite = parse_text(make_flat(state.range(0) / 2));
+	for (auto _ : state) {
+		auto merged = tomlex::merge(toml::value(base), toml::value(overwrite));
+		benchmark::DoNotOptimize(merged);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_merge)->RangeMultiplier(10)->Range(10, 10000);
+
+// the overlay is const: only its values are copied, and base is modified in place
+void BM_merge_into(benchmark::State& state) {
+	const auto base = parse_text(make_flat(state.range(0)));
+	const auto overlay = parse_text(make_flat(state.range(0) / 2));
+	for (auto _ : state) {
+		auto merged = base;
+		tomlex::merge_into(merged, overlay);
+		benchmark::DoNotOptimize(merged);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_merge_into)->RangeMultiplier(10)->Range(10, 10000);
+
+// defaults, site, host, environment and cli layers, each smaller than the one below
+void BM_merge_layers(benchmark::State& state) {
+	std::vector<toml::value> layers;
+	for (std::int64_t i = 0; i < 5; i++) {
+		layers.push_back(parse_text(make_flat(state.range(0) >> i)));
+	}
+	for (auto _ : state) {
+		auto merged = tomlex::merge(layers);
+		benchmark::DoNotOptimize(merged);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_merge_layers)->RangeMultiplier(10)->Range(10, 10000);
+
+// the same layers merged one after another by merge_into, against BM_merge_layers
+void BM_merge_layers_sequential(benchmark::State& state) {
+	std::vector<toml::value> layers;
+	for (std::int64_t i = 0; i < 5; i++) {
+		layers.push_back(parse_text(make_flat(state.range(0) >> i)));
+	}
+	for (auto _ : state) {
+		auto copies = layers;
+		auto merged = std::move(copies.front());
+		for (std::size_t i = 1; i < copies.size(); i++) {
+			tomlex::merge_into(merged, std::move(copies[i]));
+		}
+		benchmark::DoNotOptimize(merged);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_merge_layers_sequential)->RangeMultiplier(10)->Range(10, 10000);
+
+// argv of "prog a.k0=0 a.k1=1 ..." with n overrides
+void BM_from_cli(benchmark::State& state) {
+	std::vector<std::string> args{"prog"};
+	for (std::int64_t i = 0; i < state.range(0); i++) {
+		args.push_back("t" + std::to_string(i % 10) + ".k" + std::to_string(i) + "=" +
+					   std::to_string(i));
+	}
+	std::vector<char const*> argv;
+	for (auto const& arg : args) {
+		argv.push_back(arg.c_str());
+	}
+	for (auto _ : state) {
+		auto cfg = tomlex::from_cli(static_cast<int>(argv.size()), argv.data());
+		benchmark::DoNotOptimize(cfg);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_from_cli)->RangeMultiplier(10)->Range(1, 1000);
+
+// failure paths: a throwing function caught by the caller, and its try_ variant
+void BM_merge_failure_throw(benchmark::State& state) {
+	const auto base = parse_text(make_flat(10));
+	const auto overlay = parse_text("[t0]\nk1 = \"str\"\n");
+	for (auto _ : state) {
+		try {
+			auto merged = tomlex::merge(toml::value(base), toml::value(overlay));
+			benchmark::DoNotOptimize(merged);
+		} catch (tomlex::error& e) {
+			benchmark::DoNotOptimize(e);
+		}
+	}
+}
+BENCHMARK(BM_merge_failure_throw);
+
+void BM_merge_failure_result(benchmark::State& state) {
+	const auto base = parse_text(make_flat(10));
+	const auto overlay = parse_text("[t0]\nk1 = \"str\"\n");
+	for (auto _ : state) {
+		auto merged = tomlex::try_merge(toml::value(base), toml::value(overlay));
+		benchmark::DoNotOptimize(merged);
+	}
+}
+BENCHMARK(BM_merge_failure_result);
+
+// the last override conflicts with the first one
+constexpr char const* const bad_argv[] = {"prog", "a.b=1", "a.c=2", "a.b.c=3"};
+
+void BM_from_cli_failure_throw(benchmark::State& state) {
+	for (auto _ : state) {
+		try {
+			auto cfg = tomlex::from_cli(4, bad_argv);
+			benchmark::DoNotOptimize(cfg);
+		} catch (tomlex::error& e) {
+			benchmark::DoNotOptimize(e);
+		}
+	}
+}
+BENCHMARK(BM_from_cli_failure_throw);
+
+void BM_from_cli_failure_result(benchmark::State& state) {
+	for (auto _ : state) {
+		auto cfg = tomlex::try_from_cli(4, bad_argv);
+		benchmark::DoNotOptimize(cfg);
+	}
+}
+BENCHMARK(BM_from_cli_failure_result);
+
+void BM_resolve_failure_throw(benchmark::State& state) {
+	const auto cfg = parse_text("a = \"${b.c}\"\nb = 1\n");
+	for (auto _ : state) {
+		try {
+			auto resolved = tomlex::resolve(toml::value(cfg), resolver_context());
+			benchmark::DoNotOptimize(resolved);
+		} catch (tomlex::error& e) {
+			benchmark::DoNotOptimize(e);
+		}
+	}
+}
+BENCHMARK(BM_resolve_failure_throw);
+
+void BM_resolve_failure_result(benchmark::State& state) {
+	const auto cfg = parse_text("a = \"${b.c}\"\nb = 1\n");
+	for (auto _ : state) {
+		auto resolved = tomlex::try_resolve(toml::value(cfg), resolver_context());
+		benchmark::DoNotOptimize(resolved);
+	}
+}
+BENCHMARK(BM_resolve_failure_result);
+
+void BM_format(benchmark::State& state) {
+	const auto cfg = parse_text(make_flat(state.range(0), 0));
+	for (auto _ : state) {
+		auto text = tomlex::format(cfg);
+		benchmark::DoNotOptimize(text);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_format)->RangeMultiplier(10)->Range(10, 10000);
+
+// what keying a cache on the effective config cost before tomlex::fingerprint
+void BM_format_hash(benchmark::State& state) {
+	const auto cfg = parse_text(make_flat(state.range(0), 0));
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(std::hash<std::string>()(tomlex::format(cfg)));
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_format_hash)->RangeMultiplier(10)->Range(10, 10000);
+
+void BM_fingerprint(benchmark::State& state) {
+	const auto cfg = parse_text(make_flat(state.range(0), 0));
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(tomlex::fingerprint(cfg));
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_fingerprint)->RangeMultiplier(10)->Range(10, 10000);
+
+void BM_fingerprints(benchmark::State& state) {
+	const auto cfg = parse_text(make_flat(state.range(0), 0));
+	for (auto _ : state) {
+		tomlex::fingerprints sections(cfg);
+		benchmark::DoNotOptimize(sections);
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_fingerprints)->RangeMultiplier(10)->Range(10, 10000);
+
+}  // namespace
@@ -0,0 +1,243 @@
+#pragma once
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tomlex.hpp"
+
+namespace tomlex {
+namespace detail {
+/// <summary>
+/// Storage of a copy-on-write container: copies share one container, and the first
+/// modification through a copy that is not the only owner gives it a private copy.
+/// Accessing an element through a non-const member (including iterators) counts as a
+/// modification.
+/// </summary>
+template <typename Container>
+class cow_storage {
+   public:
+	cow_storage() = default;
+	explicit cow_storage(Container&& c) : data_(std::make_shared<Container>(std::move(c))) {}
+
+	Container const& get() const {
+		static const Container empty{};
+		return data_ ? *data_ : empty;
+	}
+	Container& get_mut() {
+		if (!data_) {
+			data_ = std::make_shared<Container>();
+		} else if (data_.use_count() > 1) {
+			data_ = std::make_shared<Container>(*data_);
+		}
+		return *data_;
+	}
+	long use_count() const { return data_.use_count(); }
+
+   private:
+	std::shared_ptr<Container> data_;
+};
+}  // namespace detail
+
+/// <summary>
+/// std::vector with copy-on-write storage, for toml::basic_value's Array parameter.
+/// </summary>
+template <typename T, typename Alloc = std::allocator<T>>
+class cow_vector {
+	using container_type = std::vector<T, Alloc>;
+
+   public:
+	using value_type = T;
+	using allocator_type = Alloc;
+	using size_type = typename container_type::size_type;
+	using difference_type = typename container_type::difference_type;
+	using reference = T&;
+	using const_reference = T const&;
+	using pointer = typename container_type::pointer;
+	using const_pointer = typename container_type::const_pointer;
+	using iterator = typename container_type::iterator;
+	using const_iterator = typename container_type::const_iterator;
+	using reverse_iterator = typename container_type::reverse_iterator;
+	using const_reverse_iterator = typename container_type::const_reverse_iterator;
+
+	cow_vector() = default;
+	cow_vector(std::initializer_list<T> init) : storage_(container_type(init)) {}
+	explicit cow_vector(size_type n) : storage_(container_type(n)) {}
+	cow_vector(size_type n, T const& value) : storage_(container_type(n, value)) {}
+	template <typename InputIt>
+	cow_vector(InputIt first, InputIt last) : storage_(container_type(first, last)) {}
+
+	const_iterator begin() const noexcept { return get().begin(); }
+	const_iterator end() const noexcept { return get().end(); }
+	const_iterator cbegin() const noexcept { return get().cbegin(); }
+	const_iterator cend() const noexcept { return get().cend(); }
+	const_reverse_iterator rbegin() const noexcept { return get().rbegin(); }
+	const_reverse_iterator rend() const noexcept { return get().rend(); }
+	iterator begin() { return mut().begin(); }
+	iterator end() { return mut().end(); }
+	reverse_iterator rbegin() { return mut().rbegin(); }
+	reverse_iterator rend() { return mut().rend(); }
+
+	bool empty() const noexcept { return get().empty(); }
+	size_type size() const noexcept { return get().size(); }
+	size_type capacity() const noexcept { return get().capacity(); }
+
+	const_reference operator[](size_type i) const { return get()[i]; }
+	const_reference at(size_type i) const { return get().at(i); }
+	const_reference front() const { return get().front(); }
+	const_reference back() const { return get().back(); }
+	reference operator[](size_type i) { return mut()[i]; }
+	reference at(size_type i) { return mut().at(i); }
+	reference front() { return mut().front(); }
+	reference back() { return mut().back(); }
+
+	void reserve(size_type n) { mut().reserve(n); }
+	void resize(size_type n) { mut().resize(n); }
+	void clear() { mut().clear(); }
+	void push_back(T const& value) { mut().push_back(value); }
+	void push_back(T&& value) { mut().push_back(std::move(value)); }
+	template <typename... Args>
+	reference emplace_back(Args&&... args) {
+		return mut().emplace_back(std::forward<Args>(args)...);
+	}
+	void pop_back() { mut().pop_back(); }
+	template <typename... Args>
+	iterator insert(const_iterator pos, Args&&... args) {
+		const auto offset = pos - cbegin();
+		return mut().insert(mut().cbegin() + offset, std::forward<Args>(args)...);
+	}
+	iterator erase(const_iterator pos) {
+		const auto offset = pos - cbegin();
+		return mut().erase(mut().cbegin() + offset);
+	}
+	iterator erase(const_iterator first, const_iterator last) {
+		const auto offset = first - cbegin();
+		const auto count = last - first;
+		auto& c = mut();
+		return c.erase(c.cbegin() + offset, c.cbegin() + offset + count);
+	}
+	void swap(cow_vector& other) noexcept { std::swap(storage_, other.storage_); }
+
+	// number of cow_vectors that share the elements
+	long use_count() const { return storage_.use_count(); }
+
+	friend bool operator==(cow_vector const& lhs, cow_vector const& rhs) {
+		return lhs.get() == rhs.get();
+	}
+	friend bool operator!=(cow_vector const& lhs, cow_vector const& rhs) {
+		return !(lhs == rhs);
+	}
+	friend bool operator<(cow_vector const& lhs, cow_vector const& rhs) {
+		return lhs.get() < rhs.get();
+	}
+
+   private:
+	container_type const& get() const { return storage_.get(); }
+	container_type& mut() { return storage_.get_mut(); }
+
+	detail::cow_storage<container_type> storage_;
+};
+
+/// <summary>
+/// std::unordered_map with copy-on-write storage, for toml::basic_value's Table parameter.
+/// </summary>
+template <typename Key, typename T, typename Hash = std::hash<Key>,
+		  typename KeyEqual = std::equal_to<Key>,
+		  typename Alloc = std::allocator<std::pair<const Key, T>>>
+class cow_map {
+	using container_type = std::unordered_map<Key, T, Hash, KeyEqual, Alloc>;
+
+   public:
+	using key_type = Key;
+	using mapped_type = T;
+	using value_type = typename container_type::value_type;
+	using hasher = Hash;
+	using key_equal = KeyEqual;
+	using allocator_type = Alloc;
+	using size_type = typename container_type::size_type;
+	using difference_type = typename container_type::difference_type;
+	using reference = value_type&;
+	using const_reference = value_type const&;
+	using iterator = typename container_type::iterator;
+	using const_iterator = typename container_type::const_iterator;
+
+	cow_map() = default;
+	cow_map(std::initializer_list<value_type> init) : storage_(container_type(init)) {}
+	template <typename InputIt>
+	cow_map(InputIt first, InputIt last) : storage_(container_type(first, last)) {}
+
+	const_iterator begin() const noexcept { return get().begin(); }
+	const_iterator end() const noexcept { return get().end(); }
+	const_iterator cbegin() const noexcept { return get().cbegin(); }
+	const_iterator cend() const noexcept { return get().cend(); }
+	iterator begin() { return mut().begin(); }
+	iterator end() { return mut().end(); }
+
+	bool empty() const noexcept { return get().empty(); }
+	size_type size() const noexcept { return get().size(); }
+
+	const_iterator find(Key const& key) const { return get().find(key); }
+	iterator find(Key const& key) { return mut().find(key); }
+	size_type count(Key const& key) const { return get().count(key); }
+	T const& at(Key const& key) const { return get().at(key); }
+	T& at(Key const& key) { return mut().at(key); }
+	T& operator[](Key const& key) { return mut()[key]; }
+	T& operator[](Key&& key) { return mut()[std::move(key)]; }
+
+	void reserve(size_type n) { mut().reserve(n); }
+	void clear() { mut().clear(); }
+	template <typename... Args>
+	std::pair<iterator, bool> emplace(Args&&... args) {
+		return mut().emplace(std::forward<Args>(args)...);
+	}
+	template <typename... Args>
+	std::pair<iterator, bool> try_emplace(Key const& key, Args&&... args) {
+		return mut().try_emplace(key, std::forward<Args>(args)...);
+	}
+	template <typename... Args>
+	auto insert(Args&&... args) -> decltype(std::declval<container_type&>().insert(
+		std::forward<Args>(args)...)) {
+		return mut().insert(std::forward<Args>(args)...);
+	}
+	template <typename M>
+	std::pair<iterator, bool> insert_or_assign(Key const& key, M&& obj) {
+		return mut().insert_or_assign(key, std::forward<M>(obj));
+	}
+	size_type erase(Key const& key) { return mut().erase(key); }
+	iterator erase(const_iterator pos) {
+		// pos may point into the shared container
+		if (use_count() > 1) {
+			auto const& key = pos->first;
+			auto& c = mut();
+			return c.erase(c.find(key));
+		}
+		return mut().erase(pos);
+	}
+	void swap(cow_map& other) noexcept { std::swap(storage_, other.storage_); }
+
+	// number of cow_maps that share the elements
+	long use_count() const { return storage_.use_count(); }
+
+	friend bool operator==(cow_map const& lhs, cow_map const& rhs) {
+		return lhs.get() == rhs.get();
+	}
+	friend bool operator!=(cow_map const& lhs, cow_map const& rhs) { return !(lhs == rhs); }
+
+   private:
+	container_type const& get() const { return storage_.get(); }
+	container_type& mut() { return storage_.get_mut(); }
+
+	detail::cow_storage<container_type> storage_;
+};
+
+/// <summary>
+/// toml::value whose tables and arrays are shared between copies until one of them is modified.
+/// A resolved tree shares the subtrees that are referenced by "${...}" with their source, so
+/// aliases of a large table or array cost little memory. Use it as the Value parameter, e.g.
+/// tomlex::parse&lt;tomlex::shared_value&gt;(filename).
+/// </summary>
+using shared_value = toml::basic_value<toml::discard_comments, cow_map, cow_vector>;
+
+}  // namespace tomlex
@@ -0,0 +1,537 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "tomlex.hpp"
+
+namespace tomlex {
+// version of the snapshot format; snapshots of other versions are not loaded. Bump it whenever
+// the layout or the checksum hash changes (2: checksum moved to detail::murmur3_128)
+inline constexpr std::uint32_t snapshot_version = 2;
+
+namespace detail {
+/// <summary>
+/// Read-only view of the contents of a file: a memory mapping where there is one, or a copy
+/// read with an ifstream.
+/// </summary>
+class mapped_file {
+   public:
+	explicit mapped_file(std::string const& filename) {
+#if defined(__unix__) || defined(__APPLE__)
+		const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || ::fstat(fd, &st) != 0) {
+			if (fd >= 0) {
+				::close(fd);
+			}
+			throw std::runtime_error("tomlex::mapped_file: file open error -> " + filename);
+		}
+		size_ = static_cast<std::size_t>(st.st_size);
+		if (size_ > 0) {
+			addr_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (addr_ == MAP_FAILED) {
+				::close(fd);
+				throw std::runtime_error("tomlex::mapped_file: mmap failed -> " + filename);
+			}
+			::madvise(addr_, size_, MADV_SEQUENTIAL);
+		}
+		::close(fd);
+#else
+		std::ifstream ifs(filename, std::ios_base::binary | std::ios_base::ate);
+		if (!ifs.good()) {
+			throw std::runtime_error("tomlex::mapped_file: file open error -> " + filename);
+		}
+		letters_.resize(static_cast<std::size_t>(ifs.tellg()));
+		ifs.seekg(0);
+		ifs.read(letters_.data(), static_cast<std::streamsize>(letters_.size()));
+#endif
+	}
+	mapped_file(mapped_file const&) = delete;
+	mapped_file& operator=(mapped_file const&) = delete;
+#if defined(__unix__) || defined(__APPLE__)
+	~mapped_file() {
+		if (size_ > 0) {
+			::munmap(addr_, size_);
+		}
+	}
+
+	char const* data() const noexcept { return size_ > 0 ? static_cast<char const*>(addr_) : ""; }
+	std::size_t size() const noexcept { return size_; }
+
+   private:
+	void* addr_ = nullptr;
+	std::size_t size_ = 0;
+#else
+	char const* data() const noexcept { return letters_.data(); }
+	std::size_t size() const noexcept { return letters_.size(); }
+
+   private:
+	std::vector<char> letters_;
+#endif
+};
+
+/// <summary>
+/// Layout of a snapshot, 8-byte aligned so that it is read in place from a mapping: the
+/// header, string_count + 1 offsets into the string bytes, the string bytes padded to 8 bytes,
+/// then the nodes of the tree in preorder. Keys and strings are stored once in the string
+/// table. Numbers are in the byte order of the writer, which byte_order lets the loader check,
+/// and checksum covers everything after the header.
+/// </summary>
+struct snapshot_header {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byte_order;
+	std::uint64_t key;
+	std::uint64_t checksum;
+	std::uint64_t string_count;
+	std::uint64_t string_bytes;
+	std::uint64_t node_count;
+};
+static_assert(sizeof(snapshot_header) == 56);
+constexpr char snapshot_magic[8] = {'T', 'O', 'M', 'L', 'E', 'X', 'S', 'N'};
+constexpr std::uint32_t snapshot_byte_order = 0x01020304;
+constexpr std::uint32_t snapshot_no_key = 0xFFFFFFFF;
+
+struct snapshot_node {
+	std::uint8_t type;	// toml::value_t
+	std::uint8_t kind;	// toml::string_t of strings
+	std::int8_t offset_hour, offset_minute;
+	std::uint32_t key;	// string id of the key of a member of a table, or snapshot_no_key
+	std::uint32_t aux;	// number of elements of a table or array, or a packed date
+	std::uint16_t nanosecond;
+	std::uint16_t reserved;
+	std::uint64_t payload;	// bool, integer or float bits, string id, or a packed time
+};
+static_assert(sizeof(snapshot_node) == 24);
+
+inline std::uint32_t pack_date(toml::local_date const& d) {
+	return (static_cast<std::uint32_t>(static_cast<std::uint16_t>(d.year)) << 16) |
+		   (static_cast<std::uint32_t>(d.month) << 8) | d.day;
+}
+inline toml::local_date unpack_date(std::uint32_t packed) {
+	toml::local_date d;
+	d.year = static_cast<std::int16_t>(static_cast<std::uint16_t>(packed >> 16));
+	d.month = static_cast<std::uint8_t>(packed >> 8);
+	d.day = static_cast<std::uint8_t>(packed);
+	return d;
+}
+inline void pack_time(toml::local_time const& t, snapshot_node& node) {
+	node.payload = std::uint64_t(t.hour) | (std::uint64_t(t.minute) << 8) |
+				   (std::uint64_t(t.second) << 16) | (std::uint64_t(t.millisecond) << 24) |
+				   (std::uint64_t(t.microsecond) << 40);
+	node.nanosecond = t.nanosecond;
+}
+inline toml::local_time unpack_time(snapshot_node const& node) {
+	toml::local_time t;
+	t.hour = static_cast<std::uint8_t>(node.payload);
+	t.minute = static_cast<std::uint8_t>(node.payload >> 8);
+	t.second = static_cast<std::uint8_t>(node.payload >> 16);
+	t.millisecond = static_cast<std::uint16_t>(node.payload >> 24);
+	t.microsecond = static_cast<std::uint16_t>(node.payload >> 40);
+	t.nanosecond = node.nanosecond;
+	return t;
+}
+
+template <typename Value>
+std::vector<char> encode_snapshot(Value const& cfg, std::uint64_t key) {
+	std::vector<std::string_view> strings;
+	std::unordered_map<std::string_view, std::uint32_t> ids;
+	const auto intern = [&](std::string const& str) {
+		auto [it, inserted] = ids.emplace(str, static_cast<std::uint32_t>(strings.size()));
+		if (inserted) {
+			strings.push_back(str);
+		}
+		return it->second;
+	};
+
+	std::vector<snapshot_node> nodes;
+	std::vector<std::pair<Value const*, std::uint32_t>> stack{{&cfg, snapshot_no_key}};
+	std::vector<std::pair<toml::key const*, Value const*>> members;
+	while (!stack.empty()) {
+		const auto [val, key_id] = stack.back();
+		stack.pop_back();
+		snapshot_node node{};
+		node.type = static_cast<std::uint8_t>(val->type());
+		node.key = key_id;
+		switch (val->type()) {
+			case toml::value_t::boolean:
+				node.payload = val->as_boolean() ? 1 : 0;
+				break;
+			case toml::value_t::integer: {
+				const std::int64_t i = val->as_integer();
+				std::memcpy(&node.payload, &i, 8);
+				break;
+			}
+			case toml::value_t::floating: {
+				const double f = val->as_floating();
+				std::memcpy(&node.payload, &f, 8);
+				break;
+			}
+			case toml::value_t::string:
+				node.kind = static_cast<std::uint8_t>(val->as_string().kind);
+				node.payload = intern(val->as_string().str);
+				break;
+			case toml::value_t::offset_datetime: {
+				auto const& dt = val->as_offset_datetime();
+				node.aux = pack_date(dt.date);
+				pack_time(dt.time, node);
+				node.offset_hour = dt.offset.hour;
+				node.offset_minute = dt.offset.minute;
+				break;
+			}
+			case toml::value_t::local_datetime:
+				node.aux = pack_date(val->as_local_datetime().date);
+				pack_time(val->as_local_datetime().time, node);
+				break;
+			case toml::value_t::local_date:
+				node.aux = pack_date(val->as_local_date());
+				break;
+			case toml::value_t::local_time:
+				pack_time(val->as_local_time(), node);
+				break;
+			case toml::value_t::array: {
+				auto const& arr = val->as_array();
+				node.aux = static_cast<std::uint32_t>(arr.size());
+				for (auto it = arr.rbegin(); it != arr.rend(); ++it) {
+					stack.emplace_back(&*it, snapshot_no_key);
+				}
+				break;
+			}
+			case toml::value_t::table: {
+				// sorted, so that equal configs give equal snapshots
+				members.clear();
+				for (auto const& [k, v] : val->as_table()) {
+					members.emplace_back(&k, &v);
+				}
+				std::sort(members.begin(), members.end(),
+						  [](auto const& l, auto const& r) { return *l.first < *r.first; });
+				node.aux = static_cast<std::uint32_t>(members.size());
+				for (auto it = members.rbegin(); it != members.rend(); ++it) {
+					stack.emplace_back(it->second, intern(*it->first));
+				}
+				break;
+			}
+			default:
+				throw std::runtime_error("tomlex::save_snapshot: empty value");
+		}
+		nodes.push_back(node);
+	}
+
+	std::vector<std::uint64_t> offsets{0};
+	for (auto const& str : strings) {
+		offsets.push_back(offsets.back() + str.size());
+	}
+	const std::size_t string_bytes = (offsets.back() + 7) / 8 * 8;
+	std::vector<char> out(sizeof(snapshot_header) + offsets.size() * 8 + string_bytes +
+						  nodes.size() * sizeof(snapshot_node));
+	char* p = out.data() + sizeof(snapshot_header);
+	std::memcpy(p, offsets.data(), offsets.size() * 8);
+	p += offsets.size() * 8;
+	for (auto const& str : strings) {
+		std::memcpy(p, str.data(), str.size());
+		p += str.size();
+	}
+	p = out.data() + sizeof(snapshot_header) + offsets.size() * 8 + string_bytes;
+	std::memcpy(p, nodes.data(), nodes.size() * sizeof(snapshot_node));
+
+	snapshot_header header{};
+	std::memcpy(header.magic, snapshot_magic, 8);
+	header.version = snapshot_version;
+	header.byte_order = snapshot_byte_order;
+	header.key = key;
+	header.string_count = strings.size();
+	header.string_bytes = string_bytes;
+	header.node_count = nodes.size();
+	header.checksum = murmur3_128(out.data() + sizeof(header), out.size() - sizeof(header), 0).lo;
+	std::memcpy(out.data(), &header, sizeof(header));
+	return out;
+}
+
+// the tree in a snapshot, or nullopt if it is not a valid snapshot with the given key
+template <typename Value>
+std::optional<Value> decode_snapshot(char const* data, std::size_t size, std::uint64_t key) {
+	using table_type = typename Value::table_type;
+	using array_type = typename Value::array_type;
+	snapshot_header header;
+	if (size < sizeof(header)) {
+		return std::nullopt;
+	}
+	std::memcpy(&header, data, sizeof(header));
+	if (std::memcmp(header.magic, snapshot_magic, 8) != 0 ||
+		header.version != snapshot_version || header.byte_order != snapshot_byte_order ||
+		header.key != key || header.string_count >= snapshot_no_key ||
+		header.string_bytes % 8 != 0 || header.node_count == 0) {
+		return std::nullopt;
+	}
+	// each section is checked against the bytes left, so that no size overflows
+	std::size_t rest = size - sizeof(header);
+	if (header.string_count + 1 > rest / 8) {
+		return std::nullopt;
+	}
+	rest -= (header.string_count + 1) * 8;
+	if (header.string_bytes > rest) {
+		return std::nullopt;
+	}
+	rest -= header.string_bytes;
+	if (rest % sizeof(snapshot_node) != 0 || rest / sizeof(snapshot_node) != header.node_count) {
+		return std::nullopt;
+	}
+	if (murmur3_128(data + sizeof(header), size - sizeof(header), 0).lo != header.checksum) {
+		return std::nullopt;
+	}
+
+	char const* offsets = data + sizeof(header);
+	char const* chars = offsets + (header.string_count + 1) * 8;
+	char const* node_data = chars + header.string_bytes;
+	std::vector<std::string_view> strings(header.string_count);
+	std::uint64_t first;
+	std::memcpy(&first, offsets, 8);
+	for (std::size_t i = 0; i < strings.size(); i++) {
+		std::uint64_t last;
+		std::memcpy(&last, offsets + (i + 1) * 8, 8);
+		if (first > last || last > header.string_bytes) {
+			return std::nullopt;
+		}
+		strings[i] = std::string_view(chars + first, last - first);
+		first = last;
+	}
+
+	// the containers being filled, with the number of elements they still expect
+	struct frame {
+		Value* val;
+		std::uint32_t remaining;
+	};
+	std::vector<frame> stack;
+	Value root;
+	for (std::size_t i = 0; i < header.node_count; i++) {
+		snapshot_node node;
+		std::memcpy(&node, node_data + i * sizeof(snapshot_node), sizeof(node));
+		Value* val = &root;
+		if (i > 0) {
+			if (stack.empty()) {
+				return std::nullopt;
+			}
+			auto& parent = stack.back();
+			if (parent.val->is_table()) {
+				if (node.key >= strings.size()) {
+					return std::nullopt;
+				}
+				auto [it, inserted] =
+					parent.val->as_table().emplace(toml::key(strings[node.key]), Value());
+				if (!inserted) {
+					return std::nullopt;
+				}
+				val = &it->second;
+			} else {
+				val = &parent.val->as_array().emplace_back();
+			}
+			if (--parent.remaining == 0) {
+				stack.pop_back();
+			}
+		}
+		switch (static_cast<toml::value_t>(node.type)) {
+			case toml::value_t::boolean:
+				*val = Value(node.payload != 0);
+				break;
+			case toml::value_t::integer: {
+				std::int64_t n;
+				std::memcpy(&n, &node.payload, 8);
+				*val = Value(static_cast<toml::integer>(n));
+				break;
+			}
+			case toml::value_t::floating: {
+				double f;
+				std::memcpy(&f, &node.payload, 8);
+				*val = Value(static_cast<toml::floating>(f));
+				break;
+			}
+			case toml::value_t::string:
+				if (node.payload >= strings.size() || node.kind > 1) {
+					return std::nullopt;
+				}
+				*val = Value(toml::string(std::string(strings[node.payload]),
+										  static_cast<toml::string_t>(node.kind)));
+				break;
+			case toml::value_t::offset_datetime: {
+				toml::offset_datetime dt;
+				dt.date = unpack_date(node.aux);
+				dt.time = unpack_time(node);
+				dt.offset.hour = node.offset_hour;
+				dt.offset.minute = node.offset_minute;
+				*val = Value(dt);
+				break;
+			}
+			case toml::value_t::local_datetime: {
+				toml::local_datetime dt;
+				dt.date = unpack_date(node.aux);
+				dt.time = unpack_time(node);
+				*val = Value(dt);
+				break;
+			}
+			case toml::value_t::local_date:
+				*val = Value(unpack_date(node.aux));
+				break;
+			case toml::value_t::local_time:
+				*val = Value(unpack_time(node));
+				break;
+			case toml::value_t::array:
+			case toml::value_t::table:
+				if (node.aux > header.node_count - i - 1) {
+					return std::nullopt;
+				}
+				if (node.type == static_cast<std::uint8_t>(toml::value_t::array)) {
+					*val = Value(array_type{});
+					val->as_array().reserve(node.aux);
+				} else {
+					*val = Value(table_type{});
+					val->as_table().reserve(node.aux);
+				}
+				if (node.aux > 0) {
+					stack.push_back(frame{val, node.aux});
+				}
+				break;
+			default:
+				return std::nullopt;
+		}
+	}
+	if (!stack.empty() || !root.is_table()) {
+		return std::nullopt;
+	}
+	return root;
+}
+}  // namespace detail
+
+/// <summary>
+/// Key of a snapshot of the config resolved from filenames with ctx: a hash of the contents of
+/// the files, the names and flags of the resolvers in ctx, its max_depth and max_nesting, the
+/// snapshot version and salt. The implementations of the resolvers are not covered, so salt
+/// should change with them, e.g. be the version of the program that registers them. Neither is
+/// what impure resolvers read, e.g. environment variables.
+/// </summary>
+template <typename Value = toml::value>
+std::uint64_t snapshot_key(std::vector<std::string> const& filenames, context<Value> const& ctx,
+						   std::string_view salt = {}) {
+	std::uint64_t h =
+		detail::hash_words(0, {snapshot_version, ctx.max_depth(), ctx.max_nesting()}).lo;
+	for (auto const& filename : filenames) {
+		const detail::mapped_file file(filename);
+		h = detail::murmur3_128(file.data(), file.size(), h).lo;
+	}
+	auto const resolvers = ctx.resolvers();
+	std::vector<std::pair<std::string const*, unsigned>> names;
+	for (auto const& [name, entry] : *resolvers) {
+		names.emplace_back(&name, entry.flags);
+	}
+	std::sort(names.begin(), names.end(),
+			  [](auto const& l, auto const& r) { return *l.first < *r.first; });
+	for (auto const& [name, flags] : names) {
+		h = detail::murmur3_128(name->data(), name->size(), h).lo;
+		h = detail::hash_words(h, {flags}).lo;
+	}
+	return detail::murmur3_128(salt.data(), salt.size(), h).lo;
+}
+
+/// <summary>
+/// Writes cfg, a resolved config, to filename in the binary snapshot format, with key for
+/// load_snapshot to check. Comments and source regions are not saved. The file is written
+/// under a temporary name and then renamed, so concurrent loaders see either the old or the
+/// new snapshot.
+/// </summary>
+template <typename Value = toml::value>
+void save_snapshot(Value const& cfg, std::string const& filename, std::uint64_t key = 0) {
+	if (!cfg.is_table()) {
+		throw std::runtime_error("tomlex::save_snapshot: the root is not a table");
+	}
+	const auto bytes = detail::encode_snapshot(cfg, key);
+	const auto tmp = filename + "." +
+					 std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+									static_cast<std::size_t>(std::chrono::steady_clock::now()
+																 .time_since_epoch()
+																 .count())) +
+					 ".tmp";
+	{
+		std::ofstream ofs(tmp, std::ios_base::binary | std::ios_base::trunc);
+		ofs.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+		if (!ofs.good()) {
+			ofs.close();
+			std::remove(tmp.c_str());
+			throw std::runtime_error("tomlex::save_snapshot: cannot write " + tmp);
+		}
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmp, filename, ec);
+	if (ec) {
+		std::remove(tmp.c_str());
+		throw std::runtime_error("tomlex::save_snapshot: cannot rename " + tmp + " to " +
+								 filename + ": " + ec.message());
+	}
+}
+
+/// <summary>
+/// The config saved by save_snapshot in filename, read in place from a mapping of the file.
+/// Returns nullopt if the file does not exist, is not a snapshot of this version, is
+/// corrupted, or was saved with another key, so that the caller can parse the sources instead.
+/// </summary>
+template <typename Value = toml::value>
+std::optional<Value> load_snapshot(std::string const& filename, std::uint64_t key = 0) {
+	std::optional<detail::mapped_file> file;
+	try {
+		file.emplace(filename);
+	} catch (std::runtime_error&) {
+		return std::nullopt;
+	}
+	return detail::decode_snapshot<Value>(file->data(), file->size(), key);
+}
+
+/// <summary>
+/// The config resolved from filenames, merged in order, as tomlex::merge and tomlex::resolve
+/// would give it. It is loaded from the snapshot file if that was saved from the same files,
+/// resolvers and salt (see snapshot_key); otherwise the files are parsed and the snapshot is
+/// saved again. A snapshot that cannot be written, e.g. in a read-only directory, is skipped.
+/// </summary>
+template <typename Value = toml::value>
+Value parse_with_snapshot(std::vector<std::string> const& filenames, std::string const& snapshot,
+						  context<Value> const& ctx, std::string_view salt = {}) {
+	const auto key = snapshot_key(filenames, ctx, salt);
+	if (auto cfg = load_snapshot<Value>(snapshot, key)) {
+		return std::move(*cfg);
+	}
+	std::vector<Value> layers;
+	layers.reserve(filenames.size());
+	for (auto const& filename : filenames) {
+		layers.push_back(detail::parse_file<Value>::parse(filename));
+	}
+	auto cfg = tomlex::resolve<Value>(tomlex::merge(std::move(layers)), ctx);
+	try {
+		save_snapshot(cfg, snapshot, key);
+	} catch (std::runtime_error&) {
+	}
+	return cfg;
+}
+template <typename Value = toml::value>
+Value parse_with_snapshot(std::vector<std::string> const& filenames,
+						  std::string const& snapshot) {
+	return tomlex::parse_with_snapshot<Value>(filenames, snapshot, default_context<Value>());
+}
+}  // namespace tomlex
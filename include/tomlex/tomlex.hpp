@@ -1,19 +1,44 @@
 ﻿#pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <sstream>
-#include <stack>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <toml.hpp>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
+#include <variant>
 #include <vector>
 
 #include "serializer.hpp"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TOMLEX_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace tomlex {
 namespace utils {
 // https://stackoverflow.com/questions/3418231/replace-part-of-a-string-with-another-string
@@ -65,374 +90,3289 @@ inline std::string_view trim(std::string_view s, const char* t = ws) {
 	return ltrim(rtrim(s, t), t);
 }
 
+#if defined(TOMLEX_SSE2)
+inline unsigned count_trailing_zeros(unsigned mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<unsigned>(index);
+#else
+	return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+#endif
+
+// position of the first '$' in s, or npos; compares 32 or 16 bytes at a time where possible
+inline std::size_t find_dollar(std::string_view s) {
+	const char* const data = s.data();
+	const std::size_t size = s.size();
+	std::size_t i = 0;
+#if defined(__AVX2__)
+	const __m256i dollar32 = _mm256_set1_epi8('$');
+	for (; i + 32 <= size; i += 32) {
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		const auto mask =
+			static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, dollar32)));
+		if (mask != 0) {
+			return i + count_trailing_zeros(mask);
+		}
+	}
+#endif
+#if defined(TOMLEX_SSE2)
+	const __m128i dollar16 = _mm_set1_epi8('$');
+	for (; i + 16 <= size; i += 16) {
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		const auto mask =
+			static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dollar16)));
+		if (mask != 0) {
+			return i + count_trailing_zeros(mask);
+		}
+	}
+#endif
+	if (i < size) {
+		if (auto p = static_cast<const char*>(std::memchr(data + i, '$', size - i))) {
+			return static_cast<std::size_t>(p - data);
+		}
+	}
+	return std::string_view::npos;
+}
+
+// true if s contains "${"; most strings have no '$' at all and are rejected by a single scan
+inline bool has_interpolation(std::string_view s) {
+	for (auto pos = find_dollar(s); pos != std::string_view::npos;) {
+		if (pos + 1 < s.size() && s[pos + 1] == '{') {
+			return true;
+		}
+		s.remove_prefix(pos + 1);
+		pos = find_dollar(s);
+	}
+	return false;
+}
+
 }  // namespace utils
 
-// foward decl
+/// <summary>
+/// Exception thrown by tomlex::merge, tomlex::resolve and tomlex::from_dotted_keys, and the error
+/// returned by their try_ variants. What went wrong is kept as data: the key path, the expected
+/// and actual types of a type mismatch, the source region of the value, and the strings that
+/// were being resolved. The message is formatted from them only when
+/// what() is called, so that failures expected by the caller cost little. Copies share the data.
+/// </summary>
+class error : public std::runtime_error {
+   public:
+	enum class code {
+		type_mismatch,
+		key_not_found,
+		circular_reference,
+		unknown_resolver,
+		syntax_error,
+		max_depth_exceeded,
+		other,	// e.g. an exception thrown by a resolver
+	};
+
+	error(code kind, std::string function, std::string message)
+		: std::runtime_error(std::string()), data_(std::make_shared<data>()) {
+		data_->kind = kind;
+		data_->function = std::move(function);
+		data_->message = std::move(message);
+	}
+
+	code kind() const noexcept { return data_->kind; }
+	// the function that failed, e.g. "tomlex::merge"; empty if the error came from elsewhere
+	std::string const& function() const noexcept { return data_->function; }
+	// the message without the function, the path, the region and the strings being resolved
+	std::string const& message() const noexcept { return data_->message; }
+	// keys from the root to the value, e.g. {"a", "b", "[0]"}
+	std::vector<std::string> path() const {
+		return std::vector<std::string>(data_->reversed_path.rbegin(),
+										data_->reversed_path.rend());
+	}
+	// type_mismatch: the type in the base and the type that was given
+	std::optional<toml::value_t> expected() const noexcept { return data_->expected; }
+	std::optional<toml::value_t> actual() const noexcept { return data_->actual; }
+	// where the value was read, if it was parsed from a file
+	std::optional<toml::source_location> const& region() const noexcept { return data_->region; }
+	// strings that were being resolved, innermost first
+	std::vector<std::string> const& trace() const noexcept { return data_->trace; }
+
+	char const* what() const noexcept override {
+		try {
+			std::call_once(data_->formatted, [this] { data_->what = format(); });
+			return data_->what.c_str();
+		} catch (...) {
+			return data_->message.c_str();
+		}
+	}
+
+	// used while the error propagates
+	error& set_types(toml::value_t expected, toml::value_t actual) {
+		data_->expected = expected;
+		data_->actual = actual;
+		return *this;
+	}
+	error& set_region(toml::source_location loc) {
+		if (loc.file_name() != "unknown file") {
+			data_->region = std::move(loc);
+		}
+		return *this;
+	}
+	error& prepend_key(std::string key) {
+		data_->reversed_path.push_back(std::move(key));
+		return *this;
+	}
+	error& add_trace(std::string str) {
+		data_->trace.push_back(std::move(str));
+		return *this;
+	}
+	// e.g. the override or the line of a file that failed, shown before the message
+	error& prepend_context(std::string text) {
+		data_->context = std::move(text) + ": " + data_->context;
+		return *this;
+	}
+
+   private:
+	struct data {
+		code kind = code::other;
+		std::string context;
+		std::string function;
+		std::string message;
+		std::vector<std::string> reversed_path;
+		std::optional<toml::value_t> expected;
+		std::optional<toml::value_t> actual;
+		std::optional<toml::source_location> region;
+		std::vector<std::string> trace;
+		std::once_flag formatted;
+		std::string what;
+	};
+
+	std::string format() const {
+		std::ostringstream oss;
+		oss << data_->context;
+		if (!data_->function.empty()) {
+			oss << data_->function << ": ";
+		}
+		oss << data_->message;
+		if (data_->expected && data_->actual) {
+			oss << " (expected " << *data_->expected << ", but " << *data_->actual << ')';
+		}
+		if (!data_->reversed_path.empty()) {
+			oss << " at \"";
+			for (auto it = data_->reversed_path.rbegin(); it != data_->reversed_path.rend(); ++it) {
+				if (it != data_->reversed_path.rbegin() && it->front() != '[') {
+					oss << '.';
+				}
+				oss << *it;
+			}
+			oss << '"';
+		}
+		if (data_->region) {
+			oss << std::endl
+				<< " --> " << data_->region->file_name() << ':' << data_->region->line()
+				<< std::endl
+				<< " | " << data_->region->line_str();
+		}
+		auto ret = oss.str();
+		// each string being resolved nests the message; a long chain shows only the innermost
+		// ones and the one that started it
+		constexpr std::size_t shown = 8;
+		auto const& trace = data_->trace;
+		for (std::size_t i = 0; i < trace.size(); i++) {
+			if (i < shown || i + 1 == trace.size()) {
+				std::ostringstream nested;
+				utils::replace_all(ret, "\n", "\n  ");
+				nested << "error while processing " << toml::value(trace[i]) << std::endl
+					   << "  " << ret;
+				ret = nested.str();
+			} else if (i == shown) {
+				ret = "... (" + std::to_string(trace.size() - shown - 1) + " more)\n" + ret;
+			}
+		}
+		return ret;
+	}
+
+	std::shared_ptr<data> data_;
+};
+
+/// <summary>
+/// Resolved values of the strings of a root that contain "${...}", keyed by the address of their
+/// node. A cache is only valid for the root it was filled from, and only while that root is alive
+/// and unmodified.
+/// </summary>
+template <typename Value = toml::value>
+using resolve_cache = std::unordered_map<Value const*, Value>;
+
 namespace detail {
+// resolve_cache shared by resolutions on several threads, e.g. those of a lazy_config. Entries
+// are never erased or modified, so a reference to one stays valid without the lock
 template <typename Value>
-Value resolve_impl(Value&& val, Value const& root_,
-				   std::unordered_set<std::string>& interpolating_);
-template <typename Value>
-Value parse_toml_literal(toml::detail::location loc);
+struct shared_cache {
+	std::shared_mutex mutex;
+	resolve_cache<Value> values;
+};
 }  // namespace detail
 
+/// <summary>
+/// Flattened view of a table that maps the dotted key of every entry ("a.b.c") to its node, so
+/// that a lookup is a single hash probe. Entries whose own key contains '.' are not indexed.
+/// The index points into root: rebuild it after root is modified, moved or destroyed.
+/// </summary>
+template <typename Value = toml::value>
+class index {
+   public:
+	index() = default;
+	explicit index(Value const& root) { rebuild(root); }
+	index(index const& other) : index() {
+		if (other.root_ != nullptr) {
+			rebuild(*other.root_);
+		}
+	}
+	index(index&&) = default;
+	index& operator=(index other) {
+		root_ = other.root_;
+		keys_.swap(other.keys_);
+		nodes_.swap(other.nodes_);
+		return *this;
+	}
+
+	void rebuild(Value const& root) {
+		if (!root.is_table()) {
+			std::ostringstream msg;
+			msg << "tomlex::index: following value must be a table, but " << root.type()
+				<< std::endl
+				<< root;
+			throw std::runtime_error(msg.str());
+		}
+		root_ = &root;
+		keys_.clear();
+		nodes_.clear();
+		add_tables(root);
+	}
+
+	Value const* find(std::string_view dotted_key) const {
+		auto it = nodes_.find(dotted_key);
+		return it == nodes_.end() ? nullptr : it->second;
+	}
+	Value const& at(std::string_view dotted_key) const {
+		if (auto node = find(dotted_key)) {
+			return *node;
+		}
+		throw std::runtime_error("tomlex::index::at: key \"" + std::string(dotted_key) +
+								 "\" is not found");
+	}
+	bool contains(std::string_view dotted_key) const { return find(dotted_key) != nullptr; }
+	std::size_t size() const { return nodes_.size(); }
+	Value const* root() const { return root_; }
+
+   private:
+	// walks the tables with a stack of their keys rather than recursion, so that deep nesting
+	// cannot overflow the call stack
+	void add_tables(Value const& root) {
+		std::vector<std::pair<Value const*, std::string_view>> tables{{&root, {}}};
+		while (!tables.empty()) {
+			const auto [table, prefix] = tables.back();
+			tables.pop_back();
+			for (auto const& [k, v] : table->as_table()) {
+				if (k.find('.') != std::string::npos) {
+					continue;
+				}
+				std::string path(prefix);
+				if (table != &root) {
+					path += '.';
+				}
+				path += k;
+				std::string_view key = keys_.emplace_back(std::move(path));
+				nodes_.emplace(key, &v);
+				if (v.is_table()) {
+					tables.emplace_back(&v, key);
+				}
+			}
+		}
+	}
+
+	Value const* root_ = nullptr;
+	std::deque<std::string> keys_;	// owns the keys of nodes_
+	std::unordered_map<std::string_view, Value const*> nodes_;
+};
+
+/// <summary>
+/// Option of tomlex::resolve: resolves the top-level sections of the root on a thread pool.
+/// Sections are scheduled after the sections they reference, and sections that reference each
+/// other are resolved together. The workers take the tasks whose dependencies are done from
+/// one shared ready queue; a task is a whole section, so there are few of them. Sections with
+/// keys built at resolution, e.g. "${${name}}", and sections whose task fails, e.g. on a key
+/// that only a resolver's result references, are resolved afterwards on the calling thread.
+/// That pass reuses the strings that the other tasks resolved, and the strings that a failed
+/// task completed before it failed, so their resolvers are not called again. A string whose
+/// evaluation failed partway is evaluated again, with the resolvers it had already called.
+/// Registered resolvers must be safe to call concurrently.
+/// </summary>
+struct parallel {
+	// 0: std::thread::hardware_concurrency()
+	unsigned threads = 0;
+};
+
+/// <summary>
+/// How tomlex::merge combines an array of the base with the array of the same key in the
+/// overlay. replace: the array of the overlay replaces it. append: the elements of the overlay
+/// are appended. by_index: element i of the overlay is merged into element i of the base, and
+/// the rest of the overlay is appended (an error if strict).
+/// </summary>
+enum class array_merge { replace, append, by_index };
+
+/// <summary>
+/// Default of context::max_depth.
+/// </summary>
+inline constexpr std::size_t default_max_depth = 100000;
+/// <summary>
+/// Default of context::max_nesting. A level takes up to about 3 KB of call stack in an optimized
+/// build, so that the default fits in the 512 KB stack of a secondary thread on macOS.
+/// </summary>
+inline constexpr std::size_t default_max_nesting = 100;
+
 template <typename Value = toml::value>
 using resolver_type = std::function<Value(Value&&)>;
 
+/// <summary>
+/// Flags of a resolver given to register_resolver, combined with |.
+/// pure: the result depends only on the argument, so it is computed once per argument and
+/// reused by the rest of the resolution (see resolver_memo).
+/// reparse_arguments: an argument that is a single expression, as in "${f: ${x}}", is printed
+/// and parsed as a TOML value like any other argument, so that a string x = "[1, 2]" is passed
+/// as an array. Without it, the value of x is passed as it is.
+/// </summary>
+enum resolver_flags : unsigned {
+	impure = 0u,
+	pure = 1u << 0,
+	reparse_arguments = 1u << 1,
+};
+constexpr resolver_flags operator|(resolver_flags lhs, resolver_flags rhs) noexcept {
+	return static_cast<resolver_flags>(static_cast<unsigned>(lhs) | static_cast<unsigned>(rhs));
+}
+
 template <typename Value = toml::value>
-static inline std::unordered_map<std::string, resolver_type<Value>> resolver_table;
+struct resolver_entry {
+	resolver_type<Value> func;
+	resolver_flags flags = impure;
+};
 
-// decay_tしないとうまくオーバーロード解決できない
 template <typename Value = toml::value>
-void register_resolver(std::string const& resolver_name,
-					   std::decay_t<resolver_type<Value>> const& func) {
-	if (resolver_name.empty()) {
-		throw std::runtime_error("tomlex::register_resolver: empty resolver_type name");
+using resolver_map = std::unordered_map<std::string, resolver_entry<Value>>;
+
+/// <summary>
+/// Results of pure resolvers, keyed by the resolver name and the serialized argument. Every
+/// resolution uses its own unless one is given to tomlex::resolve, which shares the results
+/// across resolutions; clear it after a pure resolver is registered again under the same name.
+/// It may be shared between threads.
+/// </summary>
+template <typename Value = toml::value>
+class resolver_memo {
+   public:
+	resolver_memo() = default;
+	resolver_memo(resolver_memo const&) = delete;
+	resolver_memo& operator=(resolver_memo const&) = delete;
+
+	// returns the stored result for key, or stores and returns call()
+	template <typename F>
+	Value get_or_call(std::string key, F&& call) {
+		if (auto result = find(key)) {
+			return std::move(*result);
+		}
+		Value result = call();
+		insert(std::move(key), result);
+		return result;
+	}
+
+	// the stored result for key, if any
+	std::optional<Value> find(std::string const& key) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (auto it = results_.find(key); it != results_.end()) {
+			hits_++;
+			return it->second;
+		}
+		misses_++;
+		return std::nullopt;
+	}
+	void insert(std::string key, Value const& result) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		results_.emplace(std::move(key), result);
+	}
+
+	std::size_t hits() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return hits_;
+	}
+	std::size_t misses() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return misses_;
+	}
+	std::size_t size() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return results_.size();
+	}
+	void clear() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		results_.clear();
+		hits_ = misses_ = 0;
+	}
+
+   private:
+	mutable std::mutex mutex_;
+	std::unordered_map<std::string, Value> results_;
+	std::size_t hits_ = 0;
+	std::size_t misses_ = 0;
+};
+
+namespace detail {
+/// <summary>
+/// A part of a string value: either literal text or a "${...}" expression. The body of an
+/// expression is a list of parts itself, since it may contain nested expressions ("${a.${b}}").
+/// </summary>
+struct interp_part {
+	bool is_expr = false;
+	std::string text;				// literal text
+	std::vector<interp_part> body;	// expression body
+};
+
+/// <summary>
+/// A string value parsed into literal text and expressions by compile_string.
+/// </summary>
+struct interp_string {
+	std::vector<interp_part> parts;
+	// keys referenced by "${key}", including nested ones; resolver calls are not included
+	std::vector<std::string> references;
+	// a key or a resolver name is built from a nested expression, e.g. "${${name}}"
+	bool has_dynamic_reference = false;
+	// "${" without a matching "}" was kept as literal text
+	bool unclosed = false;
+
+	bool has_expr() const {
+		return std::any_of(parts.begin(), parts.end(), [](auto const& p) { return p.is_expr; });
+	}
+};
+
+/// <summary>
+/// Nodes marked with a number, e.g. their position on a work stack, in a flat open-addressing
+/// table. It keeps its storage when marks are removed, so that marking and unmarking nodes
+/// allocates nothing once it has grown to the most marks alive at the same time.
+/// </summary>
+template <typename Value>
+class node_marks {
+   public:
+	std::size_t const* find(Value const* node) const {
+		if (size_ == 0) {
+			return nullptr;
+		}
+		for (auto i = home(node);; i = next(i)) {
+			if (slots_[i].node == node) {
+				return &slots_[i].mark;
+			}
+			if (slots_[i].node == nullptr) {
+				return nullptr;
+			}
+		}
+	}
+	// node must not be marked
+	void insert(Value const* node, std::size_t mark) {
+		if ((size_ + 1) * 2 > slots_.size()) {
+			grow();
+		}
+		auto i = home(node);
+		while (slots_[i].node != nullptr) {
+			i = next(i);
+		}
+		slots_[i] = slot{node, mark};
+		size_++;
+	}
+	// node must be marked
+	void erase(Value const* node) {
+		auto i = home(node);
+		while (slots_[i].node != node) {
+			i = next(i);
+		}
+		// shift back the following slots that would not be found past the hole
+		for (auto j = next(i); slots_[j].node != nullptr; j = next(j)) {
+			const auto mask = slots_.size() - 1;
+			if (((j - home(slots_[j].node)) & mask) >= ((j - i) & mask)) {
+				slots_[i] = slots_[j];
+				i = j;
+			}
+		}
+		slots_[i] = slot{};
+		size_--;
+	}
+
+   private:
+	struct slot {
+		Value const* node = nullptr;
+		std::size_t mark = 0;
+	};
+
+	std::size_t home(Value const* node) const {
+		auto h = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(node)) *
+				 0x9E3779B97F4A7C15ull;
+		return static_cast<std::size_t>(h ^ (h >> 32)) & (slots_.size() - 1);
+	}
+	std::size_t next(std::size_t i) const { return (i + 1) & (slots_.size() - 1); }
+
+	void grow() {
+		std::vector<slot> old(slots_.empty() ? 16 : slots_.size() * 2);
+		old.swap(slots_);
+		size_ = 0;
+		for (auto const& s : old) {
+			if (s.node != nullptr) {
+				insert(s.node, s.mark);
+			}
+		}
+	}
+
+	std::vector<slot> slots_;
+	std::size_t size_ = 0;
+};
+
+// A string of the root that a pending_string waits for, referenced by "${key}"
+template <typename Value>
+struct dependency {
+	Value const* node = nullptr;
+	std::string_view key;
+	// node is the table or array that key references, and comes after its strings: it is fully
+	// resolved once they are
+	bool subtree = false;
+};
+
+// A string of the root on the work stack of resolve_root_string
+template <typename Value>
+struct pending_string {
+	Value const* node = nullptr;
+	std::string_view key;  // that referenced node; empty for the string that started
+	// nullptr for a string evaluated from its text by evaluate_flat
+	interp_string const* compiled = nullptr;
+	std::unique_ptr<interp_string> parsed;	// compiled, unless it was precompiled
+	// its dependencies in resolve_state::dependencies; dependencies[next] is the next to resolve
+	std::size_t first_dependency = 0;
+	std::size_t next = 0;
+	std::size_t last_dependency = 0;
+	// a dependency was left to the evaluation, so a subtree may not be fully resolved
+	bool skipped = false;
+};
+
+template <typename Value>
+struct resolve_state {
+	Value const& root;
+	resolve_cache<Value>& cache;
+	resolver_map<Value> const& resolvers;
+	// used instead of cache if given; other threads add to it while this resolution runs
+	shared_cache<Value>* shared = nullptr;
+	// nodes being interpolated, outermost first, with the keys that referenced them; the keys
+	// point into the expressions being evaluated
+	std::vector<std::pair<Value const*, std::string_view>> interpolating{};
+	// position of each node of interpolating
+	node_marks<Value> interpolating_at{};
+	// dotted keys of root; built on the first interpolation unless given
+	index<Value> const* keys = nullptr;
+	std::optional<index<Value>> own_keys{};
+	// strings precompiled by tomlex::compile, keyed by the address of their node in root
+	std::unordered_map<Value const*, interp_string const*> const* compiled = nullptr;
+	// parallel resolution: top-level sections visible from the current one, keyed by their key
+	std::unordered_map<std::string_view, Value const*> const* sections = nullptr;
+	// results of pure resolvers; created on the first call unless given
+	resolver_memo<Value>* memo = nullptr;
+	std::optional<resolver_memo<Value>> own_memo{};
+	// strings and resolver results being resolved, nested or waiting for what they reference
+	std::size_t depth = 0;
+	std::size_t max_depth = default_max_depth;
+	// evaluations nested on the call stack
+	std::size_t nesting = 0;
+	std::size_t max_nesting = default_max_nesting;
+
+	// The stacks below are kept for the whole resolution, so that they stop allocating once they
+	// have grown. A nested call of a function pushes above the entries of the calls it is nested
+	// in, and leaves the stack as it found it.
+
+	// work stack of resolve_root_string: the strings of root that wait for the strings they
+	// reference, with the position of each on it, and their dependencies, in the same order
+	std::vector<pending_string<Value>> pending{};
+	node_marks<Value> pending_at{};
+	std::vector<dependency<Value>> dependencies{};
+	// tables and arrays of root whose strings are all resolved
+	node_marks<Value> resolved_subtrees{};
+	// nodes to visit by the tree walks that resolve, with the node they are a copy of, if any
+	std::vector<std::pair<Value*, Value const*>> walk{};
+	// nodes to visit by the tree walks that only read, which are never nested
+	std::vector<Value const*> scan{};
+	// item of a dotted key being looked up by find_dotted, which table_type::find takes as a
+	// std::string
+	std::string key_item{};
+};
+
+// foward decl
+template <typename Value>
+toml::result<Value, error> resolve_impl(Value&& val, resolve_state<Value>& state_,
+										bool in_root = false);
+template <typename Value>
+toml::result<Value, error> resolve_node(Value const& src, resolve_state<Value>& state_);
+template <typename Value>
+toml::result<Value, std::string> parse_toml_literal(toml::detail::location loc);
+template <typename Value>
+std::optional<error> add_override(typename Value::table_type& table, std::string_view arg);
+inline interp_string compile_string(std::string const& src);
+template <typename Value>
+void warn_unclosed(Value const& val);
+template <typename Value>
+toml::result<Value, error> evaluate_string(interp_string const& compiled, Value const& val,
+										   resolve_state<Value>& state_);
+template <typename Value>
+toml::result<Value, error> resolve_serial(Value&& root, resolver_map<Value> const& resolvers,
+										  std::size_t max_depth, std::size_t max_nesting,
+										  resolver_memo<Value>* memo = nullptr);
+
+// toml::parse for the Comment, Table and Array parameters of Value
+template <typename Value>
+struct parse_file;
+template <typename C, template <typename...> class T, template <typename...> class A>
+struct parse_file<toml::basic_value<C, T, A>> {
+	template <typename U>
+	static toml::basic_value<C, T, A> parse(U&& filename) {
+		return toml::parse<C, T, A>(std::forward<U>(filename));
+	}
+};
+template <typename Value, typename Overlay>
+std::optional<error> merge_root(Value& base, Overlay&& overlay, bool strict, array_merge arrays);
+template <typename Value>
+std::optional<error> merge_layers_root(std::vector<Value>& layers, bool strict,
+									   array_merge arrays);
+template <typename Value>
+std::size_t strip_sources(Value& root, bool comments);
+template <typename Value>
+toml::result<Value, error> resolve_parallel(Value&& root, resolver_map<Value> const& resolvers,
+											std::size_t max_depth, std::size_t max_nesting,
+											parallel const& options,
+											resolver_memo<Value>* memo = nullptr);
+
+// e as a tomlex::error; the other exceptions keep only their message
+inline error to_error(std::exception const& e) {
+	if (auto p = dynamic_cast<error const*>(&e)) {
+		return *p;
+	}
+	if (dynamic_cast<toml::syntax_error const*>(&e)) {
+		return error(error::code::syntax_error, "", e.what());
+	}
+	return error(error::code::other, "", e.what());
+}
+
+// the value returned by f, or the exception that it threw
+template <typename Value, typename F>
+toml::result<Value, error> catch_error(F&& f) {
+	try {
+		return toml::ok(f());
+	} catch (std::exception& e) {
+		return toml::err(to_error(e));
+	} catch (...) {
+		return toml::err(error(error::code::other, "", "unknown exception"));
 	}
-	if (auto it = resolver_table<Value>.find(resolver_name); it != resolver_table<Value>.end()) {
-		throw std::runtime_error("tomlex::register_resolver: resolver_type \"" + resolver_name +
-								 "\" is already registered");
+}
+
+template <typename Value>
+Value value_or_throw(toml::result<Value, error>&& res) {
+	if (res.is_err()) {
+		throw std::move(res.as_err());
+	}
+	return std::move(res.as_ok());
+}
+}  // namespace detail
+
+/// <summary>
+/// A set of resolvers. Each resolution takes a snapshot of the set when it starts, so lookups
+/// never lock, and resolvers can be registered or cleared while other threads are resolving
+/// with the same context. Writers copy the set.
+/// </summary>
+template <typename Value = toml::value>
+class context {
+   public:
+	context() : resolvers_(std::make_shared<resolver_map<Value> const>()) {}
+	context(context const& other)
+		: resolvers_(other.resolvers()),
+		  max_depth_(other.max_depth()),
+		  max_nesting_(other.max_nesting()) {}
+	context& operator=(context const& other) {
+		if (this != &other) {
+			auto snapshot = other.resolvers();
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::atomic_store(&resolvers_, std::move(snapshot));
+			max_depth_ = other.max_depth();
+			max_nesting_ = other.max_nesting();
+		}
+		return *this;
+	}
+
+	void register_resolver(std::string const& resolver_name, resolver_type<Value> const& func,
+						   resolver_flags flags = impure) {
+		if (resolver_name.empty()) {
+			throw std::runtime_error("tomlex::register_resolver: empty resolver_type name");
+		}
+		update([&](resolver_map<Value>& resolvers) {
+			if (resolvers.find(resolver_name) != resolvers.end()) {
+				throw std::runtime_error("tomlex::register_resolver: resolver_type \"" +
+										 resolver_name + "\" is already registered");
+			}
+			resolvers[resolver_name] = resolver_entry<Value>{func, flags};
+		});
+	}
+
+	void clear_resolvers() {
+		update([](resolver_map<Value>& resolvers) { resolvers.clear(); });
+	}
+
+	void clear_resolver(std::string const& func_name) {
+		update([&](resolver_map<Value>& resolvers) {
+			if (resolvers.erase(func_name) == 0) {
+				throw std::runtime_error("tomlex::clear_resolver: specified resolver_name \"" +
+										 func_name + "\" is not found");
+			}
+		});
+	}
+
+	// snapshot of the registered resolvers; later changes to the context do not affect it
+	std::shared_ptr<resolver_map<Value> const> resolvers() const {
+		return std::atomic_load(&resolvers_);
+	}
+
+	// Maximum number of interpolations that wait on each other, e.g. the length of a chain
+	// a = "${b}", b = "${c}", ...; a longer one fails with an error instead of exhausting memory.
+	void set_max_depth(std::size_t max_depth) { max_depth_ = max_depth; }
+	std::size_t max_depth() const { return max_depth_; }
+
+	// Maximum number of evaluations that are nested on the call stack: keys built at resolution,
+	// e.g. "${${name}}", results of resolvers that contain "${...}", and nested expressions such
+	// as "${f: ${g: ...}}". A deeper nesting fails with an error instead of overflowing the stack.
+	void set_max_nesting(std::size_t max_nesting) { max_nesting_ = max_nesting; }
+	std::size_t max_nesting() const { return max_nesting_; }
+
+   private:
+	template <typename F>
+	void update(F&& modify) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto resolvers = std::make_shared<resolver_map<Value>>(*resolvers_);
+		modify(*resolvers);
+		std::atomic_store(&resolvers_,
+						  std::shared_ptr<resolver_map<Value> const>(std::move(resolvers)));
 	}
-	resolver_table<Value>[resolver_name] = func;
+
+	std::mutex mutex_;	// serializes writers
+	std::shared_ptr<resolver_map<Value> const> resolvers_;
+	std::atomic<std::size_t> max_depth_{default_max_depth};
+	std::atomic<std::size_t> max_nesting_{default_max_nesting};
+};
+
+/// <summary>
+/// The context used by the functions that do not take one.
+/// </summary>
+template <typename Value = toml::value>
+context<Value>& default_context() {
+	static context<Value> ctx;
+	return ctx;
+}
+
+// decay_tしないとうまくオーバーロード解決できない
+template <typename Value = toml::value>
+void register_resolver(std::string const& resolver_name,
+					   std::decay_t<resolver_type<Value>> const& func,
+					   resolver_flags flags = impure) {
+	default_context<Value>().register_resolver(resolver_name, func, flags);
 }
 
 template <typename Value = toml::value>
 void clear_resolvers() {
-	resolver_table<Value>.clear();
+	default_context<Value>().clear_resolvers();
 }
 
 template <typename Value = toml::value>
 void clear_resolver(std::string const& func_name) {
-	if (auto it = resolver_table<Value>.find(func_name); it == resolver_table<Value>.end()) {
-		throw std::runtime_error("tomlex::clear_resolver: specified resolver_name \"" + func_name +
-								 "\" is not found");
+	default_context<Value>().clear_resolver(func_name);
+}
+
+/// <summary>
+/// Merges overlay into base in place. Tables are merged key by key, arrays as the array_merge
+/// policy arrays says, and any other value of overlay replaces the one of base, which must be of
+/// the same type. The values of overlay are moved if it is an rvalue and copied otherwise, and
+/// the values of base that overlay does not have are not touched. If enable_strict_overrwrite,
+/// every key of overlay must exist in base. If an error is thrown, base may be merged partially.
+/// </summary>
+template <typename Value>
+void merge_into(Value& base, Value const& overlay, bool enable_strict_overrwrite = false,
+				array_merge arrays = array_merge::replace) {
+	if (auto e = detail::merge_root(base, overlay, enable_strict_overrwrite, arrays)) {
+		throw std::move(*e);
 	}
-	resolver_table<Value>.erase(func_name);
-}
-
-template <typename Value = toml::value>
-Value merge(Value&& base, Value&& overwrite, bool enable_strict_overrwrite = false) {
-	// note: array is overwritten by "overwrite" obj
-	if (!base.is_table()) {
-		std::ostringstream msg;
-		msg << "tomlex::merge: following value must be a table, but " << base.type() << std::endl
-			<< base;
-		throw std::runtime_error(msg.str());
-	}
-	if (!overwrite.is_table()) {
-		std::ostringstream msg;
-		msg << "tomlex::merge: following value must be a table, but " << overwrite.type()
-			<< std::endl
-			<< overwrite;
-		throw std::runtime_error(msg.str());
-	}
-	auto& base_t = base.as_table();
-	for (auto&& [key, value] : overwrite.as_table()) {
-		// contains
-		if (auto it = base_t.find(key); it != base_t.end()) {
-			auto& base_val = it->second;
-			if (base_val.type() != value.type()) {
-				std::ostringstream msg;
-				msg << "tomlex::merge: type mismatch " << base_val.type() << " and " << value.type()
-					<< std::endl
-					<< base << std::endl
-					<< value;
-				throw std::runtime_error(msg.str());
-			}
-			if (value.is_table()) {
-				base[key] =
-					merge<Value>(std::move(it->second), std::move(value), enable_strict_overrwrite);
-				continue;
-			} else {
-				base[key] = std::move(value);
-				continue;
-			}
-		}
-		if (enable_strict_overrwrite) {
-			std::ostringstream msg;
-			msg << "tomlex::merge: following key does not exist in the base table: \"" << key
-				<< "\"";
-			throw std::runtime_error(msg.str());
-		}
-		base[key] = std::move(value);
+}
+template <typename Value>
+void merge_into(Value& base, Value&& overlay, bool enable_strict_overrwrite = false,
+				array_merge arrays = array_merge::replace) {
+	if (auto e = detail::merge_root(base, std::move(overlay), enable_strict_overrwrite, arrays)) {
+		throw std::move(*e);
 	}
-	return std::move(base);
 }
 
+/// <summary>
+/// Same as merge, but returns the error instead of throwing it. Nothing is thrown on the way:
+/// the error is passed up as a value, so a failure costs about as much as a success.
+/// </summary>
 template <typename Value = toml::value>
-Value from_dotted_keys(std::vector<std::string> const& key_list) {
-	typename Value::table_type ret;
-	for (const auto& key : key_list) {
-		toml::detail::location loc(key, key);
-		ret = merge(std::move(toml::value(ret)), detail::parse_toml_literal<Value>(loc)).as_table();
+toml::result<Value, error> try_merge(Value&& base, Value&& overwrite,
+									 bool enable_strict_overrwrite = false,
+									 array_merge arrays = array_merge::replace) {
+	if (auto e = detail::merge_root(base, std::move(overwrite), enable_strict_overrwrite, arrays)) {
+		return toml::err(std::move(*e));
 	}
-	return ret;
+	return toml::ok(std::move(base));
+}
+template <typename Value = toml::value>
+toml::result<Value, error> try_merge(std::vector<Value> layers,
+									 bool enable_strict_overrwrite = false,
+									 array_merge arrays = array_merge::replace) {
+	if (layers.empty()) {
+		return toml::ok(Value(typename Value::table_type{}));
+	}
+	if (auto e = detail::merge_layers_root(layers, enable_strict_overrwrite, arrays)) {
+		return toml::err(std::move(*e));
+	}
+	return toml::ok(std::move(layers.front()));
 }
 
 template <typename Value = toml::value>
-Value from_cli(const int argc, char const* const argv[], const int first = 1) {
-	if (first >= argc) {
-		throw std::runtime_error("tomlex::from_cli: first < argc must be satisfied");
+Value merge(Value&& base, Value&& overwrite, bool enable_strict_overrwrite = false,
+			array_merge arrays = array_merge::replace) {
+	return detail::value_or_throw(
+		try_merge<Value>(std::move(base), std::move(overwrite), enable_strict_overrwrite, arrays));
+}
+
+/// <summary>
+/// Merges layers, e.g. {defaults, site, host, environment, cli}, in order into the first one,
+/// with the result of merge_into with each layer in turn. The keys of all layers are grouped
+/// first, so the merge takes expected time linear in the total number of keys: each key is
+/// looked up in the merged table once however many layers have it, and a value that a later
+/// layer replaces is not moved into it.
+/// </summary>
+template <typename Value = toml::value>
+Value merge(std::vector<Value> layers, bool enable_strict_overrwrite = false,
+			array_merge arrays = array_merge::replace) {
+	return detail::value_or_throw(
+		try_merge<Value>(std::move(layers), enable_strict_overrwrite, arrays));
+}
+
+/// <summary>
+/// Same as from_dotted_keys, but returns the error instead of throwing it.
+/// </summary>
+template <typename Value = toml::value>
+toml::result<Value, error> try_from_dotted_keys(std::vector<std::string_view> const& key_list) {
+	typename Value::table_type ret;
+	for (const auto key : key_list) {
+		if (auto e = detail::add_override<Value>(ret, key)) {
+			return toml::err(std::move(*e));
+		}
 	}
-	std::vector<std::string> arg_list(argv + first, argv + argc);
-	return from_dotted_keys<Value>(arg_list);
+	return toml::ok(Value(std::move(ret)));
 }
 
 template <typename Value = toml::value>
-Value resolve(Value&& root_) {
-	std::unordered_set<std::string> interpolating_;
-	return detail::resolve_impl(std::move(root_), root_, interpolating_);
+toml::result<Value, error> try_from_dotted_keys(std::vector<std::string> const& key_list) {
+	return try_from_dotted_keys<Value>(
+		std::vector<std::string_view>(key_list.begin(), key_list.end()));
 }
-template <typename Value = toml::value, typename U>
-Value parse(U&& filename) {
-	return tomlex::resolve<Value>(toml::parse(std::forward<U>(filename)));
+
+template <typename Value = toml::value>
+toml::result<Value, error> try_from_dotted_keys(std::initializer_list<std::string_view> key_list) {
+	return try_from_dotted_keys<Value>(std::vector<std::string_view>(key_list));
 }
 
 /// <summary>
-/// toml11の"<<"演算子を参考に、少ない行数で表示できるよう修正した。
-/// コメントは表示しない。
+/// Table of "key = value" overrides such as "a.b.c = 10". Later overrides take precedence, and
+/// tables are merged as by tomlex::merge. Every override is inserted into the same table, so
+/// the cost is linear in the number of overrides.
 /// </summary>
-/// <typeparam name="Value"></typeparam>
-/// <param name="cfg"></param>
-/// <returns></returns>
 template <typename Value = toml::value>
-std::string format(const toml::value& cfg, std::size_t w = 80u, int fprec = 6) {
-	std::string serialized =
-		toml::visit(detail::serializer::serializer_short<Value>(w, fprec, false, true), cfg);
-	return std::string(tomlex::utils::rtrim(serialized));
+Value from_dotted_keys(std::vector<std::string_view> const& key_list) {
+	return detail::value_or_throw(try_from_dotted_keys<Value>(key_list));
 }
 
-namespace detail {
+template <typename Value = toml::value>
+Value from_dotted_keys(std::vector<std::string> const& key_list) {
+	return from_dotted_keys<Value>(
+		std::vector<std::string_view>(key_list.begin(), key_list.end()));
+}
 
-template <typename Value>
-toml::result<Value, std::string> parse_value_strict(toml::detail::location& loc);
+// from_dotted_keys({"a = 1", "b = 2"})
+template <typename Value = toml::value>
+Value from_dotted_keys(std::initializer_list<std::string_view> key_list) {
+	return from_dotted_keys<Value>(std::vector<std::string_view>(key_list));
+}
 
-template <typename Value>
-Value to_toml_value(std::string const& str) {
-	if (str.empty()) {
-		throw std::runtime_error(
-			"tomlex::detail::to_toml_value: cannot convert empty string to toml::value");
+/// <summary>
+/// Same as from_dotted_keys, with one override per line of a file. Empty lines and lines that
+/// start with '#' are skipped.
+/// </summary>
+template <typename Value = toml::value>
+Value from_dotted_keys_file(std::string const& filename) {
+	std::ifstream ifs(filename, std::ios_base::binary);
+	if (!ifs.good()) {
+		throw std::runtime_error("tomlex::from_dotted_keys_file: file open error -> " + filename);
+	}
+	typename Value::table_type ret;
+	std::string line;
+	for (std::size_t line_num = 1; std::getline(ifs, line); line_num++) {
+		const auto arg = utils::trim(line);
+		if (arg.empty() || arg.front() == '#') {
+			continue;
+		}
+		if (auto e = detail::add_override<Value>(ret, arg)) {
+			e->prepend_context(filename + ":" + std::to_string(line_num));
+			throw std::move(*e);
+		}
+	}
+	return ret;
+}
+
+template <typename Value = toml::value>
+toml::result<Value, error> try_from_cli(const int argc, char const* const argv[],
+										const int first = 1) {
+	if (first >= argc) {
+		return toml::err(
+			error(error::code::other, "tomlex::from_cli", "first < argc must be satisfied"));
+	}
+	return try_from_dotted_keys<Value>(std::vector<std::string_view>(argv + first, argv + argc));
+}
+
+template <typename Value = toml::value>
+Value from_cli(const int argc, char const* const argv[], const int first = 1) {
+	return detail::value_or_throw(try_from_cli<Value>(argc, argv, first));
+}
+
+/// <summary>
+/// Same as resolve, with the same options, but returns the error instead of throwing it. An
+/// exception thrown by a resolver is caught and returned as tomlex::error; the other errors are
+/// never thrown.
+/// </summary>
+template <typename Value = toml::value>
+toml::result<Value, error> try_resolve(Value&& root_, context<Value> const& ctx) {
+	return detail::resolve_serial(std::move(root_), *ctx.resolvers(), ctx.max_depth(),
+								  ctx.max_nesting());
+}
+template <typename Value = toml::value>
+toml::result<Value, error> try_resolve(Value&& root_) {
+	return tomlex::try_resolve(std::move(root_), default_context<Value>());
+}
+template <typename Value = toml::value>
+toml::result<Value, error> try_resolve(Value&& root_, context<Value> const& ctx,
+									   parallel const& options) {
+	return detail::resolve_parallel(std::move(root_), *ctx.resolvers(), ctx.max_depth(),
+									 ctx.max_nesting(), options);
+}
+template <typename Value = toml::value>
+toml::result<Value, error> try_resolve(Value&& root_, parallel const& options) {
+	return tomlex::try_resolve(std::move(root_), default_context<Value>(), options);
+}
+template <typename Value = toml::value>
+toml::result<Value, error> try_resolve(Value&& root_, context<Value> const& ctx,
+									   resolver_memo<Value>& memo) {
+	return detail::resolve_serial(std::move(root_), *ctx.resolvers(), ctx.max_depth(),
+								  ctx.max_nesting(), &memo);
+}
+template <typename Value = toml::value>
+toml::result<Value, error> try_resolve(Value&& root_, resolver_memo<Value>& memo) {
+	return tomlex::try_resolve(std::move(root_), default_context<Value>(), memo);
+}
+template <typename Value = toml::value>
+toml::result<Value, error> try_resolve(Value&& root_, context<Value> const& ctx,
+									   parallel const& options, resolver_memo<Value>& memo) {
+	return detail::resolve_parallel(std::move(root_), *ctx.resolvers(), ctx.max_depth(),
+									 ctx.max_nesting(), options, &memo);
+}
+
+template <typename Value = toml::value>
+Value resolve(Value&& root_, context<Value> const& ctx) {
+	return detail::value_or_throw(tomlex::try_resolve(std::move(root_), ctx));
+}
+template <typename Value = toml::value>
+Value resolve(Value&& root_) {
+	return tomlex::resolve(std::move(root_), default_context<Value>());
+}
+template <typename Value = toml::value>
+Value resolve(Value&& root_, context<Value> const& ctx, parallel const& options) {
+	return detail::value_or_throw(tomlex::try_resolve(std::move(root_), ctx, options));
+}
+template <typename Value = toml::value>
+Value resolve(Value&& root_, parallel const& options) {
+	return tomlex::resolve(std::move(root_), default_context<Value>(), options);
+}
+/// <summary>
+/// Same as resolve(root_, ctx), but keeps the results of pure resolvers in memo, so that later
+/// resolutions with the same memo reuse them.
+/// </summary>
+template <typename Value = toml::value>
+Value resolve(Value&& root_, context<Value> const& ctx, resolver_memo<Value>& memo) {
+	return detail::value_or_throw(tomlex::try_resolve(std::move(root_), ctx, memo));
+}
+template <typename Value = toml::value>
+Value resolve(Value&& root_, resolver_memo<Value>& memo) {
+	return tomlex::resolve(std::move(root_), default_context<Value>(), memo);
+}
+template <typename Value = toml::value>
+Value resolve(Value&& root_, context<Value> const& ctx, parallel const& options,
+			  resolver_memo<Value>& memo) {
+	return detail::value_or_throw(tomlex::try_resolve(std::move(root_), ctx, options, memo));
+}
+/// <summary>
+/// Whether the values returned by parse keep their source regions, which the error messages of
+/// toml11 and tomlex show. Every region shares the whole text of the file, so the text stays in
+/// memory as long as any value with a region does.
+/// </summary>
+enum class source_regions { keep, drop };
+
+/// <summary>
+/// Parses and resolves a file. With source_regions::drop the regions of the resolved values are
+/// removed as by compact, except that the comments are kept, so the text of the file is freed
+/// before parse returns. This costs one walk over the resolved tree, and later errors about the
+/// values show no region.
+/// </summary>
+template <typename Value = toml::value, typename U>
+Value parse(U&& filename, context<Value> const& ctx,
+			source_regions regions = source_regions::keep) {
+	auto root = tomlex::resolve<Value>(
+		detail::parse_file<Value>::parse(std::forward<U>(filename)), ctx);
+	if (regions == source_regions::drop) {
+		detail::strip_sources(root, false);
+	}
+	return root;
+}
+template <typename Value = toml::value, typename U>
+Value parse(U&& filename, source_regions regions = source_regions::keep) {
+	return tomlex::parse<Value>(std::forward<U>(filename), default_context<Value>(), regions);
+}
+
+/// <summary>
+/// Same as parse, but returns the error, including the syntax errors of the file, instead of
+/// throwing it.
+/// </summary>
+template <typename Value = toml::value, typename U, typename... Options>
+toml::result<Value, error> try_parse(U&& filename, Options&&... options) {
+	// toml11 reports the errors of the file by throwing
+	auto root = detail::catch_error<Value>(
+		[&] { return detail::parse_file<Value>::parse(std::forward<U>(filename)); });
+	if (root.is_err()) {
+		return root;
+	}
+	return tomlex::try_resolve<Value>(std::move(root.unwrap()), std::forward<Options>(options)...);
+}
+
+/// <summary>
+/// A config whose "${...}" strings have been parsed once by tomlex::compile. It can be resolved
+/// any number of times, e.g. with different overrides in a parameter sweep, without scanning
+/// its strings again. Strings that come from the overrides are parsed on each resolution.
+/// </summary>
+template <typename Value = toml::value>
+class config_template {
+   public:
+	using path_type = std::vector<std::variant<toml::key, std::size_t>>;
+
+	explicit config_template(Value root) : root_(std::move(root)) {
+		if (!root_.is_table()) {
+			std::ostringstream msg;
+			msg << "tomlex::config_template: following value must be a table, but "
+				<< root_.type() << std::endl
+				<< root_;
+			throw std::runtime_error(msg.str());
+		}
+		path_type path;
+		compile_node(root_, path);
+		std::sort(references_.begin(), references_.end());
+		references_.erase(std::unique(references_.begin(), references_.end()), references_.end());
+	}
+
+	Value resolve(context<Value> const& ctx = default_context<Value>()) const {
+		return resolve_with(nullptr, root_, ctx);
+	}
+
+	/// <summary>
+	/// Resolves merge(template, overrides) without modifying the template.
+	/// </summary>
+	Value resolve(Value const& overrides, context<Value> const& ctx,
+				  bool enable_strict_overrwrite = false) const {
+		Value merged = root_;
+		tomlex::merge_into(merged, overrides, enable_strict_overrwrite);
+		return resolve_with(&overrides, std::move(merged), ctx);
+	}
+	Value resolve(Value const& overrides, bool enable_strict_overrwrite = false) const {
+		return resolve(overrides, default_context<Value>(), enable_strict_overrwrite);
+	}
+
+	Value const& root() const { return root_; }
+	// keys referenced by "${key}" in the template, sorted
+	std::vector<std::string> const& references() const { return references_; }
+	// true if some key is only known at resolution, e.g. "${${name}}"
+	bool has_dynamic_references() const { return has_dynamic_references_; }
+	// number of strings that contain "${...}"
+	std::size_t size() const { return leaves_.size(); }
+
+   private:
+	struct leaf {
+		path_type path;
+		detail::interp_string compiled;
+	};
+
+	void compile_node(Value const& node, path_type& path) {
+		if (node.is_table()) {
+			for (auto const& [k, v] : node.as_table()) {
+				path.emplace_back(k);
+				compile_node(v, path);
+				path.pop_back();
+			}
+		} else if (node.is_array()) {
+			auto const& arr = node.as_array();
+			for (std::size_t i = 0; i < arr.size(); i++) {
+				path.emplace_back(i);
+				compile_node(arr[i], path);
+				path.pop_back();
+			}
+		} else if (node.is_string() && utils::has_interpolation(node.as_string().str)) {
+			auto compiled = detail::compile_string(node.as_string());
+			if (compiled.unclosed) {
+				detail::warn_unclosed(node);
+			}
+			if (!compiled.has_expr()) {
+				return;
+			}
+			references_.insert(references_.end(), compiled.references.begin(),
+							   compiled.references.end());
+			has_dynamic_references_ |= compiled.has_dynamic_reference;
+			leaves_.push_back(leaf{path, std::move(compiled)});
+		}
+	}
+
+	// a leaf is overridden if it, or an array or a non-table value on its path, is in overrides
+	static bool is_overridden(path_type const& path, Value const* overrides) {
+		Value const* node = overrides;
+		for (auto const& item : path) {
+			if (node == nullptr) {
+				return false;
+			}
+			if (!node->is_table()) {
+				return true;
+			}
+			auto const& table = node->as_table();
+			auto it = table.find(std::get<toml::key>(item));
+			node = it == table.end() ? nullptr : &it->second;
+		}
+		return node != nullptr;
+	}
+
+	static Value& node_at(Value& root, path_type const& path) {
+		Value* node = &root;
+		for (auto const& item : path) {
+			if (auto key = std::get_if<toml::key>(&item)) {
+				node = &node->as_table().at(*key);
+			} else {
+				node = &node->as_array().at(std::get<std::size_t>(item));
+			}
+		}
+		return *node;
+	}
+
+	Value resolve_with(Value const* overrides, Value work, context<Value> const& ctx) const {
+		std::unordered_map<Value const*, detail::interp_string const*> compiled;
+		compiled.reserve(leaves_.size());
+		for (auto const& leaf : leaves_) {
+			if (!is_overridden(leaf.path, overrides)) {
+				compiled.emplace(&node_at(work, leaf.path), &leaf.compiled);
+			}
+		}
+		const auto resolvers = ctx.resolvers();
+		resolve_cache<Value> cache;
+		detail::resolve_state<Value> state{work, cache, *resolvers};
+		state.compiled = &compiled;
+		state.max_depth = ctx.max_depth();
+		state.max_nesting = ctx.max_nesting();
+		return detail::value_or_throw(detail::resolve_impl(std::move(work), state, true));
+	}
+
+	Value root_;
+	std::vector<leaf> leaves_;
+	std::vector<std::string> references_;
+	bool has_dynamic_references_ = false;
+};
+
+/// <summary>
+/// Parses the "${...}" strings of root once, for repeated resolution with different overrides.
+/// </summary>
+template <typename Value = toml::value>
+config_template<Value> compile(Value root) {
+	return config_template<Value>(std::move(root));
+}
+
+/// <summary>
+/// An unresolved config whose nodes are resolved on their first access through find or
+/// operator[], e.g. when a service reads a small part of a large shared config. The result of
+/// each node, and of every "${...}" string resolved on the way, is kept and reused by later
+/// accesses. It may be read from several threads: a node is resolved exactly once, and reading
+/// a resolved node does not wait. First accesses of different nodes run concurrently; a string
+/// that two of them need at the same time may be evaluated by both, but only the first value
+/// is kept, so every node sees the same one. A resolver may read other nodes of the same
+/// lazy_config on its own thread; reading the node it is resolving is a circular_reference
+/// error. Re-entrant reads across threads are not supported: a resolver that waits for another
+/// thread, e.g. a helper thread it joins, which reads a node being resolved by the resolver's
+/// thread, or two threads whose resolvers read each other's nodes, wait forever. The resolvers
+/// of ctx are taken when it is constructed. It keeps pointers into its root, so it cannot be
+/// copied or moved.
+/// </summary>
+template <typename Value = toml::value>
+class lazy_config {
+   public:
+	explicit lazy_config(Value root, context<Value> const& ctx = default_context<Value>())
+		: root_(std::move(root)),
+		  resolvers_(ctx.resolvers()),
+		  max_depth_(ctx.max_depth()),
+		  max_nesting_(ctx.max_nesting()) {
+		if (!root_.is_table()) {
+			std::ostringstream msg;
+			msg << "tomlex::lazy_config: following value must be a table, but " << root_.type()
+				<< std::endl
+				<< root_;
+			throw std::runtime_error(msg.str());
+		}
+	}
+	lazy_config(lazy_config const&) = delete;
+	lazy_config& operator=(lazy_config const&) = delete;
+
+	// the resolved value of the node at keys, e.g. find("a", "b", 0); it lives as long as *this
+	template <typename... Keys>
+	Value const& find(Keys&&... keys) const {
+		Value const& node = toml::find(root_, std::forward<Keys>(keys)...);
+		auto& e = entry_of(node);
+		if (e.resolved.load(std::memory_order_acquire)) {
+			return e.value;
+		}
+		// the first reader resolves the node while the others wait on its mutex; if the
+		// resolution throws, the next reader tries again. std::call_once is not used, as some
+		// implementations hang when the function throws. A resolver that reads the node it
+		// resolves is found by owner, which only this thread sets to its id, without a lock.
+		const auto self = std::this_thread::get_id();
+		if (e.owner.load(std::memory_order_relaxed) == self) {
+			throw error(error::code::circular_reference, "tomlex::lazy_config::find",
+						"the node is read by a resolver while it is being resolved")
+				.set_region(node.location());
+		}
+		std::lock_guard<std::mutex> lock(e.mutex);
+		if (!e.resolved.load(std::memory_order_relaxed)) {
+			e.owner.store(self, std::memory_order_relaxed);
+			struct release {
+				std::atomic<std::thread::id>& owner;
+				~release() { owner.store(std::thread::id(), std::memory_order_relaxed); }
+			} guard{e.owner};
+			resolve_cache<Value> unused;
+			detail::resolve_state<Value> state{root_, unused, *resolvers_};
+			state.shared = &cache_;
+			state.keys = &keys();
+			state.max_depth = max_depth_;
+			state.max_nesting = max_nesting_;
+			state.memo = &memo_;
+			e.value = detail::value_or_throw(detail::resolve_node(node, state));
+			e.resolved.store(true, std::memory_order_release);
+		}
+		return e.value;
+	}
+	Value const& operator[](toml::key const& key) const { return find(key); }
+
+	// the unresolved root
+	Value const& root() const { return root_; }
+
+   private:
+	struct entry {
+		std::atomic<bool> resolved{false};
+		std::mutex mutex;  // held by the thread that resolves the node
+		std::atomic<std::thread::id> owner{std::thread::id()};	// that thread
+		Value value;
+	};
+
+	entry& entry_of(Value const& node) const {
+		{
+			std::shared_lock<std::shared_mutex> lock(entries_mutex_);
+			if (auto it = entries_.find(&node); it != entries_.end()) {
+				return *it->second;
+			}
+		}
+		std::unique_lock<std::shared_mutex> lock(entries_mutex_);
+		auto& e = entries_[&node];
+		if (!e) {
+			e = std::make_unique<entry>();
+		}
+		return *e;
+	}
+
+	index<Value> const& keys() const {
+		if (auto keys = keys_ptr_.load(std::memory_order_acquire)) {
+			return *keys;
+		}
+		std::lock_guard<std::mutex> lock(keys_mutex_);
+		if (!keys_) {
+			keys_.emplace(root_);
+			keys_ptr_.store(&*keys_, std::memory_order_release);
+		}
+		return *keys_;
+	}
+
+	Value root_;
+	std::shared_ptr<resolver_map<Value> const> resolvers_;
+	std::size_t max_depth_;
+	std::size_t max_nesting_;
+
+	mutable std::shared_mutex entries_mutex_;
+	mutable std::unordered_map<Value const*, std::unique_ptr<entry>> entries_;
+
+	// shared by the resolutions, which may run concurrently
+	mutable detail::shared_cache<Value> cache_;
+	mutable std::mutex keys_mutex_;
+	mutable std::optional<index<Value>> keys_;
+	mutable std::atomic<index<Value> const*> keys_ptr_{nullptr};
+	mutable resolver_memo<Value> memo_;
+};
+
+/// <summary>
+/// toml11の"<<"演算子を参考に、少ない行数で表示できるよう修正した。
+/// コメントは表示しない。
+/// </summary>
+/// <typeparam name="Value"></typeparam>
+/// <param name="cfg"></param>
+/// <returns></returns>
+template <typename Value = toml::value>
+std::string format(const Value& cfg, std::size_t w = 80u, int fprec = 6) {
+	std::string serialized =
+		toml::visit(detail::serializer::serializer_short<Value>(w, fprec, false, true), cfg);
+	return std::string(tomlex::utils::rtrim(serialized));
+}
+
+namespace detail {
+// removes the source regions of root and its descendants, and their comments if comments is
+// true. Returns the bytes of the file contents and comments that no other value refers to
+template <typename Value>
+std::size_t strip_sources(Value& root, bool comments) {
+	using source_ptr = std::shared_ptr<const std::vector<char>>;
+	std::vector<source_ptr> sources;
+	std::size_t freed = 0;
+	std::vector<Value*> stack{&root};
+	while (!stack.empty()) {
+		auto* val = stack.back();
+		stack.pop_back();
+		auto const& reg = toml::detail::get_region(*val);
+		if (reg.is_ok()) {
+			// the values of a file share one buffer, so the last one is nearly always the same
+			auto const* parsed = dynamic_cast<toml::detail::region const*>(&reg);
+			if (parsed && (sources.empty() || sources.back() != parsed->source()) &&
+				std::find(sources.begin(), sources.end(), parsed->source()) == sources.end()) {
+				sources.push_back(parsed->source());
+			}
+			toml::detail::change_region(*val, toml::detail::region_base{});
+		}
+		if (comments) {
+			for (auto const& comment : val->comments()) {
+				freed += comment.size();
+			}
+			val->comments().clear();
+		}
+		if (val->is_table()) {
+			for (auto& [key, child] : val->as_table()) {
+				stack.push_back(&child);
+			}
+		} else if (val->is_array()) {
+			for (auto& child : val->as_array()) {
+				stack.push_back(&child);
+			}
+		}
+	}
+	for (auto const& source : sources) {
+		if (source.use_count() == 1) {
+			freed += source->size();
+		}
+	}
+	return freed;
+}
+}  // namespace detail
+
+/// <summary>
+/// Removes the source regions and the comments of cfg and its descendants. Every region shares
+/// the whole text of its file, so a config kept for the lifetime of a process otherwise keeps
+/// that text in memory. Returns the bytes of text and comments that were freed; the text of a
+/// file that other values still refer to, e.g. the unresolved tree, is not freed. cfg resolves,
+/// merges and formats as before, but errors about its values no longer show their region.
+/// Like any modification, it gives the shared tables and arrays of a shared_value a copy.
+/// </summary>
+template <typename Value = toml::value>
+std::size_t compact(Value& cfg) {
+	return detail::strip_sources(cfg, true);
+}
+
+/// <summary>
+/// 128-bit hash of a config, given by tomlex::fingerprint.
+/// </summary>
+struct digest {
+	std::uint64_t lo = 0;
+	std::uint64_t hi = 0;
+
+	// 32 lowercase hex digits, hi first
+	std::string str() const {
+		static constexpr char digits[] = "0123456789abcdef";
+		std::string out(32, '0');
+		for (int i = 0; i < 16; i++) {
+			out[15 - i] = digits[(hi >> (4 * i)) & 0xf];
+			out[31 - i] = digits[(lo >> (4 * i)) & 0xf];
+		}
+		return out;
+	}
+	friend bool operator==(digest const& l, digest const& r) {
+		return l.lo == r.lo && l.hi == r.hi;
+	}
+	friend bool operator!=(digest const& l, digest const& r) { return !(l == r); }
+	friend bool operator<(digest const& l, digest const& r) {
+		return l.hi != r.hi ? l.hi < r.hi : l.lo < r.lo;
+	}
+};
+
+namespace detail {
+inline std::uint64_t rotl64(std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+inline std::uint64_t fmix64(std::uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+// little-endian regardless of the host, so that digests are the same everywhere
+inline std::uint64_t load_le64(unsigned char const* p, std::size_t n = 8) {
+	std::uint64_t k = 0;
+	for (std::size_t i = 0; i < n; i++) {
+		k |= std::uint64_t(p[i]) << (8 * i);
+	}
+	return k;
+}
+
+// orig: MurmurHash3_x64_128 (public domain), split so that words can be hashed without
+// writing them out as bytes
+struct murmur3_state {
+	static constexpr std::uint64_t c1 = 0x87c37b91114253d5ULL;
+	static constexpr std::uint64_t c2 = 0x4cf5ad432745937fULL;
+	std::uint64_t h1, h2;
+
+	void block(std::uint64_t k1, std::uint64_t k2) {
+		h1 ^= rotl64(k1 * c1, 31) * c2;
+		h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+		h2 ^= rotl64(k2 * c2, 33) * c1;
+		h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+	}
+	// the last len % 16 bytes, as little-endian words
+	void tail(std::uint64_t k1, std::uint64_t k2) {
+		h2 ^= rotl64(k2 * c2, 33) * c1;
+		h1 ^= rotl64(k1 * c1, 31) * c2;
+	}
+	digest finish(std::size_t len) {
+		h1 ^= len;
+		h2 ^= len;
+		h1 += h2;
+		h2 += h1;
+		h1 = fmix64(h1);
+		h2 = fmix64(h2);
+		h1 += h2;
+		h2 += h1;
+		return digest{h1, h2};
+	}
+};
+
+inline digest murmur3_128(void const* data, std::size_t len, std::uint64_t seed) {
+	const auto* p = static_cast<unsigned char const*>(data);
+	murmur3_state state{seed, seed};
+	for (std::size_t i = 0; i < len / 16; i++, p += 16) {
+		state.block(load_le64(p), load_le64(p + 8));
+	}
+	const std::size_t tail = len % 16;
+	if (tail > 0) {
+		state.tail(load_le64(p, std::min<std::size_t>(tail, 8)),
+				   tail > 8 ? load_le64(p + 8, tail - 8) : 0);
+	}
+	return state.finish(len);
+}
+// same as murmur3_128 of the little-endian bytes of words, with the type tag as seed
+inline digest hash_words(std::uint64_t tag, std::initializer_list<std::uint64_t> words) {
+	murmur3_state state{tag, tag};
+	auto it = words.begin();
+	for (std::size_t i = 0; i < words.size() / 2; i++, it += 2) {
+		state.block(it[0], it[1]);
+	}
+	if (words.size() % 2 == 1) {
+		state.tail(it[0], 0);
+	}
+	return state.finish(words.size() * 8);
+}
+
+template <typename Value>
+digest hash_scalar(Value const& val) {
+	const auto tag = static_cast<std::uint64_t>(val.type());
+	const auto date = [](toml::local_date const& d) {
+		return std::uint64_t(static_cast<std::uint16_t>(d.year)) |
+			   (std::uint64_t(d.month) << 16) | (std::uint64_t(d.day) << 24);
+	};
+	const auto time = [](toml::local_time const& t) {
+		return std::uint64_t(t.hour) | (std::uint64_t(t.minute) << 8) |
+			   (std::uint64_t(t.second) << 16) | (std::uint64_t(t.millisecond) << 24) |
+			   (std::uint64_t(t.microsecond) << 40);
+	};
+	switch (val.type()) {
+		case toml::value_t::boolean:
+			return hash_words(tag, {val.as_boolean() ? 1u : 0u});
+		case toml::value_t::integer:
+			return hash_words(tag, {static_cast<std::uint64_t>(val.as_integer())});
+		case toml::value_t::floating: {
+			// exact bits: 0.0 and -0.0 differ, and so do NaNs with different payloads
+			const double f = val.as_floating();
+			std::uint64_t bits;
+			std::memcpy(&bits, &f, 8);
+			return hash_words(tag, {bits});
+		}
+		case toml::value_t::string: {
+			auto const& str = val.as_string().str;
+			return murmur3_128(str.data(), str.size(), tag);
+		}
+		case toml::value_t::offset_datetime: {
+			auto const& dt = val.as_offset_datetime();
+			const auto offset = std::uint64_t(static_cast<std::uint8_t>(dt.offset.hour)) |
+								(std::uint64_t(static_cast<std::uint8_t>(dt.offset.minute)) << 8);
+			return hash_words(tag, {date(dt.date), time(dt.time), dt.time.nanosecond, offset});
+		}
+		case toml::value_t::local_datetime: {
+			auto const& dt = val.as_local_datetime();
+			return hash_words(tag, {date(dt.date), time(dt.time), dt.time.nanosecond});
+		}
+		case toml::value_t::local_date:
+			return hash_words(tag, {date(val.as_local_date())});
+		case toml::value_t::local_time:
+			return hash_words(tag, {time(val.as_local_time()), val.as_local_time().nanosecond});
+		default:
+			return hash_words(tag, {});
+	}
+}
+
+/// <summary>
+/// Digest of root, from one walk with a stack rather than recursion. A table is hashed from the
+/// sum of the digests of its (key, value) pairs, so the order of its members does not matter;
+/// an array from its elements in order. If paths is given, the digest of every entry reachable
+/// through tables is stored under its dotted key, named as tomlex::index names them.
+/// </summary>
+template <typename Value>
+digest fingerprint_tree(Value const& root,
+						std::unordered_map<std::string, digest>* paths = nullptr) {
+	constexpr std::uint64_t member_tag = 0x100;
+	constexpr auto unnamed = std::string::npos;
+	struct frame {
+		Value const* val;
+		toml::key const* key;  // in the parent table, if it is a member of one
+		typename Value::table_type::const_iterator member;
+		std::size_t element;
+		std::size_t path_size;	// of the dotted key of val, or unnamed
+		digest acc;
+		std::uint64_t count;
+	};
+	const auto push = [](std::vector<frame>& stack, Value const* val, toml::key const* key,
+						 std::size_t path_size) {
+		frame f{val, key, {}, 0, path_size, {}, 0};
+		if (val->is_table()) {
+			f.member = val->as_table().begin();
+		}
+		stack.push_back(f);
+	};
+	const auto fold = [](frame& f, toml::key const* key, digest h) {
+		if (key) {
+			const auto k = murmur3_128(key->data(), key->size(), member_tag);
+			const auto member = hash_words(member_tag, {k.lo, k.hi, h.lo, h.hi});
+			f.acc.lo += member.lo;
+			f.acc.hi += member.hi;
+		} else {
+			f.acc = hash_words(static_cast<std::uint64_t>(toml::value_t::array),
+							   {f.acc.lo, f.acc.hi, h.lo, h.hi});
+		}
+		f.count++;
+	};
+
+	std::string path;
+	std::vector<frame> stack;
+	push(stack, &root, nullptr, 0);
+	while (true) {
+		auto& f = stack.back();
+		Value const* child = nullptr;
+		toml::key const* key = nullptr;
+		if (f.val->is_table() && f.member != f.val->as_table().end()) {
+			key = &f.member->first;
+			child = &f.member->second;
+			++f.member;
+		} else if (f.val->is_array() && f.element < f.val->as_array().size()) {
+			child = &f.val->as_array()[f.element++];
+		}
+
+		if (child) {
+			std::size_t child_path = unnamed;
+			if (paths && key && f.path_size != unnamed && key->find('.') == std::string::npos) {
+				path.resize(f.path_size);
+				if (f.val != &root) {
+					path += '.';
+				}
+				path += *key;
+				child_path = path.size();
+			}
+			if (child->is_table() || child->is_array()) {
+				push(stack, child, key, child_path);
+				continue;
+			}
+			const auto h = hash_scalar(*child);
+			if (child_path != unnamed) {
+				paths->emplace(path, h);
+			}
+			fold(f, key, h);
+			continue;
+		}
+
+		const auto h = hash_words(static_cast<std::uint64_t>(f.val->type()),
+								  {f.acc.lo, f.acc.hi, f.count});
+		if (paths && f.val != &root && f.path_size != unnamed) {
+			path.resize(f.path_size);
+			paths->emplace(path, h);
+		}
+		key = f.key;
+		stack.pop_back();
+		if (stack.empty()) {
+			return h;
+		}
+		fold(stack.back(), key, h);
+	}
+}
+}  // namespace detail
+
+/// <summary>
+/// Fingerprint of cfg: a 128-bit hash of its contents from one walk, much cheaper than hashing
+/// tomlex::format(cfg). It covers the type of every value and the exact bits of floats, but not
+/// the order of the members of tables, comments, source regions, or whether a string is
+/// literal. It is the same on every platform and in every run.
+/// </summary>
+template <typename Value = toml::value>
+digest fingerprint(Value const& cfg) {
+	return detail::fingerprint_tree(cfg);
+}
+
+/// <summary>
+/// Fingerprints of a root and of every entry reachable through its tables, keyed by the dotted
+/// keys that tomlex::index uses, so that the sections of two configs can be compared without
+/// walking them again. Unlike an index, it does not refer to the root once built.
+/// </summary>
+class fingerprints {
+   public:
+	fingerprints() = default;
+	template <typename Value>
+	explicit fingerprints(Value const& root) : root_(detail::fingerprint_tree(root, &paths_)) {}
+
+	digest root() const { return root_; }
+	std::optional<digest> find(std::string_view dotted_key) const {
+		auto it = paths_.find(std::string(dotted_key));
+		return it == paths_.end() ? std::nullopt : std::optional<digest>(it->second);
+	}
+	digest at(std::string_view dotted_key) const {
+		if (auto h = find(dotted_key)) {
+			return *h;
+		}
+		throw std::runtime_error("tomlex::fingerprints::at: key \"" + std::string(dotted_key) +
+								 "\" is not found");
+	}
+	bool contains(std::string_view dotted_key) const { return find(dotted_key).has_value(); }
+	std::size_t size() const { return paths_.size(); }
+
+   private:
+	std::unordered_map<std::string, digest> paths_;
+	digest root_;
+};
+
+namespace detail {
+
+template <typename Value>
+toml::result<Value, std::string> parse_value_strict(toml::detail::location& loc);
+
+// appends the digits of s to out; s must be digits with each '_' between two of them
+template <typename IsDigit>
+bool append_toml_digits(std::string_view s, IsDigit is_digit, std::string& out) {
+	if (s.empty() || !is_digit(s.front()) || !is_digit(s.back())) {
+		return false;
+	}
+	for (std::size_t i = 0; i < s.size(); i++) {
+		if (s[i] == '_') {
+			if (!is_digit(s[i + 1])) {
+				return false;
+			}
+		} else if (is_digit(s[i])) {
+			out += s[i];
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// <summary>
+/// Value of str if it is a whole TOML boolean, integer or float, without building a location
+/// for the toml11 lexers. Anything else, including values out of range, gives nullopt, and is
+/// left to the full parser along with its error messages. The values are the same as the ones
+/// toml11 parses, except that they have no source region.
+/// </summary>
+template <typename Value>
+std::optional<Value> parse_scalar(std::string_view str) {
+	const auto is_dec = [](char c) { return '0' <= c && c <= '9'; };
+	if (str.empty()) {
+		return std::nullopt;
+	}
+	if (str == "true" || str == "false") {
+		return Value(str == "true");
+	}
+
+	std::string digits;
+	digits.reserve(str.size());
+	// hexadecimal, octal and binary integers, which have no sign
+	if (str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'o' || str[1] == 'b')) {
+		const auto is_hex = [](char c) {
+			return ('0' <= c && c <= '9') || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
+		};
+		const auto is_oct = [](char c) { return '0' <= c && c <= '7'; };
+		const auto is_bin = [](char c) { return c == '0' || c == '1'; };
+		const auto body = str.substr(2);
+		int base = 0;
+		if (str[1] == 'x' && append_toml_digits(body, is_hex, digits)) {
+			base = 16;
+		} else if (str[1] == 'o' && append_toml_digits(body, is_oct, digits)) {
+			base = 8;
+		} else if (str[1] == 'b' && append_toml_digits(body, is_bin, digits)) {
+			base = 2;
+		} else {
+			return std::nullopt;
+		}
+		toml::integer value = 0;
+		const auto last = digits.data() + digits.size();
+		const auto [ptr, ec] = std::from_chars(digits.data(), last, value, base);
+		if (ec != std::errc{} || ptr != last) {
+			return std::nullopt;
+		}
+		return Value(value);
+	}
+
+	// from_chars does not take '+'
+	const bool negative = str.front() == '-';
+	auto body = str;
+	if (str.front() == '+' || negative) {
+		body.remove_prefix(1);
+		if (negative) {
+			digits += '-';
+		}
+	}
+	if (body == "inf") {
+		return Value(negative ? -std::numeric_limits<toml::floating>::infinity()
+							  : std::numeric_limits<toml::floating>::infinity());
+	}
+	if (body == "nan") {
+		return Value(negative ? -std::numeric_limits<toml::floating>::quiet_NaN()
+							  : std::numeric_limits<toml::floating>::quiet_NaN());
+	}
+
+	// decimal integer part, without leading zeros
+	const auto int_end = std::min(body.find_first_of(".eE"), body.size());
+	const auto int_part = body.substr(0, int_end);
+	if (int_part.size() > 1 && int_part.front() == '0') {
+		return std::nullopt;
+	}
+	if (!append_toml_digits(int_part, is_dec, digits)) {
+		return std::nullopt;
+	}
+	if (int_end == body.size()) {
+		toml::integer value = 0;
+		const auto last = digits.data() + digits.size();
+		const auto [ptr, ec] = std::from_chars(digits.data(), last, value);
+		if (ec != std::errc{} || ptr != last) {
+			return std::nullopt;
+		}
+		return Value(value);
+	}
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+	// fractional part and exponent part
+	auto rest = body.substr(int_end);
+	if (rest.front() == '.') {
+		const auto frac_end = std::min(rest.find_first_of("eE"), rest.size());
+		digits += '.';
+		if (!append_toml_digits(rest.substr(1, frac_end - 1), is_dec, digits)) {
+			return std::nullopt;
+		}
+		rest.remove_prefix(frac_end);
+	}
+	if (!rest.empty()) {
+		// rest starts with 'e' or 'E'
+		digits += 'e';
+		rest.remove_prefix(1);
+		if (!rest.empty() && (rest.front() == '+' || rest.front() == '-')) {
+			digits += rest.front();
+			rest.remove_prefix(1);
+		}
+		if (!append_toml_digits(rest, is_dec, digits)) {
+			return std::nullopt;
+		}
+	}
+	toml::floating value = 0;
+	const auto last = digits.data() + digits.size();
+	const auto [ptr, ec] = std::from_chars(digits.data(), last, value);
+	if (ec != std::errc{} || ptr != last) {
+		return std::nullopt;
+	}
+	return Value(value);
+#else
+	// floating-point from_chars is not available
+	return std::nullopt;
+#endif
+}
+
+// str parsed as a toml value, e.g. the argument of a resolver
+template <typename Value>
+toml::result<Value, error> try_to_toml_value(std::string const& str) {
+	if (str.empty()) {
+		return toml::err(error(error::code::syntax_error, "tomlex::detail::to_toml_value",
+							   "cannot convert empty string to toml::value"));
+	}
+	if (auto scalar = parse_scalar<Value>(str)) {
+		return toml::ok(std::move(*scalar));
 	}
 	toml::detail::location loc(str, str);
+	// toml11 reports some errors by throwing
+	try {
+		auto result = parse_value_strict<Value>(loc);
+		if (result.is_err()) {
+			// std::cout << result.as_err() << std::endl;
+			return toml::err(error(error::code::syntax_error, std::string(), result.as_err()));
+		}
+		return toml::ok(std::move(result.unwrap()));
+	} catch (toml::syntax_error& e) {
+		// std::cout << e.what() << std::endl;
+		return toml::err(error(error::code::syntax_error, std::string(), e.what()));
+	}
+}
+
+template <typename Value>
+Value to_toml_value(std::string const& str) {
+	return value_or_throw(try_to_toml_value<Value>(str));
+}
+
+// Counts a call in count while it is alive, e.g. an interpolation in resolve_state::depth.
+// Resolution fails once more than limit of them would be alive at the same time, in which case
+// ok() is false and nothing is counted.
+class count_guard {
+   public:
+	count_guard(std::size_t& count, std::size_t limit) : count_(count), ok_(count < limit) {
+		if (ok_) {
+			count_++;
+		}
+	}
+	count_guard(count_guard const&) = delete;
+	count_guard& operator=(count_guard const&) = delete;
+	~count_guard() {
+		if (ok_) {
+			count_--;
+		}
+	}
+
+	bool ok() const { return ok_; }
+
+   private:
+	std::size_t& count_;
+	bool ok_;
+};
+
+template <typename Value>
+error max_depth_error(resolve_state<Value> const& state_) {
+	return error(error::code::max_depth_exceeded, "tomlex::resolve",
+				 "interpolations are nested deeper than max_depth (" +
+					 std::to_string(state_.max_depth) + ")");
+}
+template <typename Value>
+error max_nesting_error(resolve_state<Value> const& state_) {
+	return error(error::code::max_depth_exceeded, "tomlex::resolve",
+				 "evaluations are nested deeper than max_nesting (" +
+					 std::to_string(state_.max_nesting) + ")");
+}
+
+// The lookups below return nullptr for a key that is not found, and build the error in *err
+// only if err is given. Each item of a key is copied into the reused buffer item_buf to be
+// looked up, so that probing a key costs no allocation once the buffer has grown.
+
+// walks root along the '.' separated items of key
+template <typename Value>
+Value const* find_dotted(Value const& root, std::string_view key, std::string& item_buf,
+						 std::optional<error>* err) {
+	Value const* node = &root;
+	std::size_t first = 0;
+	while (true) {
+		const auto last = std::min(key.find('.', first), key.size());
+		const auto item = key.substr(first, last - first);
+		Value const* next = nullptr;
+		if (node->is_table()) {
+			auto const& table = node->as_table();
+			item_buf.assign(item.data(), item.size());
+			if (auto it = table.find(item_buf); it != table.end()) {
+				next = &it->second;
+			}
+		}
+		if (next == nullptr) {
+			if (err != nullptr) {
+				auto& e = err->emplace(
+					error::code::key_not_found, "tomlex::detail::register_resolver",
+					"interpolation key \"" + std::string(item) + "\" is not found");
+				for (auto pos = key.size(); pos != std::string_view::npos;) {
+					const auto dot = pos == 0 ? std::string_view::npos : key.rfind('.', pos - 1);
+					const auto begin = dot == std::string_view::npos ? 0 : dot + 1;
+					e.prepend_key(std::string(key.substr(begin, pos - begin)));
+					pos = dot;
+				}
+			}
+			return nullptr;
+		}
+		node = next;
+		if (last == key.size()) {
+			return node;
+		}
+		first = last + 1;
+	}
+}
+
+template <typename Value>
+Value const* find_in_sections(std::string_view key,
+							  std::unordered_map<std::string_view, Value const*> const& sections,
+							  std::string& item_buf, std::optional<error>* err) {
+	const auto first_dot = std::min(key.find('.'), key.size());
+	auto it = sections.find(key.substr(0, first_dot));
+	if (it == sections.end()) {
+		if (err != nullptr) {
+			err->emplace(error::code::key_not_found, "tomlex::detail::interp",
+						 "interpolation key \"" + std::string(key) +
+							 "\" is outside of the scheduled sections");
+		}
+		return nullptr;
+	}
+	if (first_dot == key.size()) {
+		return it->second;
+	}
+	return find_dotted(*it->second, key.substr(first_dot + 1), item_buf, err);
+}
+
+template <typename Value>
+interp_string const* find_compiled(Value const& node, resolve_state<Value> const& state_) {
+	if (state_.compiled == nullptr) {
+		return nullptr;
+	}
+	auto it = state_.compiled->find(&node);
+	return it == state_.compiled->end() ? nullptr : it->second;
+}
+
+// the cached value of node, a string of the root, or nullptr
+template <typename Value>
+Value const* find_cached(Value const* node, resolve_state<Value>& state_) {
+	if (state_.shared != nullptr) {
+		std::shared_lock<std::shared_mutex> lock(state_.shared->mutex);
+		auto it = state_.shared->values.find(node);
+		return it == state_.shared->values.end() ? nullptr : &it->second;
+	}
+	auto it = state_.cache.find(node);
+	return it == state_.cache.end() ? nullptr : &it->second;
+}
+
+// caches result as the value of node and returns the cached value. If another thread cached
+// node meanwhile, its value is kept, so that every reader sees the same one
+template <typename Value>
+Value const& cache_result(Value const* node, Value&& result, resolve_state<Value>& state_) {
+	if (state_.shared != nullptr) {
+		std::unique_lock<std::shared_mutex> lock(state_.shared->mutex);
+		return state_.shared->values.emplace(node, std::move(result)).first->second;
+	}
+	return state_.cache.emplace(node, std::move(result)).first->second;
+}
+
+// node of root referenced by "${key}"
+template <typename Value>
+Value const* find_reference(std::string_view key, resolve_state<Value>& state_,
+							std::optional<error>* err = nullptr) {
+	if (state_.sections != nullptr) {
+		return find_in_sections(key, *state_.sections, state_.key_item, err);
+	}
+	if (state_.keys == nullptr) {
+		state_.keys = &state_.own_keys.emplace(state_.root);
+	}
+	if (auto node = state_.keys->find(key)) {
+		return node;
+	}
+	// not indexed: the key runs through a value resolved into a table
+	return find_dotted(state_.root, key, state_.key_item, err);
+}
+
+template <typename Value>
+toml::result<Value, error> interp(std::string_view dst, resolve_state<Value>& state_) {
+	if (dst.empty()) {
+		return toml::err(
+			error(error::code::syntax_error, "tomlex::detail::interp", "empty interpolation key"));
+	}
+
+	std::optional<error> not_found;
+	Value const* node = find_reference(dst, state_, &not_found);
+	if (node == nullptr) {
+		return toml::err(std::move(*not_found));
+	}
+	count_guard nested(state_.nesting, state_.max_nesting);
+	if (!nested.ok()) {
+		return toml::err(max_nesting_error(state_));
+	}
+	// a reference to a node that is being interpolated closes a cycle
+	auto& stack = state_.interpolating;
+	if (auto i = state_.interpolating_at.find(node)) {
+		std::string path;
+		for (std::size_t j = *i; j < stack.size(); j++) {
+			path.append(stack[j].second).append(" -> ");
+		}
+		path += dst;
+		return toml::err(error(error::code::circular_reference, "tomlex::detail::interp",
+							   "circular reference detected: " + path));
+	}
+	state_.interpolating_at.insert(node, stack.size());
+	stack.emplace_back(node, dst);
+	auto result = resolve_node(*node, state_);
+	stack.pop_back();
+	state_.interpolating_at.erase(node);
+	return result;
+}
+
+template <typename Value>
+toml::result<resolver_entry<Value> const*, error> find_resolver(
+	std::string_view resolver_name, resolve_state<Value> const& state_) {
+	if (resolver_name.empty()) {
+		return toml::err(error(error::code::syntax_error, "tomlex::detail::apply_custom_resolver",
+							   "empty resolver_name"));
+	}
+	std::string key(resolver_name);
+	if (auto it = state_.resolvers.find(key); it != state_.resolvers.end()) {
+		return toml::ok(&it->second);
+	}
+	std::string message = "non-registered resolver_type: \"" + key + "\", registered: ";
+	for (const auto& [k, v] : state_.resolvers) {
+		message.append(k).append(", ");
+	}
+	return toml::err(error(error::code::unknown_resolver, "tomlex::detail::apply_custom_resolver",
+						   std::move(message)));
+}
+
+// key of a pure resolver call in resolver_memo: the name and the serialized argument
+template <typename Value>
+std::string memo_key(std::string_view resolver_name, Value const& args) {
+	std::string key(resolver_name);
+	key += '\0';
+	if (!args.is_uninitialized()) {
+		key += toml::visit(
+			toml::serializer<Value>((std::numeric_limits<std::size_t>::max)(),
+									std::numeric_limits<toml::floating>::max_digits10, true, true),
+			args);
+	}
+	return key;
+}
+
+// The result of a registered resolver. The resolvers are the only code of a resolution that
+// throws: what they throw is returned as tomlex::error, keeping only the message of the other
+// exceptions.
+template <typename Value>
+toml::result<Value, error> call_resolver(resolver_entry<Value> const& entry, Value&& args) {
 	try {
-		const auto result = parse_value_strict<Value>(loc);
+		return toml::ok(entry.func(std::move(args)));
+	} catch (error& e) {
+		return toml::err(std::move(e));
+	} catch (std::exception& e) {
+		return toml::err(error(error::code::other, std::string(), e.what()));
+	}
+}
+
+// args is an evaluated value, passed to the resolver as it is
+template <typename Value>
+toml::result<Value, error> apply_custom_resolver(std::string_view resolver_name, Value&& args,
+												 resolve_state<Value>& state_) {
+	count_guard nested(state_.nesting, state_.max_nesting);
+	if (!nested.ok()) {
+		return toml::err(max_nesting_error(state_));
+	}
+	auto found = find_resolver(resolver_name, state_);
+	if (found.is_err()) {
+		return toml::err(std::move(found.unwrap_err()));
+	}
+	auto const& entry = *found.unwrap();
+	if (!(entry.flags & pure)) {
+		auto result = call_resolver(entry, std::move(args));
 		if (result.is_err()) {
-			// std::cout << result.as_err() << std::endl;
-			throw std::runtime_error(result.as_err());
+			return result;
 		}
-		return result.unwrap();
-	} catch (toml::syntax_error& e) {
-		// std::cout << e.what() << std::endl;
-		throw std::runtime_error(e.what());
+		return resolve_impl(std::move(result.unwrap()), state_);
+	}
+	if (state_.memo == nullptr) {
+		state_.memo = &state_.own_memo.emplace();
+	}
+	auto key = memo_key(resolver_name, args);
+	if (auto hit = state_.memo->find(key)) {
+		return resolve_impl(std::move(*hit), state_);
+	}
+	// a failed call is not kept, so it is tried again by the next resolution
+	auto result = call_resolver(entry, std::move(args));
+	if (result.is_err()) {
+		return result;
+	}
+	state_.memo->insert(std::move(key), result.unwrap());
+	return resolve_impl(std::move(result.unwrap()), state_);
+}
+
+template <typename Value>
+toml::result<Value, error> apply_custom_resolver(std::string_view resolver_name,
+												 std::string_view arr_str,
+												 resolve_state<Value>& state_) {
+	if (arr_str.empty()) {
+		return apply_custom_resolver(resolver_name, Value{}, state_);
+	}
+	auto args = try_to_toml_value<Value>(std::string(arr_str));
+	if (args.is_err()) {
+		return args;
+	}
+	return apply_custom_resolver(resolver_name, std::move(args.unwrap()), state_);
+}
+
+template <typename Value>
+std::string to_string(Value const& val) {
+	std::ostringstream oss;
+	if (val.is_string()) {
+		return val.as_string();
+	}
+
+	oss << toml::visit(
+		toml::serializer<Value>((std::numeric_limits<std::size_t>::max)(),
+								std::numeric_limits<toml::floating>::max_digits10, true, true),
+		val);
+	return oss.str();
+}
+
+// appends to_string(val) to out, without a copy of a string
+template <typename Value>
+void append_string(std::string& out, Value const& val) {
+	if (val.is_string()) {
+		out += val.as_string().str;
+	} else {
+		out += to_string(val);
+	}
+}
+
+template <typename Value>
+toml::result<Value, error> evaluate(std::string_view expr, resolve_state<Value>& state_) {
+	auto pos_first_colon = expr.find(':');
+
+	// コロンがないのでinterp
+	if (pos_first_colon == std::string::npos) {
+		expr = utils::trim(expr);
+		return interp(expr, state_);
+	}
+
+	// 関数適用
+	std::string_view func_name = utils::trim(expr.substr(0, pos_first_colon));
+	std::string_view args = utils::trim(expr.substr(pos_first_colon + 1));
+	return apply_custom_resolver(func_name, args, state_);
+}
+
+inline void append_literal(std::vector<interp_part>& parts, std::string_view text) {
+	if (text.empty()) {
+		return;
+	}
+	if (parts.empty() || parts.back().is_expr) {
+		parts.emplace_back();
+	}
+	parts.back().text += text;
+}
+
+inline void collect_references(std::vector<interp_part> const& parts, interp_string& ret) {
+	for (auto const& part : parts) {
+		if (!part.is_expr) {
+			continue;
+		}
+		collect_references(part.body, ret);
+		auto const& body = part.body;
+		if (body.empty()) {
+			continue;  // "${}" is reported on evaluation
+		}
+		// the text before the first nested expression decides between "${key}" and "${f: args}"
+		if (!body.front().is_expr && body.front().text.find(':') != std::string::npos) {
+			continue;
+		}
+		if (body.size() == 1) {
+			ret.references.emplace_back(utils::trim(body.front().text));
+		} else {
+			ret.has_dynamic_reference = true;
+		}
+	}
+}
+
+/// <summary>
+/// Splits src into literal text and "${...}" expressions in a single forward pass.
+/// "{" without "$" only has to be balanced, and "${" without a matching "}" is kept as text.
+/// </summary>
+inline interp_string compile_string(std::string const& src) {
+	interp_string ret;
+	// parts of the top level and of each open "${"
+	std::vector<std::vector<interp_part>> frames(1);
+	// unmatched '{' and whether it was preceded by '$'
+	std::vector<bool> left_brackets;
+	bool dollar_found = false;
+
+	for (const char char_ : src) {
+		switch (char_) {
+			case '$':
+				append_literal(frames.back(), "$");
+				dollar_found = true;
+				break;
+			case '{':
+				left_brackets.push_back(dollar_found);
+				if (dollar_found) {
+					auto& text = frames.back().back().text;
+					text.pop_back();  // '$' belongs to the expression
+					if (text.empty()) {
+						frames.back().pop_back();
+					}
+					frames.emplace_back();
+				} else {
+					append_literal(frames.back(), "{");
+				}
+				dollar_found = false;
+				break;
+			case '}': {
+				dollar_found = false;
+				const bool enable_eval = !left_brackets.empty() && left_brackets.back();
+				if (!left_brackets.empty()) {
+					left_brackets.pop_back();
+				}
+				if (!enable_eval) {
+					append_literal(frames.back(), "}");
+					break;
+				}
+				interp_part expr;
+				expr.is_expr = true;
+				expr.body = std::move(frames.back());
+				frames.pop_back();
+				frames.back().push_back(std::move(expr));
+				break;
+			}
+			default:
+				append_literal(frames.back(), std::string_view(&char_, 1));
+				dollar_found = false;
+				break;
+		};
+	}
+	// unclosed "${": put the text back into the enclosing frame
+	while (frames.size() > 1) {
+		auto parts = std::move(frames.back());
+		frames.pop_back();
+		append_literal(frames.back(), "${");
+		for (auto& part : parts) {
+			if (part.is_expr) {
+				frames.back().push_back(std::move(part));
+			} else {
+				append_literal(frames.back(), part.text);
+			}
+		}
+		ret.unclosed = true;
+	}
+	ret.parts = std::move(frames.back());
+	collect_references(ret.parts, ret);
+	return ret;
+}
+
+template <typename Value>
+void warn_unclosed(Value const& val) {
+	std::cerr << "tomlex: warning while parsing " << val << std::endl
+			  << "  \"${\" is found, but \"}\" is missing" << std::endl;
+}
+
+template <typename Value>
+toml::result<Value, error> evaluate_expression(interp_part const& expr,
+											   resolve_state<Value>& state_);
+
+// evaluates expr, an expression nested in another one
+template <typename Value>
+toml::result<Value, error> evaluate_nested(interp_part const& expr, resolve_state<Value>& state_) {
+	count_guard nested(state_.nesting, state_.max_nesting);
+	if (!nested.ok()) {
+		return toml::err(max_nesting_error(state_));
+	}
+	return evaluate_expression(expr, state_);
+}
+
+template <typename Value>
+toml::result<Value, error> evaluate_expression(interp_part const& expr,
+											   resolve_state<Value>& state_) {
+	auto const& body = expr.body;
+	if (body.size() == 1 && !body.front().is_expr) {
+		return evaluate(body.front().text, state_);
+	}
+	// "${f: ${x}}": the argument is a single expression, so its value goes to the resolver
+	// without being printed and parsed again, unless f has reparse_arguments. Any other text,
+	// e.g. quotes, keeps the argument a string to be parsed.
+	if ((body.size() == 2 || (body.size() == 3 && !body[2].is_expr &&
+							  utils::trim(body[2].text).empty())) &&
+		!body[0].is_expr && body[1].is_expr) {
+		std::string_view head = body[0].text;
+		if (auto colon = head.find(':');
+			colon != std::string::npos && utils::trim(head.substr(colon + 1)).empty()) {
+			auto name = utils::trim(head.substr(0, colon));
+			auto found = find_resolver(name, state_);
+			if (found.is_ok() && !(found.unwrap()->flags & reparse_arguments)) {
+				auto args = evaluate_nested(body[1], state_);
+				if (args.is_err()) {
+					return args;
+				}
+				return apply_custom_resolver(name, std::move(args.unwrap()), state_);
+			}
+		}
+	}
+	std::string text;
+	for (auto const& part : expr.body) {
+		if (!part.is_expr) {
+			text += part.text;
+			continue;
+		}
+		auto evaluated = evaluate_nested(part, state_);
+		if (evaluated.is_err()) {
+			return evaluated;
+		}
+		append_string(text, evaluated.unwrap());
+	}
+	return evaluate(text, state_);
+}
+
+template <typename Value>
+toml::result<Value, error> evaluate_string(interp_string const& compiled, Value const& val,
+										   resolve_state<Value>& state_) {
+	auto const& parts = compiled.parts;
+	std::string out;
+	for (std::size_t i = 0; i < parts.size(); i++) {
+		if (!parts[i].is_expr) {
+			out += parts[i].text;
+			continue;
+		}
+		auto evaluated = evaluate_expression(parts[i], state_);
+		if (evaluated.is_err()) {
+			evaluated.unwrap_err().add_trace(val.as_string().str);
+			return evaluated;
+		}
+		// パースする文字列の先頭が"${"で後端が"}"の場合は、toml::valueをそのまま返す
+		if (out.empty() && i + 1 == parts.size()) {
+			return evaluated;
+		}
+		append_string(out, evaluated.unwrap());
+	}
+	return toml::ok(Value(std::move(out)));
+}
+
+/// <summary>
+/// Splits src into text and "${...}" expressions as compile_string does, without building the
+/// parts, as long as no "${" is nested in an expression or left unclosed. Each call of next
+/// finds the next expression; flat is false once src turns out to need compile_string.
+/// </summary>
+struct flat_scanner {
+	std::string_view src;
+	std::size_t pos = 0;
+	bool flat = true;
+	std::size_t open_brackets = 0;	// unmatched '{' without '$' outside the expressions
+
+	// text is the text before the expression, and body is the expression without "${" and "}".
+	// After the last expression, the rest of src is text.
+	bool next(std::string_view& text, std::string_view& body) {
+		auto i = pos;
+		bool dollar = false;
+		for (; i < src.size(); i++) {
+			const char c = src[i];
+			if (c == '{' && dollar) {
+				break;
+			}
+			if (c == '{') {
+				open_brackets++;
+			} else if (c == '}' && open_brackets > 0) {
+				open_brackets--;
+			}
+			dollar = c == '$';
+		}
+		if (i == src.size()) {
+			return false;
+		}
+		const auto body_begin = ++i;
+		std::size_t inner = 0;	// unmatched '{' in the expression
+		dollar = false;
+		for (; i < src.size(); i++) {
+			const char c = src[i];
+			if (c == '{' && dollar) {
+				flat = false;
+				return false;
+			}
+			if (c == '{') {
+				inner++;
+			} else if (c == '}' && inner > 0) {
+				inner--;
+			} else if (c == '}') {
+				text = src.substr(pos, body_begin - 2 - pos);
+				body = src.substr(body_begin, i - body_begin);
+				pos = i + 1;
+				return true;
+			}
+			dollar = c == '$';
+		}
+		flat = false;  // unclosed
+		return false;
+	}
+};
+
+inline bool is_flat(std::string_view src) {
+	flat_scanner scanner{src};
+	std::string_view text, body;
+	while (scanner.next(text, body)) {
+	}
+	return scanner.flat;
+}
+
+// Same as evaluate_string(compile_string(val.as_string()), val, state_) for a string for which
+// is_flat holds
+template <typename Value>
+toml::result<Value, error> evaluate_flat(Value const& val, resolve_state<Value>& state_) {
+	std::string_view src = val.as_string().str;
+	flat_scanner scanner{src};
+	std::string out;
+	std::string_view text, body;
+	while (scanner.next(text, body)) {
+		out += text;
+		auto evaluated = evaluate(body, state_);
+		if (evaluated.is_err()) {
+			evaluated.unwrap_err().add_trace(val.as_string().str);
+			return evaluated;
+		}
+		if (out.empty() && scanner.pos == src.size()) {
+			return evaluated;
+		}
+		append_string(out, evaluated.unwrap());
+	}
+	out += src.substr(scanner.pos);
+	return toml::ok(Value(std::move(out)));
+}
+
+// containers with copy-on-write storage, such as tomlex::cow_vector, tell how many values share
+// them; any other container is never shared
+template <typename Container>
+auto is_shared(Container const& c, int) -> decltype(c.use_count() > 1) {
+	return c.use_count() > 1;
+}
+template <typename Container>
+bool is_shared(Container const&, long) {
+	return false;
+}
+
+template <typename Value>
+bool is_shared_container(Value const& val) {
+	if (val.is_table()) {
+		return is_shared(val.as_table(), 0);
+	}
+	if (val.is_array()) {
+		return is_shared(val.as_array(), 0);
+	}
+	return false;
+}
+
+// The tree walks below keep the nodes to visit on a stack of their own rather than recursing,
+// so that deeply nested tables and arrays cannot overflow the call stack. Children are pushed
+// in reverse so that they are visited in order.
+template <typename Value>
+bool contains_expression(Value const& val, std::vector<Value const*>& nodes) {
+	nodes.assign(1, &val);
+	while (!nodes.empty()) {
+		Value const& node = *nodes.back();
+		nodes.pop_back();
+		if (node.is_table()) {
+			for (auto const& [k, v] : node.as_table()) {
+				nodes.push_back(&v);
+			}
+		} else if (node.is_array()) {
+			for (auto const& item : node.as_array()) {
+				nodes.push_back(&item);
+			}
+		} else if (node.is_string() && utils::has_interpolation(node.as_string().str)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Appends to state_.dependencies the strings of the root under the node that "${ref}"
+// references, and that are not resolved yet, with ref. A key that is not found is left to the
+// evaluation, which reports it. A table or an array is followed by a mark, so that it is walked
+// again only until its strings are resolved.
+template <typename Value>
+void add_dependencies(std::string_view ref, resolve_state<Value>& state_) {
+	Value const* found = find_reference(ref, state_);
+	if (found == nullptr || state_.resolved_subtrees.find(found) != nullptr) {
+		return;
+	}
+	auto& nodes = state_.scan;
+	nodes.assign(1, found);
+	while (!nodes.empty()) {
+		Value const& v = *nodes.back();
+		nodes.pop_back();
+		if (&v != found && state_.resolved_subtrees.find(&v) != nullptr) {
+			continue;
+		}
+		if (v.is_table()) {
+			for (auto const& [k, item] : v.as_table()) {
+				nodes.push_back(&item);
+			}
+		} else if (v.is_array()) {
+			auto const& array = v.as_array();
+			for (auto it = array.rbegin(); it != array.rend(); ++it) {
+				nodes.push_back(&*it);
+			}
+		} else if (v.is_string() && utils::has_interpolation(v.as_string().str) &&
+				   find_cached(&v, state_) == nullptr) {
+			state_.dependencies.push_back(dependency<Value>{&v, ref});
+		}
+	}
+	if (found->is_table() || found->is_array()) {
+		state_.dependencies.push_back(dependency<Value>{found, ref, true});
+	}
+}
+
+// Pushes node, a string of the root referenced by "${key}", on the work stack of
+// resolve_root_string, with the strings it references. Keys built at resolution, e.g.
+// "${${name}}", are left to the evaluation.
+template <typename Value>
+std::optional<error> push_pending(Value const& node, std::string_view key,
+								  resolve_state<Value>& state_) {
+	if (state_.depth >= state_.max_depth) {
+		return max_depth_error(state_);
+	}
+	state_.depth++;
+	auto& top = state_.pending.emplace_back();
+	top.node = &node;
+	top.key = key;
+	top.compiled = find_compiled(node, state_);
+	if (top.compiled == nullptr && !is_flat(node.as_string().str)) {
+		top.parsed = std::make_unique<interp_string>(compile_string(node.as_string()));
+		if (top.parsed->unclosed) {
+			warn_unclosed(node);
+		}
+		top.compiled = top.parsed.get();
+	}
+	top.first_dependency = top.next = state_.dependencies.size();
+	if (top.compiled != nullptr) {
+		for (std::string_view ref : top.compiled->references) {
+			add_dependencies(ref, state_);
+		}
+	} else {
+		// the same keys as collect_references finds
+		flat_scanner scanner{node.as_string().str};
+		std::string_view text, body;
+		while (scanner.next(text, body)) {
+			if (!body.empty() && body.find(':') == std::string_view::npos) {
+				add_dependencies(utils::trim(body), state_);
+			}
+		}
+	}
+	top.last_dependency = state_.dependencies.size();
+	state_.pending_at.insert(&node, state_.pending.size() - 1);
+	return std::nullopt;
+}
+
+template <typename Value>
+void pop_pending(resolve_state<Value>& state_) {
+	auto& top = state_.pending.back();
+	state_.pending_at.erase(top.node);
+	state_.dependencies.resize(top.first_dependency);
+	state_.depth--;
+	state_.pending.pop_back();
+}
+
+// adds the strings from the top of the work stack down to first, which wait for the one that
+// failed, to the trace of e
+template <typename Value>
+error& add_waiting(error& e, resolve_state<Value> const& state_, std::size_t first) {
+	for (auto i = state_.pending.size(); i-- > first;) {
+		e.add_trace(state_.pending[i].node->as_string().str);
+	}
+	return e;
+}
+
+/// <summary>
+/// Resolves src, a string of the root, and the strings it references. Instead of evaluating
+/// "${key}" recursively, the strings that src references, directly or through a chain, wait on
+/// a stack on the heap, and each is evaluated after the ones it references, so that its
+/// interpolations only hit the cache. A chain of any length up to state_.max_depth takes no
+/// call stack.
+/// </summary>
+template <typename Value>
+toml::result<Value, error> resolve_root_string(Value const& src, resolve_state<Value>& state_) {
+	auto& stack = state_.pending;
+	const auto first = stack.size();  // src; the frames below belong to outer calls
+	auto fail = [&](error&& e) -> toml::result<Value, error> {
+		add_waiting(e, state_, first);
+		while (stack.size() > first) {
+			pop_pending(state_);
+		}
+		return toml::err(std::move(e));
+	};
+	if (auto e = push_pending(src, std::string_view(), state_)) {
+		return toml::err(std::move(*e));
+	}
+	while (stack.size() > first) {
+		auto& top = stack.back();
+		if (top.next < top.last_dependency) {
+			const auto [target, key, subtree] = state_.dependencies[top.next++];
+			if (subtree) {
+				if (!top.skipped && state_.resolved_subtrees.find(target) == nullptr) {
+					state_.resolved_subtrees.insert(target, 0);
+				}
+				continue;
+			}
+			if (find_cached(target, state_) != nullptr) {
+				continue;
+			}
+			if (auto position = state_.pending_at.find(target)) {
+				// waits on this stack for top: a cycle. One that waits on the stack of an outer
+				// call is left to the evaluation, whose interp reports the cycle.
+				if (*position < first) {
+					top.skipped = true;
+					continue;
+				}
+				std::string path(key);
+				for (auto i = *position + 1; i < stack.size(); i++) {
+					path.append(" -> ").append(stack[i].key);
+				}
+				path.append(" -> ").append(key);
+				return fail(error(error::code::circular_reference, "tomlex::detail::interp",
+								  "circular reference detected: " + path));
+			}
+			if (auto e = push_pending(*target, key, state_)) {
+				return fail(std::move(*e));
+			}
+			continue;
+		}
+		// nested calls may move the stack while top is evaluated
+		Value const* node = top.node;
+		if (find_cached(node, state_) == nullptr) {
+			auto result = top.compiled != nullptr ? evaluate_string(*top.compiled, *node, state_)
+												  : evaluate_flat(*node, state_);
+			if (result.is_err()) {
+				pop_pending(state_);  // evaluate_string added it
+				return fail(std::move(result.unwrap_err()));
+			}
+			cache_result(node, std::move(result.unwrap()), state_);
+		}
+		pop_pending(state_);
+	}
+	return toml::ok(*find_cached(&src, state_));
+}
+
+// Resolves src, a string, into dst, which may be src itself; dst is not touched if src contains
+// no expression. Strings of the root are cached by address, so that each of them is evaluated
+// only once however often it is referenced.
+template <typename Value>
+std::optional<error> resolve_string(Value const& src, resolve_state<Value>& state_, bool in_root,
+									Value& dst) {
+	auto compiled = find_compiled(src, state_);
+	if (compiled == nullptr && !utils::has_interpolation(src.as_string().str)) {
+		return std::nullopt;
+	}
+	if (in_root) {
+		if (auto cached = find_cached(&src, state_)) {
+			dst = *cached;
+			return std::nullopt;
+		}
+		if (state_.pending_at.find(&src) == nullptr) {
+			auto result = resolve_root_string(src, state_);
+			if (result.is_err()) {
+				return std::move(result.unwrap_err());
+			}
+			dst = std::move(result.unwrap());
+			return std::nullopt;
+		}
+		// src is waiting on the stack for a string that refers back to it, directly or through
+		// a key built at resolution: evaluate it here, and let interp report a cycle
+	}
+	count_guard guard(state_.depth, state_.max_depth);
+	if (!guard.ok()) {
+		return max_depth_error(state_);
+	}
+	std::optional<interp_string> parsed;
+	if (compiled == nullptr && !is_flat(src.as_string().str)) {
+		parsed = compile_string(src.as_string());
+		if (parsed->unclosed) {
+			warn_unclosed(src);
+		}
+		compiled = &*parsed;
+	}
+	auto result = compiled != nullptr ? evaluate_string(*compiled, src, state_)
+									  : evaluate_flat(src, state_);
+	if (result.is_err()) {
+		return std::move(result.unwrap_err());
+	}
+	if (in_root) {
+		dst = cache_result(&src, std::move(result.unwrap()), state_);
+	} else {
+		dst = std::move(result.unwrap());
+	}
+	return std::nullopt;
+}
+
+// Resolves val in place. Strings without "${" are not touched.
+template <typename Value>
+std::optional<error> resolve_in_place(Value& val, resolve_state<Value>& state_, bool in_root) {
+	auto& nodes = state_.walk;
+	const auto first = nodes.size();
+	nodes.emplace_back(&val, nullptr);
+	while (nodes.size() > first) {
+		Value& node = *nodes.back().first;
+		nodes.pop_back();
+		// a shared container would be copied by the non-const access below
+		if (is_shared_container(node) && !contains_expression(node, state_.scan)) {
+			continue;
+		}
+		const auto children = nodes.size();
+		if (node.is_table()) {
+			for (auto& [k, v] : node.as_table()) {
+				nodes.emplace_back(&v, nullptr);
+			}
+		} else if (node.is_array()) {
+			for (auto& item : node.as_array()) {
+				nodes.emplace_back(&item, nullptr);
+			}
+		} else if (node.is_string() && utils::has_interpolation(node.as_string().str)) {
+			if (auto e = resolve_string(node, state_, in_root, node)) {
+				nodes.resize(first);
+				return e;
+			}
+		}
+		std::reverse(nodes.begin() + children, nodes.end());
+	}
+	return std::nullopt;
+}
+
+/// <summary>
+/// Resolves val in place. in_root tells that val is a node of the root, which outlives the
+/// resolution, rather than a temporary such as the return value of a resolver.
+/// </summary>
+template <typename Value>
+toml::result<Value, error> resolve_impl(Value&& val, resolve_state<Value>& state_, bool in_root) {
+	if (auto e = resolve_in_place(val, state_, in_root)) {
+		return toml::err(std::move(*e));
+	}
+	return toml::ok(std::move(val));
+}
+
+// resolves dst, a copy of src, looking up the strings by the address of their node in src
+template <typename Value>
+std::optional<error> resolve_copy(Value& dst, Value const& src, resolve_state<Value>& state_) {
+	auto& nodes = state_.walk;
+	const auto first = nodes.size();
+	nodes.emplace_back(&dst, &src);
+	while (nodes.size() > first) {
+		const auto [d, s] = nodes.back();
+		nodes.pop_back();
+		// keep sharing the containers of src that have nothing to resolve
+		if (is_shared_container(*d) && !contains_expression(*s, state_.scan)) {
+			continue;
+		}
+		const auto children = nodes.size();
+		if (d->is_table()) {
+			auto const& src_table = s->as_table();
+			for (auto& [k, v] : d->as_table()) {
+				nodes.emplace_back(&v, &src_table.at(k));
+			}
+		} else if (d->is_array()) {
+			auto& array = d->as_array();
+			for (std::size_t i = 0; i < array.size(); i++) {
+				nodes.emplace_back(&array[i], &s->as_array()[i]);
+			}
+		} else if (d->is_string() && utils::has_interpolation(s->as_string().str)) {
+			if (auto e = resolve_string(*s, state_, true, *d)) {
+				nodes.resize(first);
+				return e;
+			}
+		}
+		std::reverse(nodes.begin() + children, nodes.end());
 	}
+	return std::nullopt;
 }
 
+/// <summary>
+/// Resolved copy of src, a node of the root. src itself may be resolved in place later, or may
+/// already have been, and is not modified.
+/// </summary>
 template <typename Value>
-Value interp(std::string_view dst, Value const& root_,
-			 std::unordered_set<std::string>& interpolating_) {
-	if (dst.empty()) {
-		throw std::runtime_error("tomlex::detail::interp: empty interpolation key");
-	}
-
-	std::string key(dst);
-	if (interpolating_.find(key) != interpolating_.end()) {
-		throw std::runtime_error(
-			"tomlex::detail::register_resolver: circular reference detected: keyword: \"" + key +
-			"\"");
+toml::result<Value, error> resolve_node(Value const& src, resolve_state<Value>& state_) {
+	Value ret = src;  // copy
+	if (auto e = resolve_copy(ret, src, state_)) {
+		return toml::err(std::move(*e));
 	}
-	interpolating_.insert(key);
-
-	// stringで返しているので遅いが、toml11のatはstd::string_viewをとれないのでこれで問題ない
-	auto splitted = utils::split(key, '.');
+	return toml::ok(std::move(ret));
+}
 
-	Value const* node = &root_;
-	for (auto& item : splitted) {
-		if (!node->contains(item)) {
-			throw std::runtime_error("tomlex::detail::register_resolver: interpolation key \"" +
-									 item + "\" in \"" + key + "\" is not found");
+// appends the keys referenced by the strings of root to refs; dynamic is set if a key is built
+// at resolution
+template <typename Value>
+void collect_references(Value const& root, std::vector<std::string>& refs, bool& dynamic) {
+	std::vector<Value const*> nodes{&root};
+	while (!nodes.empty()) {
+		Value const& node = *nodes.back();
+		nodes.pop_back();
+		if (node.is_table()) {
+			for (auto const& [k, v] : node.as_table()) {
+				nodes.push_back(&v);
+			}
+		} else if (node.is_array()) {
+			for (auto const& item : node.as_array()) {
+				nodes.push_back(&item);
+			}
+		} else if (node.is_string() && utils::has_interpolation(node.as_string().str)) {
+			auto compiled = compile_string(node.as_string());
+			refs.insert(refs.end(), compiled.references.begin(), compiled.references.end());
+			dynamic |= compiled.has_dynamic_reference;
 		}
-		Value const& tmp = node->at(item);
-		node = &tmp;
 	}
-	Value ret = *node;	// copy
-	Value result = resolve_impl(std::move(ret), root_, interpolating_);
-	interpolating_.erase(key);
-	return result;
 }
 
+// adds the strings of src, a node of the root, to cache with their values in dst, the node that
+// src was resolved into
 template <typename Value>
-Value apply_custom_resolver(std::string_view resolver_name, std::string_view arr_str,
-							Value const& root_, std::unordered_set<std::string>& interpolating_) {
-	if (resolver_name.empty()) {
-		throw std::runtime_error("tomlex::detail::apply_custom_resolver: empty resolver_name");
-	}
-	std::string key(resolver_name);
-	if (auto it = resolver_table<Value>.find(key); it != resolver_table<Value>.end()) {
-		resolver_type<Value> func = it->second;
-		Value result;
-		if (arr_str.empty()) {
-			result = func(Value{});
-		} else {
-			result = func(to_toml_value<Value>(std::string(arr_str)));
+void seed_cache(Value const& src, Value const& dst, resolve_cache<Value>& cache) {
+	std::vector<std::pair<Value const*, Value const*>> nodes{{&src, &dst}};
+	while (!nodes.empty()) {
+		const auto [s, d] = nodes.back();
+		nodes.pop_back();
+		if (s->is_table()) {
+			auto const& dst_table = d->as_table();
+			for (auto const& [k, v] : s->as_table()) {
+				nodes.emplace_back(&v, &dst_table.at(k));
+			}
+		} else if (s->is_array()) {
+			for (std::size_t i = 0; i < s->as_array().size(); i++) {
+				nodes.emplace_back(&s->as_array()[i], &d->as_array()[i]);
+			}
+		} else if (s->is_string() && utils::has_interpolation(s->as_string().str)) {
+			cache.emplace(s, *d);
 		}
-		return resolve_impl(std::move(result), root_, interpolating_);
-	}  // namespace detail
-	std::ostringstream oss;
-	oss << "tomlex::detail::apply_custom_resolver: non-registered resolver_type: \"" + key + "\", "
-		<< "registered: ";
-	for (const auto& [k, v] : resolver_table<Value>) {
-		oss << k << ", ";
 	}
-	throw std::runtime_error(oss.str());
-}  // namespace tomlex
+}
 
+// adds the strings of src, a node of the root, to cache with the values that a failed
+// resolution of work, a copy of src resolved in place, had cached in done for them. The tables
+// and arrays of work are still those of src, but its strings may have been replaced by their
+// values
 template <typename Value>
-std::string to_string(Value const& val) {
-	std::ostringstream oss;
-	if (val.is_string()) {
-		return val.as_string();
+void seed_cache_partial(Value const& src, Value const& work, resolve_cache<Value> const& done,
+						resolve_cache<Value>& cache) {
+	std::vector<std::pair<Value const*, Value const*>> nodes{{&src, &work}};
+	while (!nodes.empty()) {
+		const auto [s, w] = nodes.back();
+		nodes.pop_back();
+		if (s->is_table()) {
+			auto const& work_table = w->as_table();
+			for (auto const& [k, v] : s->as_table()) {
+				nodes.emplace_back(&v, &work_table.at(k));
+			}
+		} else if (s->is_array()) {
+			for (std::size_t i = 0; i < s->as_array().size(); i++) {
+				nodes.emplace_back(&s->as_array()[i], &w->as_array()[i]);
+			}
+		} else if (s->is_string() && utils::has_interpolation(s->as_string().str)) {
+			if (auto it = done.find(w); it != done.end()) {
+				cache.emplace(s, it->second);
+			}
+		}
 	}
+}
 
-	oss << toml::visit(
-		toml::serializer<Value>((std::numeric_limits<std::size_t>::max)(),
-								std::numeric_limits<toml::floating>::max_digits10, true, true),
-		val);
-	return oss.str();
+/// <summary>
+/// Strongly connected components of a graph given as adjacency lists, in the order Tarjan's
+/// algorithm completes them: every component comes after the components it has edges to.
+/// </summary>
+inline std::vector<std::vector<std::size_t>> strong_components(
+	std::vector<std::vector<std::size_t>> const& edges) {
+	constexpr auto unvisited = (std::numeric_limits<std::size_t>::max)();
+	const auto n = edges.size();
+	std::vector<std::size_t> order(n, unvisited), low(n, 0);
+	std::vector<bool> on_stack(n, false);
+	std::vector<std::size_t> stack;
+	std::vector<std::pair<std::size_t, std::size_t>> calls;	// (vertex, next edge)
+	std::vector<std::vector<std::size_t>> components;
+	std::size_t counter = 0;
+
+	auto visit = [&](std::size_t v) {
+		order[v] = low[v] = counter++;
+		stack.push_back(v);
+		on_stack[v] = true;
+		calls.emplace_back(v, 0);
+	};
+	for (std::size_t root = 0; root < n; root++) {
+		if (order[root] != unvisited) {
+			continue;
+		}
+		visit(root);
+		while (!calls.empty()) {
+			const auto [v, e] = calls.back();
+			if (e < edges[v].size()) {
+				calls.back().second++;
+				const auto w = edges[v][e];
+				if (order[w] == unvisited) {
+					visit(w);
+				} else if (on_stack[w]) {
+					low[v] = std::min(low[v], order[w]);
+				}
+				continue;
+			}
+			calls.pop_back();
+			if (!calls.empty()) {
+				auto& parent = low[calls.back().first];
+				parent = std::min(parent, low[v]);
+			}
+			if (low[v] == order[v]) {
+				auto& component = components.emplace_back();
+				std::size_t w;
+				do {
+					w = stack.back();
+					stack.pop_back();
+					on_stack[w] = false;
+					component.push_back(w);
+				} while (w != v);
+			}
+		}
+	}
+	return components;
 }
 
 template <typename Value>
-Value evaluate(std::string_view expr, Value const& root_,
-			   std::unordered_set<std::string>& interpolating_) {
-	auto pos_first_colon = expr.find(':');
+toml::result<Value, error> resolve_serial(Value&& root, resolver_map<Value> const& resolvers,
+										  std::size_t max_depth, std::size_t max_nesting,
+										  resolver_memo<Value>* memo) {
+	resolve_cache<Value> cache;
+	resolve_state<Value> state{root, cache, resolvers};
+	state.max_depth = max_depth;
+	state.max_nesting = max_nesting;
+	state.memo = memo;
+	return resolve_impl(std::move(root), state, true);
+}
 
-	// コロンがないのでinterp
-	if (pos_first_colon == std::string::npos) {
-		expr = utils::trim(expr);
-		auto evaluated = interp(expr, root_, interpolating_);
-		return evaluated;
+template <typename Value>
+toml::result<Value, error> resolve_parallel(Value&& root, resolver_map<Value> const& resolvers,
+											std::size_t max_depth, std::size_t max_nesting,
+											parallel const& options, resolver_memo<Value>* memo) {
+	const unsigned threads = options.threads != 0
+								 ? options.threads
+								 : (std::max)(1u, std::thread::hardware_concurrency());
+	if (threads <= 1 || !root.is_table() || root.as_table().size() < 2) {
+		return resolve_serial(std::move(root), resolvers, max_depth, max_nesting, memo);
 	}
 
-	// 関数適用
-	std::string_view func_name = utils::trim(expr.substr(0, pos_first_colon));
-	std::string_view args = utils::trim(expr.substr(pos_first_colon + 1));
-	auto evaluated = apply_custom_resolver(func_name, args, root_, interpolating_);
-	return evaluated;
-}
-
-inline int calc_charsize(unsigned char const lead) {
-	if (lead < 0x80) {
-		return 1;
+	// dependency graph of the top-level sections
+	std::vector<std::string_view> keys;
+	std::unordered_map<std::string_view, std::size_t> section_of;
+	for (auto const& [k, v] : root.as_table()) {
+		section_of.emplace(k, keys.size());
+		keys.emplace_back(k);
 	}
-	if (lead < 0xE0) {
-		return 2;
+	std::vector<std::vector<std::size_t>> edges(keys.size());
+	std::vector<bool> dynamic(keys.size(), false);
+	for (std::size_t i = 0; i < keys.size(); i++) {
+		std::vector<std::string> refs;
+		bool has_dynamic = false;
+		collect_references(root.as_table().at(std::string(keys[i])), refs, has_dynamic);
+		dynamic[i] = has_dynamic;
+		for (auto const& ref : refs) {
+			auto head = std::string_view(ref).substr(0, ref.find('.'));
+			if (auto it = section_of.find(head); it != section_of.end() && it->second != i) {
+				edges[i].push_back(it->second);
+			}
+		}
+		std::sort(edges[i].begin(), edges[i].end());
+		edges[i].erase(std::unique(edges[i].begin(), edges[i].end()), edges[i].end());
 	}
-	if (lead < 0xF0) {
-		return 3;
+
+	// one task per group of sections that reference each other
+	const auto components = strong_components(edges);
+	const auto n_tasks = components.size();
+	std::vector<std::size_t> task_of(keys.size());
+	for (std::size_t t = 0; t < n_tasks; t++) {
+		for (auto i : components[t]) {
+			task_of[i] = t;
+		}
 	}
-	return 4;
-}
-template <typename Value>
-Value resolve_impl(Value&& val, Value const& root_,
-				   std::unordered_set<std::string>& interpolating_) {
-	if (val.is_table()) {
-		for (auto& [k, v] : val.as_table()) {
-			val[k] = std::move(resolve_impl(std::move(v), root_, interpolating_));
+	std::vector<std::vector<std::size_t>> dependencies(n_tasks), dependents(n_tasks);
+	for (std::size_t t = 0; t < n_tasks; t++) {
+		for (auto i : components[t]) {
+			for (auto j : edges[i]) {
+				if (task_of[j] != t) {
+					dependencies[t].push_back(task_of[j]);
+				}
+			}
 		}
-		return std::move(val);
-	} else if (val.is_array()) {
-		int i = 0;
-		for (auto& item : val.as_array()) {
-			val[i] = std::move(resolve_impl(std::move(item), root_, interpolating_));
-			i++;
+		auto& deps = dependencies[t];
+		std::sort(deps.begin(), deps.end());
+		deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+		for (auto d : deps) {
+			dependents[d].push_back(t);
 		}
-		return std::move(val);
-	}
-	if (!val.is_string()) {
-		return std::move(val);
 	}
 
-	bool dollar_found = false;
-	int step_size = 0;
-	std::string value_str = std::move(val.as_string());
-	std::stack<std::pair<size_t, bool>> dist_left_bracket_st;
-
-	for (auto it = value_str.begin(); it != value_str.end(); it += step_size) {
-		unsigned char char_ = *it;
-		step_size = calc_charsize(char_);
+	// the tasks share the results of pure resolvers
+	std::optional<resolver_memo<Value>> own_memo;
+	if (memo == nullptr) {
+		memo = &own_memo.emplace();
+	}
 
-		switch (char_) {
-			case '$':
-				dollar_found = true;
-				break;
-			case '{':
-				dist_left_bracket_st.push(
-					std::make_pair(std::distance(value_str.begin(), it), dollar_found));
-				dollar_found = false;
-				break;
-			case '}': {
-				dollar_found = false;
-				if (dist_left_bracket_st.empty()) {
-					break;
-				}
-				auto const& [dist_left, enable_eval] = dist_left_bracket_st.top();
-				dist_left_bracket_st.pop();
-				if (!enable_eval) {
-					break;
+	// each task resolves copies of its sections, reading the sections of its dependencies from
+	// their results; root itself stays untouched until every task has succeeded. A task that
+	// fails keeps its partly resolved copies and the strings it resolved, for the serial path
+	std::vector<Value> results(n_tasks);
+	std::vector<Value> works(n_tasks);
+	std::vector<resolve_cache<Value>> caches(n_tasks);
+	auto run = [&](std::size_t t) {
+		auto& work = works[t];
+		work = Value{typename Value::table_type{}};
+		for (auto i : components[t]) {
+			work[std::string(keys[i])] = root.as_table().at(std::string(keys[i]));
+		}
+		std::unordered_map<std::string_view, Value const*> sections;
+		for (auto i : components[t]) {
+			sections.emplace(keys[i], &work.as_table().at(std::string(keys[i])));
+		}
+		for (auto d : dependencies[t]) {
+			for (auto i : components[d]) {
+				sections.emplace(keys[i], &results[d].as_table().at(std::string(keys[i])));
+			}
+		}
+		auto& cache = caches[t];
+		resolve_state<Value> state{root, cache, resolvers};
+		state.sections = &sections;
+		state.max_depth = max_depth;
+		state.max_nesting = max_nesting;
+		state.memo = memo;
+		// resolve_impl resolves work in place, so it is still there if the resolution fails
+		auto result = resolve_impl(std::move(work), state, true);
+		if (result.is_err()) {
+			return false;
+		}
+		results[t] = std::move(result.unwrap());
+		resolve_cache<Value>().swap(cache);
+		return true;
+	};
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<std::size_t> ready;
+	std::vector<std::size_t> pending(n_tasks);
+	// tasks left to the serial path, and every task that depends on one of them
+	std::vector<bool> serial(n_tasks, false);
+	// tasks that ran and failed, whose works and caches are kept
+	std::vector<bool> failed(n_tasks, false);
+	std::size_t remaining = n_tasks;
+	auto leave_to_serial = [&](std::size_t task) {
+		std::vector<std::size_t> tasks{task};
+		serial[task] = true;
+		remaining--;
+		while (!tasks.empty()) {
+			const auto t = tasks.back();
+			tasks.pop_back();
+			for (auto d : dependents[t]) {
+				if (!serial[d]) {
+					serial[d] = true;
+					remaining--;
+					tasks.push_back(d);
 				}
-				auto left = value_str.begin() + dist_left;
-				try {
-					auto evaluated =
-						evaluate(std::string_view{&(*(left + 1)),
-												  static_cast<size_t>(std::distance(left + 1, it))},
-								 root_, interpolating_);
-					// パースする文字列の先頭が"${"で後端が"}"の場合は、toml::valueをそのまま返す
-					if ((left - 1) == value_str.begin() && (it + 1) == value_str.end()) {
-						return evaluated;
+			}
+		}
+	};
+	for (std::size_t t = 0; t < n_tasks; t++) {
+		pending[t] = dependencies[t].size();
+		// the graph does not show what a key built at resolution references
+		if (!serial[t] && std::any_of(components[t].begin(), components[t].end(),
+									  [&](std::size_t i) { return dynamic[i]; })) {
+			leave_to_serial(t);
+		}
+	}
+	for (std::size_t t = 0; t < n_tasks; t++) {
+		if (pending[t] == 0 && !serial[t]) {
+			ready.push_back(t);
+		}
+	}
+	auto worker = [&] {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cv.wait(lock, [&] { return remaining == 0 || !ready.empty(); });
+			if (ready.empty()) {
+				return;
+			}
+			const auto t = ready.front();
+			ready.pop_front();
+			lock.unlock();
+			// run returns the errors of the resolution; only a failed allocation throws
+			bool succeeded = false;
+			bool threw = false;
+			try {
+				succeeded = run(t);
+			} catch (...) {
+				threw = true;
+			}
+			lock.lock();
+			if (!succeeded) {
+				failed[t] = !threw;
+				leave_to_serial(t);
+			} else {
+				remaining--;
+				for (auto d : dependents[t]) {
+					if (--pending[d] == 0 && !serial[d]) {
+						ready.push_back(d);
 					}
-					auto evaluated_str = to_string(evaluated);
-					value_str.erase(left - 1, it + 1);
-					auto dist_to_dollar = std::distance(value_str.begin(), left - 1);
-					value_str.insert(dist_to_dollar, evaluated_str);
-					it = value_str.begin() + dist_to_dollar + evaluated_str.size();
-					step_size = 0;
-				} catch (std::exception& e) {
-					std::ostringstream oss;
-					auto err = std::string(e.what());
-					utils::replace_all(err, "\n", "\n  ");
-					oss << "error while processing " << val << std::endl << "  " << err;
-					throw std::runtime_error(oss.str());
 				}
-				break;
 			}
-			default:
-				dollar_found = false;
-				break;
-		};
+			cv.notify_all();
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < (std::min)(static_cast<std::size_t>(threads), n_tasks); i++) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (auto& th : pool) {
+		th.join();
+	}
+
+	if (std::find(serial.begin(), serial.end(), true) != serial.end()) {
+		// resolve the other sections as the serial path would, in the order of root, reading
+		// the strings of the tasks that succeeded from their results, and those that failed
+		// tasks completed from their caches, so that the resolvers of those strings are not
+		// called again
+		resolve_cache<Value> cache;
+		for (std::size_t t = 0; t < n_tasks; t++) {
+			for (auto i : components[t]) {
+				const std::string key(keys[i]);
+				if (!serial[t]) {
+					seed_cache(root.as_table().at(key), results[t].as_table().at(key), cache);
+				} else if (failed[t]) {
+					seed_cache_partial(root.as_table().at(key), works[t].as_table().at(key),
+									   caches[t], cache);
+				}
+			}
+		}
+		resolve_state<Value> state{root, cache, resolvers};
+		state.max_depth = max_depth;
+		state.max_nesting = max_nesting;
+		state.memo = memo;
+		for (auto& [k, v] : root.as_table()) {
+			if (serial[task_of[section_of.at(k)]]) {
+				if (auto e = resolve_in_place(v, state, true)) {
+					return toml::err(std::move(*e));
+				}
+			}
+		}
 	}
-	while (!dist_left_bracket_st.empty()) {
-		auto const& [dist_left, enable_eval] = dist_left_bracket_st.top();
-		dist_left_bracket_st.pop();
-		if (!enable_eval) {
+	for (std::size_t t = 0; t < n_tasks; t++) {
+		if (serial[t]) {
 			continue;
 		}
-		std::cerr << "tomlex: warning while parsing " << val << std::endl
-				  << "  \"${\" is found, but \"}\" is missing" << std::endl;
+		for (auto i : components[t]) {
+			const std::string key(keys[i]);
+			root[key] = std::move(results[t].as_table().at(key));
+		}
 	}
-	return value_str;
+	return toml::ok(std::move(root));
 }
 
 template <typename Value = toml::value, typename... Keys>
-Value find(Value const& root, Value const& cfg, Keys&&... keys) {
-	std::unordered_set<std::string> interpolating;
+Value find(context<Value> const& ctx, resolve_cache<Value>& cache, Value const& root,
+		   Value const& cfg, Keys&&... keys) {
+	const auto resolvers = ctx.resolvers();
+	resolve_state<Value> state{root, cache, *resolvers};
+	state.max_depth = ctx.max_depth();
+	state.max_nesting = ctx.max_nesting();
 	Value val = toml::find(cfg, std::forward<Keys>(keys)...);
-	return resolve_impl(std::move(val), root, interpolating);
+	return value_or_throw(resolve_impl(std::move(val), state));
+}
+
+template <typename Value = toml::value, typename... Keys>
+Value find(resolve_cache<Value>& cache, Value const& root, Value const& cfg, Keys&&... keys) {
+	return find(default_context<Value>(), cache, root, cfg, std::forward<Keys>(keys)...);
+}
+
+template <typename Value = toml::value, typename... Keys>
+Value find(context<Value> const& ctx, Value const& root, Value const& cfg, Keys&&... keys) {
+	resolve_cache<Value> cache;
+	return find(ctx, cache, root, cfg, std::forward<Keys>(keys)...);
+}
+
+template <typename Value = toml::value, typename... Keys>
+Value find(Value const& root, Value const& cfg, Keys&&... keys) {
+	return find(default_context<Value>(), root, cfg, std::forward<Keys>(keys)...);
+}
+
+template <typename Value, typename... Keys>
+Value find_from_root_impl(context<Value> const& ctx, resolve_cache<Value>& cache,
+						  Value const& root, index<Value> const* keys_index, Keys&&... keys) {
+	Value const& node = toml::find(root, std::forward<Keys>(keys)...);
+	const auto resolvers = ctx.resolvers();
+	resolve_state<Value> state{root, cache, *resolvers};
+	state.keys = keys_index;
+	state.max_depth = ctx.max_depth();
+	state.max_nesting = ctx.max_nesting();
+	return value_or_throw(resolve_node(node, state));
+}
+
+template <typename Value = toml::value, typename... Keys>
+Value find_from_root(context<Value> const& ctx, resolve_cache<Value>& cache, Value const& root,
+					 Keys&&... keys) {
+	return find_from_root_impl<Value>(ctx, cache, root, nullptr, std::forward<Keys>(keys)...);
+}
+
+template <typename Value = toml::value, typename... Keys>
+Value find_from_root(resolve_cache<Value>& cache, Value const& root, Keys&&... keys) {
+	return find_from_root_impl<Value>(default_context<Value>(), cache, root, nullptr,
+									  std::forward<Keys>(keys)...);
+}
+
+/// <summary>
+/// Same as find_from_root(cache, *keys_index.root(), keys...), but reuses keys_index for the
+/// interpolations instead of indexing the root on every call.
+/// </summary>
+template <typename Value = toml::value, typename... Keys>
+Value find_from_root(context<Value> const& ctx, resolve_cache<Value>& cache,
+					 index<Value> const& keys_index, Keys&&... keys) {
+	return find_from_root_impl(ctx, cache, *keys_index.root(), &keys_index,
+							   std::forward<Keys>(keys)...);
+}
+
+template <typename Value = toml::value, typename... Keys>
+Value find_from_root(resolve_cache<Value>& cache, index<Value> const& keys_index, Keys&&... keys) {
+	return find_from_root(default_context<Value>(), cache, keys_index, std::forward<Keys>(keys)...);
 }
 
 template <typename Value = toml::value, typename... Keys>
+Value find_from_root(context<Value> const& ctx, Value const& root, Keys&&... keys) {
+	resolve_cache<Value> cache;
+	return find_from_root(ctx, cache, root, std::forward<Keys>(keys)...);
+}
+
+template <typename Value = toml::value, typename... Keys,
+		  std::enable_if_t<toml::detail::is_basic_value<Value>::value, std::nullptr_t> = nullptr>
 Value find_from_root(Value const& root, Keys&&... keys) {
-	std::unordered_set<std::string> interpolating;
-	Value val = toml::find(root, std::forward<Keys>(keys)...);
-	return resolve_impl(std::move(val), root, interpolating);
+	return find_from_root(default_context<Value>(), root, std::forward<Keys>(keys)...);
 }
 
 // following code is derived from toml11
@@ -459,16 +3399,70 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
+// lexers tried by guess_number_type_strict, in this order
+enum lexer_step : unsigned {
+	step_offset_datetime = 1u << 0,
+	step_local_datetime = 1u << 1,
+	step_local_date = 1u << 2,
+	step_local_time = 1u << 3,
+	step_float = 1u << 4,
+	step_integer = 1u << 5,
+	step_boolean = 1u << 6,
+	step_string = 1u << 7,
+	all_lexer_steps = (1u << 8) - 1,
+};
+
+/// <summary>
+/// The lexers that can match the beginning of the value at l, judged from its first bytes:
+/// a quote starts a string, 't' and 'f' a boolean, "dddd-" a date or a datetime, "dd:" a time,
+/// and a sign, a digit, "inf" or "nan" a number. Every other lexer would fail, so skipping them
+/// gives the same result as trying all of them.
+/// </summary>
+inline unsigned classify_lexer_steps(const toml::detail::location& l) {
+	const auto first = l.iter();
+	const auto size = l.end() - first;
+	const auto is_digit = [&](std::ptrdiff_t i) {
+		return i < size && '0' <= first[i] && first[i] <= '9';
+	};
+	switch (first[0]) {
+		case '"':
+		case '\'':
+			return step_string;
+		case 't':
+		case 'f':
+			return step_boolean;
+		case 'i':
+		case 'n':
+		case '+':
+		case '-':
+			return step_float | step_integer;
+		default:
+			break;
+	}
+	if (!is_digit(0)) {
+		return 0;
+	}
+	if (is_digit(1) && is_digit(2) && is_digit(3) && 4 < size && first[4] == '-') {
+		return step_offset_datetime | step_local_datetime | step_local_date | step_float |
+			   step_integer;
+	}
+	if (is_digit(1) && 2 < size && first[2] == ':') {
+		return step_local_time | step_float | step_integer;
+	}
+	return step_float | step_integer;
+}
+
 // orig: toml/parser.hpp
-inline toml::result<toml::value_t, std::string> guess_number_type_strict(
-	const toml::detail::location& l) {
+// tries the lexers in steps in order; the first one that matches decides the type
+inline toml::result<toml::value_t, std::string> guess_number_type_with(
+	const toml::detail::location& l, unsigned steps) {
 	// suffixが付いていたらパース失敗とする
 	using namespace toml;
 	using namespace toml::detail;
 
 	location loc = l;
 
-	if (lex_offset_date_time::invoke(loc)) {
+	if ((steps & step_offset_datetime) && lex_offset_date_time::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(format_underline("bad offset_date_time: invalid suffix",
 										{{source_location(loc), "here"}}));
@@ -477,7 +3471,7 @@ inline toml::result<toml::value_t, std::string> guess_number_type_strict(
 	}
 	loc.reset(l.iter());
 
-	if (lex_local_date_time::invoke(loc)) {
+	if ((steps & step_local_datetime) && lex_local_date_time::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(format_underline("bad local_date_time: invalid suffix",
 										{{source_location(loc), "here"}}));
@@ -486,7 +3480,7 @@ inline toml::result<toml::value_t, std::string> guess_number_type_strict(
 	}
 	loc.reset(l.iter());
 
-	if (lex_local_date::invoke(loc)) {
+	if ((steps & step_local_date) && lex_local_date::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(format_underline("bad local_date: invalid suffix",
 										{{source_location(loc), "here"}}));
@@ -495,7 +3489,7 @@ inline toml::result<toml::value_t, std::string> guess_number_type_strict(
 	}
 	loc.reset(l.iter());
 
-	if (lex_local_time::invoke(loc)) {
+	if ((steps & step_local_time) && lex_local_time::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(format_underline("bad local_time: invalid suffix",
 										{{source_location(loc), "here"}}));
@@ -504,7 +3498,7 @@ inline toml::result<toml::value_t, std::string> guess_number_type_strict(
 	}
 	loc.reset(l.iter());
 
-	if (lex_float::invoke(loc)) {
+	if ((steps & step_float) && lex_float::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(
 				format_underline("bad float: invalid suffix", {{source_location(loc), "here"}}));
@@ -512,7 +3506,7 @@ inline toml::result<toml::value_t, std::string> guess_number_type_strict(
 		return ok(value_t::floating);
 	}
 	loc.reset(l.iter());
-	if (lex_integer::invoke(loc)) {
+	if ((steps & step_integer) && lex_integer::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(
 				format_underline("bad integer: invalid suffix", {{source_location(loc), "here"}}));
@@ -520,7 +3514,7 @@ inline toml::result<toml::value_t, std::string> guess_number_type_strict(
 		return ok(value_t::integer);
 	}
 	loc.reset(l.iter());
-	if (lex_boolean::invoke(loc)) {
+	if ((steps & step_boolean) && lex_boolean::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(
 				format_underline("bad boolean: invalid suffix", {{source_location(loc), "here"}}));
@@ -528,17 +3522,23 @@ inline toml::result<toml::value_t, std::string> guess_number_type_strict(
 		return ok(value_t::boolean);
 	}
 	loc.reset(l.iter());
-	if (lex_string::invoke(loc)) {
+	if ((steps & step_string) && lex_string::invoke(loc)) {
 		if (loc.iter() != loc.end()) {
 			return err(
 				format_underline("bad string: invalid suffix", {{source_location(loc), "here"}}));
 		}
 		return ok(value_t::string);
 	}
+	loc.reset(l.iter());
 	return err(
 		format_underline("bad format: unknown value appeared", {{source_location(loc), "here"}}));
 }
 
+inline toml::result<toml::value_t, std::string> guess_number_type_strict(
+	const toml::detail::location& loc) {
+	return guess_number_type_with(loc, classify_lexer_steps(loc));
+}
+
 inline toml::result<toml::value_t, std::string> guess_value_type_strict(
 	const toml::detail::location& loc) {
 	using namespace toml;
@@ -619,9 +3619,334 @@ toml::result<Value, std::string> parse_value_strict(toml::detail::location& loc)
 	}
 }
 
-// from toml::literals::toml_literals
+// "key = value" with a dotted key, or nullopt if arg is anything else
+template <typename Value>
+std::optional<std::pair<std::vector<toml::key>, Value>> parse_key_value(
+	toml::detail::location& loc) {
+	using skip_ws = ::toml::detail::maybe<::toml::detail::lex_ws>;
+	skip_ws::invoke(loc);
+	auto keys = ::toml::detail::parse_key(loc);
+	if (!keys) {
+		return std::nullopt;
+	}
+	skip_ws::invoke(loc);
+	if (loc.iter() == loc.end() || *loc.iter() != '=') {
+		return std::nullopt;
+	}
+	loc.advance();
+	skip_ws::invoke(loc);
+	const std::string_view rest =
+		loc.iter() == loc.end() ? std::string_view()
+								: std::string_view(&*loc.iter(), loc.end() - loc.iter());
+	if (auto scalar = parse_scalar<Value>(utils::rtrim(rest))) {
+		return std::make_pair(std::move(keys.unwrap().first), std::move(*scalar));
+	}
+	auto value = ::toml::detail::parse_value<Value>(loc);
+	if (!value) {
+		return std::nullopt;
+	}
+	skip_ws::invoke(loc);
+	::toml::detail::maybe<::toml::detail::lex_comment>::invoke(loc);
+	if (loc.iter() != loc.end()) {
+		return std::nullopt;
+	}
+	return std::make_pair(std::move(keys.unwrap().first), std::move(value.unwrap()));
+}
+
+// u as an rvalue unless Overlay, the type of the overlay that u belongs to, is an lvalue
+template <typename Overlay, typename U>
+decltype(auto) forward_like(U& u) {
+	if constexpr (std::is_lvalue_reference_v<Overlay>) {
+		return static_cast<U const&>(u);
+	} else {
+		return std::move(u);
+	}
+}
+
+// the merge functions return the error instead of throwing it, for tomlex::try_merge
+
+template <typename Value>
+std::optional<error> check_types_to_merge(Value const& base, Value const& overlay) {
+	if (base.type() == overlay.type()) {
+		return std::nullopt;
+	}
+	return error(error::code::type_mismatch, "tomlex::merge", "type mismatch")
+		.set_types(base.type(), overlay.type())
+		.set_region(overlay.location());
+}
+
+template <typename Value, typename OverlayTable>
+std::optional<error> merge_table(typename Value::table_type& base, OverlayTable&& overlay,
+								 bool strict, array_merge arrays);
+
+// merges overlay into base, a value of the same type, in place
+template <typename Value, typename Overlay>
+std::optional<error> merge_value(Value& base, Overlay&& overlay, bool strict, array_merge arrays) {
+	if (base.is_table()) {
+		return merge_table<Value>(base.as_table(), forward_like<Overlay>(overlay.as_table()),
+								  strict, arrays);
+	}
+	if (!base.is_array() || arrays == array_merge::replace) {
+		base = std::forward<Overlay>(overlay);
+		return std::nullopt;
+	}
+	auto& array = base.as_array();
+	auto& items = overlay.as_array();
+	std::size_t i = 0;
+	if (arrays == array_merge::by_index) {
+		for (; i < items.size() && i < array.size(); i++) {
+			auto e = check_types_to_merge(array[i], items[i]);
+			if (!e) {
+				e = merge_value(array[i], forward_like<Overlay>(items[i]), strict, arrays);
+			}
+			if (e) {
+				e->prepend_key("[" + std::to_string(i) + "]");
+				return e;
+			}
+		}
+		if (strict && i < items.size()) {
+			return error(error::code::key_not_found, "tomlex::merge",
+						 "following index does not exist in the base array")
+				.prepend_key("[" + std::to_string(i) + "]");
+		}
+	}
+	array.reserve(array.size() + items.size() - i);
+	for (; i < items.size(); i++) {
+		array.push_back(forward_like<Overlay>(items[i]));
+	}
+	return std::nullopt;
+}
+
+// merges the entries of overlay, a table_type, into base in place; each key is looked up once
+template <typename Value, typename OverlayTable>
+std::optional<error> merge_table(typename Value::table_type& base, OverlayTable&& overlay,
+								 bool strict, array_merge arrays) {
+	for (auto&& [key, value] : overlay) {
+		auto it = base.find(key);
+		if (it == base.end()) {
+			if (strict) {
+				return error(error::code::key_not_found, "tomlex::merge",
+							 "following key does not exist in the base table")
+					.prepend_key(key);
+			}
+			base.emplace(key, forward_like<OverlayTable>(value));
+			continue;
+		}
+		auto e = check_types_to_merge(it->second, value);
+		if (!e) {
+			e = merge_value(it->second, forward_like<OverlayTable>(value), strict, arrays);
+		}
+		if (e) {
+			e->prepend_key(key);
+			return e;
+		}
+	}
+	return std::nullopt;
+}
+
+// merges overlay into base in place; both must be tables
+template <typename Value, typename Overlay>
+std::optional<error> merge_root(Value& base, Overlay&& overlay, bool strict, array_merge arrays) {
+	for (auto val : std::initializer_list<Value const*>{&base, &overlay}) {
+		if (!val->is_table()) {
+			return error(error::code::type_mismatch, "tomlex::merge",
+						 "following value must be a table")
+				.set_types(toml::value_t::table, val->type())
+				.set_region(val->location());
+		}
+	}
+	return merge_table<Value>(base.as_table(), forward_like<Overlay>(overlay.as_table()), strict,
+							  arrays);
+}
+
+// merges the tables of layers, in order, into base in place. The keys of all layers are grouped
+// first, so the merge takes expected time linear in the total number of keys of the layers: each
+// key is looked up in base once, and of the values that replace each other only the last is moved,
+// or copied if Table is const
+template <typename Value, typename Table>
+std::optional<error> merge_layers(typename Value::table_type& base,
+								  std::vector<Table*> const& layers, bool strict,
+								  array_merge arrays) {
+	using value_ptr = std::conditional_t<std::is_const_v<Table>, Value const*, Value*>;
+	if (layers.size() == 1) {
+		return merge_table<Value>(base, std::move(*layers.front()), strict, arrays);
+	}
+	// the values of each key, in the order of the layers
+	std::vector<std::pair<std::string const*, std::vector<value_ptr>>> groups;
+	std::unordered_map<std::string_view, std::size_t> index;
+	for (auto* layer : layers) {
+		for (auto& [key, value] : *layer) {
+			auto [it, inserted] = index.emplace(key, groups.size());
+			if (inserted) {
+				groups.emplace_back(&key, std::vector<value_ptr>{});
+			}
+			groups[it->second].second.push_back(&value);
+		}
+	}
+
+	std::vector<Table*> tables;
+	for (auto& [key, values] : groups) {
+		auto it = base.find(*key);
+		std::size_t first = 0;
+		if (it == base.end()) {
+			if (strict) {
+				return error(error::code::key_not_found, "tomlex::merge",
+							 "following key does not exist in the base table")
+					.prepend_key(*key);
+			}
+			it = base.emplace(*key, std::move(*values.front())).first;
+			first = 1;
+		}
+		auto& slot = it->second;
+		std::optional<error> e;
+		for (std::size_t j = first; j < values.size() && !e; j++) {
+			e = check_types_to_merge(slot, *values[j]);
+		}
+		if (!e && first < values.size()) {
+			if (slot.is_table()) {
+				tables.clear();
+				for (std::size_t j = first; j < values.size(); j++) {
+					tables.push_back(&values[j]->as_table());
+				}
+				e = merge_layers<Value>(slot.as_table(), tables, strict, arrays);
+			} else if (slot.is_array() && arrays != array_merge::replace) {
+				for (std::size_t j = first; j < values.size() && !e; j++) {
+					e = merge_value(slot, std::move(*values[j]), strict, arrays);
+				}
+			} else {
+				slot = std::move(*values.back());
+			}
+		}
+		if (e) {
+			e->prepend_key(*key);
+			return e;
+		}
+	}
+	return std::nullopt;
+}
+
+// the tables of layers[1], layers[2], ..., or the error if one of the layers is not a table
+template <typename Layers, typename Table>
+std::optional<error> later_layer_tables(Layers& layers, std::vector<Table*>& tables) {
+	tables.reserve(layers.size());
+	for (auto& layer : layers) {
+		if (!layer.is_table()) {
+			return error(error::code::type_mismatch, "tomlex::merge",
+						 "following value must be a table")
+				.set_types(toml::value_t::table, layer.type())
+				.set_region(layer.location());
+		}
+		if (&layer != &layers.front()) {
+			tables.push_back(&layer.as_table());
+		}
+	}
+	return std::nullopt;
+}
+
+// merges layers[1], layers[2], ... into layers[0] in place; all must be tables
+template <typename Value>
+std::optional<error> merge_layers_root(std::vector<Value>& layers, bool strict,
+									   array_merge arrays) {
+	std::vector<typename Value::table_type*> tables;
+	if (auto e = later_layer_tables(layers, tables)) {
+		return e;
+	}
+	return merge_layers<Value>(layers.front().as_table(), tables, strict, arrays);
+}
+
+// merges layers[1], layers[2], ... into a copy of layers[0]; all must be tables. Of the later
+// layers only the values that no later layer replaces are copied, so the layers are not copied
+// as a whole before they are merged
+template <typename Value>
+toml::result<Value, error> merge_layers_copy(std::vector<Value> const& layers, bool strict,
+											 array_merge arrays) {
+	std::vector<typename Value::table_type const*> tables;
+	if (auto e = later_layer_tables(layers, tables)) {
+		return toml::err(std::move(*e));
+	}
+	Value merged = layers.front();
+	if (auto e = merge_layers<Value>(merged.as_table(), tables, strict, arrays)) {
+		return toml::err(std::move(*e));
+	}
+	return toml::ok(std::move(merged));
+}
+
+template <typename Value>
+std::optional<error> merge_override(typename Value::table_type& table, std::string const& src) {
+	toml::detail::location loc(src, src);
+	auto key_value = parse_key_value<Value>(loc);
+	if (!key_value) {
+		toml::detail::location whole(src, src);
+		auto parsed = parse_toml_literal<Value>(whole);
+		if (!parsed) {
+			return error(error::code::syntax_error, "", parsed.unwrap_err());
+		}
+		if (!parsed.unwrap().is_table()) {
+			return error(error::code::type_mismatch, "", "following value must be a table")
+				.set_types(toml::value_t::table, parsed.unwrap().type());
+		}
+		key_value.emplace(std::vector<toml::key>{}, std::move(parsed.unwrap()));
+	}
+	auto& [keys, value] = *key_value;
+	if (keys.empty()) {
+		return merge_table<Value>(table, std::move(value.as_table()), false,
+								  array_merge::replace);
+	}
+	auto* parent = &table;
+	for (std::size_t i = 0; i + 1 < keys.size(); i++) {
+		auto it = parent->find(keys[i]);
+		if (it == parent->end()) {
+			it = parent->emplace(keys[i], typename Value::table_type{}).first;
+		} else if (!it->second.is_table()) {
+			error e(error::code::type_mismatch, "tomlex::merge", "type mismatch");
+			e.set_types(it->second.type(), toml::value_t::table);
+			for (std::size_t j = i + 1; j-- > 0;) {
+				e.prepend_key(keys[j]);
+			}
+			return e;
+		}
+		parent = &it->second.as_table();
+	}
+	auto it = parent->find(keys.back());
+	if (it == parent->end()) {
+		parent->emplace(keys.back(), std::move(value));
+		return std::nullopt;
+	}
+	auto e = check_types_to_merge(it->second, value);
+	if (!e) {
+		e = merge_value(it->second, std::move(value), false, array_merge::replace);
+	}
+	if (e) {
+		for (auto key = keys.rbegin(); key != keys.rend(); ++key) {
+			e->prepend_key(*key);
+		}
+	}
+	return e;
+}
+
+/// <summary>
+/// Merges the override arg, "a.b.c = value", into table in place, or returns the error that
+/// names arg. Anything else that is a valid toml table, e.g. "a = 1 # comment" with a newline,
+/// goes through the full parser.
+/// </summary>
+template <typename Value>
+std::optional<error> add_override(typename Value::table_type& table, std::string_view arg) {
+	const std::string src(arg);
+	std::optional<error> ret;
+	try {
+		ret = merge_override<Value>(table, src);
+	} catch (std::exception& e) {
+		ret = to_error(e);
+	}
+	if (ret) {
+		ret->prepend_context("tomlex::from_dotted_keys: invalid argument \"" + src + "\"");
+	}
+	return ret;
+}
+
+// from toml::literals::toml_literals, returning the syntax error instead of throwing it
 template <typename Value>
-Value parse_toml_literal(toml::detail::location loc) {
+toml::result<Value, std::string> parse_toml_literal(toml::detail::location loc) {
 	// if there are some comments or empty lines, skip them.
 	using skip_line = ::toml::detail::repeat<
 		toml::detail::sequence<::toml::detail::maybe<::toml::detail::lex_ws>,
@@ -657,7 +3982,7 @@ Value parse_toml_literal(toml::detail::location loc) {
 	// If it is neither a table-key or a array-of-table-key, it may be a value.
 	if (!is_table_key && !is_aots_key) {
 		if (auto data = ::toml::detail::parse_value<Value>(loc)) {
-			return data.unwrap();
+			return data;
 		}
 	}
 
@@ -672,12 +3997,7 @@ Value parse_toml_literal(toml::detail::location loc) {
 	// It is a valid toml file.
 	// It should be parsed as if we parse a file with this content.
 
-	if (auto data = ::toml::detail::parse_toml_file<Value>(loc)) {
-		return data.unwrap();
-	} else	// none of them.
-	{
-		throw ::toml::syntax_error(data.unwrap_err(), toml::source_location(loc));
-	}
+	return ::toml::detail::parse_toml_file<Value>(loc);
 }
 
 }  // namespace detail
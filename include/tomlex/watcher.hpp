@@ -0,0 +1,571 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+#include "tomlex.hpp"
+
+namespace tomlex {
+namespace detail {
+// whether the tables of Value share their storage between copies, like those of shared_value
+template <typename Value, typename = void>
+struct has_shared_storage : std::false_type {};
+template <typename Value>
+struct has_shared_storage<
+	Value, std::void_t<decltype(std::declval<typename Value::table_type const&>().use_count())>>
+	: std::true_type {};
+
+/// <summary>
+/// Resolves successive versions of a raw tree. The strings whose inputs did not change since
+/// the last version, i.e. neither the string itself nor any key it references, directly or
+/// through other strings, keep their last resolved value, and only the rest is resolved again.
+/// Resolvers are not called again for the strings that are reused. The strings of the last
+/// version are found by their path, not by their node, so that copy-on-write containers, e.g.
+/// those of shared_value, may copy their nodes while a version is resolved or read.
+/// </summary>
+template <typename Value>
+class incremental_resolver {
+   public:
+	incremental_resolver(std::shared_ptr<resolver_map<Value> const> resolvers,
+						 std::size_t max_depth, std::size_t max_nesting = default_max_nesting)
+		: resolvers_(std::move(resolvers)), max_depth_(max_depth), max_nesting_(max_nesting) {}
+
+	// the resolved raw, or nullptr if raw is the same as the last version
+	std::shared_ptr<Value const> resolve(Value raw) {
+		auto next = std::make_shared<Value>(std::move(raw));
+		if constexpr (has_shared_storage<Value>::value) {
+			unshare(*next);
+		}
+		std::vector<std::string> changed;
+		const auto strings = compare(*next, changed);
+		if (resolved_ && changed.empty()) {
+			return nullptr;
+		}
+		const auto dirty = find_dirty(strings, changed);
+		resolve_cache<Value> cache;
+		std::unordered_map<Value const*, interp_string const*> compiled;
+		compiled.reserve(strings.size());
+		for (std::size_t i = 0; i < strings.size(); i++) {
+			if (dirty[i]) {
+				compiled.emplace(strings[i].node, &strings[i].src->compiled);
+			} else {
+				cache.emplace(strings[i].node, *strings[i].old);
+			}
+		}
+		strings_resolved_ = compiled.size();
+
+		resolve_state<Value> state{*next, cache, *resolvers_};
+		state.compiled = &compiled;
+		state.max_depth = max_depth_;
+		state.max_nesting = max_nesting_;
+		state.memo = &memo_;
+		if (auto e = resolve_in_place(*next, state, true)) {
+			throw std::move(*e);
+		}
+
+		std::unordered_map<std::uint64_t, std::shared_ptr<source const>> sources;
+		sources.reserve(strings.size());
+		for (auto const& s : strings) {
+			sources.emplace(frames_[s.frame].hash, s.src);
+		}
+		sources_.swap(sources);
+		resolved_ = next;
+		return next;
+	}
+
+	// number of "${...}" strings resolved by the last call; the others were reused
+	std::size_t strings_resolved() const { return strings_resolved_; }
+
+   private:
+	// a string that contains "${...}", as it was before it was resolved
+	struct source {
+		std::string path;
+		std::string text;
+		interp_string compiled;
+	};
+	struct string_node {
+		Value const* node;
+		std::size_t frame;	// its path
+		std::shared_ptr<source const> src;
+		Value const* old;  // its value in the last resolved tree, if the string is the same
+	};
+	// a key, or an index of an array, on the path from the root
+	struct frame {
+		std::size_t parent;
+		std::string_view key;
+		std::size_t index;
+		bool is_index;
+		std::uint64_t hash;	 // of the path, to find the source of the string at it
+	};
+
+	static std::uint64_t path_hash(std::uint64_t parent, std::string_view key) {
+		return (parent ^ std::hash<std::string_view>{}(key)) * 0x100000001b3ull;
+	}
+	static std::uint64_t path_hash(std::uint64_t parent, std::size_t index) {
+		return (parent ^ (index + 0x9e3779b97f4a7c15ull)) * 0x100000001b3ull;
+	}
+
+	// gives every table and array of root storage of its own. Otherwise resolving root in place
+	// would copy the shared ones, and move the strings that compare found, by whose node the
+	// reused values and the compiled strings are looked up
+	static void unshare(Value& root) {
+		std::vector<Value*> nodes{&root};
+		while (!nodes.empty()) {
+			Value& node = *nodes.back();
+			nodes.pop_back();
+			if (node.is_table()) {
+				for (auto& [k, v] : node.as_table()) {
+					nodes.push_back(&v);
+				}
+			} else if (node.is_array()) {
+				for (auto& item : node.as_array()) {
+					nodes.push_back(&item);
+				}
+			}
+		}
+	}
+
+	std::string path(std::size_t f) const {
+		std::vector<std::size_t> frames;
+		for (; f != 0; f = frames_[f].parent) {
+			frames.push_back(f);
+		}
+		std::string ret;
+		for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+			if (!ret.empty()) {
+				ret += '.';
+			}
+			auto const& fr = frames_[*it];
+			if (fr.is_index) {
+				ret += "[" + std::to_string(fr.index) + "]";
+			} else {
+				ret += fr.key;
+			}
+		}
+		return ret;
+	}
+	std::string path(std::size_t f, std::string_view key) const {
+		auto ret = path(f);
+		return (ret.empty() ? ret : ret + '.').append(key);
+	}
+
+	/// <summary>
+	/// Walks root, the new raw tree, along with the last resolved tree. Appends the paths of the
+	/// values that were added, removed or modified to changed, and returns the strings of root
+	/// that contain "${...}".
+	/// </summary>
+	std::vector<string_node> compare(Value const& root, std::vector<std::string>& changed) {
+		std::vector<string_node> ret;
+		frames_.assign(1, frame{0, {}, 0, false, 0});
+		// nodes of root and of the last resolved tree at the same path, or nullptr if there is
+		// no such node or the value changed
+		std::vector<std::tuple<Value const*, Value const*, std::size_t>> nodes{
+			{&root, resolved_.get(), 0}};
+		while (!nodes.empty()) {
+			auto [a, b, f] = nodes.back();
+			nodes.pop_back();
+			if (b != nullptr) {
+				auto it = sources_.find(frames_[f].hash);
+				if (it != sources_.end() && it->second->path != path(f)) {
+					it = sources_.end();
+				}
+				if (it != sources_.end()) {
+					if (a->is_string() && a->as_string().str == it->second->text) {
+						ret.push_back(string_node{a, f, it->second, b});
+						continue;
+					}
+					changed.push_back(path(f));
+					b = nullptr;
+				} else if (a->type() != b->type() ||
+						   (a->is_array() && a->as_array().size() != b->as_array().size())) {
+					changed.push_back(path(f));
+					b = nullptr;
+				} else if (!a->is_table() && !a->is_array()) {
+					if (*a == *b) {
+						continue;
+					}
+					changed.push_back(path(f));
+					b = nullptr;
+				}
+			}
+			if (a->is_table()) {
+				auto const& table = a->as_table();
+				if (b != nullptr) {
+					for (auto const& [k, v] : b->as_table()) {
+						if (table.find(k) == table.end()) {
+							changed.push_back(path(f, k));
+						}
+					}
+				}
+				for (auto const& [k, v] : table) {
+					Value const* old = nullptr;
+					if (b != nullptr) {
+						auto const& old_table = b->as_table();
+						if (auto it = old_table.find(k); it != old_table.end()) {
+							old = &it->second;
+						} else {
+							changed.push_back(path(f, k));
+						}
+					}
+					nodes.emplace_back(&v, old, frames_.size());
+					frames_.push_back(frame{f, k, 0, false, path_hash(frames_[f].hash, k)});
+				}
+			} else if (a->is_array()) {
+				auto const& arr = a->as_array();
+				for (std::size_t i = 0; i < arr.size(); i++) {
+					nodes.emplace_back(&arr[i], b != nullptr ? &b->as_array()[i] : nullptr,
+									   frames_.size());
+					frames_.push_back(frame{f, {}, i, true, path_hash(frames_[f].hash, i)});
+				}
+			} else if (a->is_string() && utils::has_interpolation(a->as_string().str)) {
+				auto src = std::make_shared<source>();
+				src->path = path(f);
+				src->text = a->as_string().str;
+				src->compiled = compile_string(src->text);
+				if (src->compiled.has_expr()) {
+					ret.push_back(string_node{a, f, std::move(src), nullptr});
+				}
+			}
+		}
+		return ret;
+	}
+
+	/// <summary>
+	/// Strings that have to be resolved again: the new and changed ones, and the ones that
+	/// reference a changed key, a table that contains one, a key inside a changed value, or
+	/// another string that has to be resolved again.
+	/// </summary>
+	std::vector<bool> find_dirty(std::vector<string_node> const& strings,
+								 std::vector<std::string> const& changed) const {
+		std::vector<bool> dirty(strings.size(), false);
+		std::vector<std::string> queue(changed.begin(), changed.end());
+		auto mark = [&](std::size_t i) {
+			dirty[i] = true;
+			queue.push_back(path(strings[i].frame));
+		};
+		// strings by the keys they reference, and by every table that contains those keys
+		std::unordered_map<std::string_view, std::vector<std::size_t>> exact, below;
+		for (std::size_t i = 0; i < strings.size(); i++) {
+			auto const& compiled = strings[i].src->compiled;
+			// the keys of a dynamic reference are only known at resolution
+			if (strings[i].old == nullptr || compiled.has_dynamic_reference) {
+				mark(i);
+				continue;
+			}
+			for (std::string_view ref : compiled.references) {
+				exact[ref].push_back(i);
+				for (auto pos = ref.find('.'); pos != std::string_view::npos;
+					 pos = ref.find('.', pos + 1)) {
+					below[ref.substr(0, pos)].push_back(i);
+				}
+			}
+		}
+		auto mark_all = [&](auto const& index, std::string_view key) {
+			if (auto it = index.find(key); it != index.end()) {
+				for (auto i : it->second) {
+					if (!dirty[i]) {
+						mark(i);
+					}
+				}
+			}
+		};
+		while (!queue.empty()) {
+			const auto key = std::move(queue.back());
+			queue.pop_back();
+			if (key.empty()) {	// the whole root
+				std::fill(dirty.begin(), dirty.end(), true);
+				break;
+			}
+			mark_all(below, key);
+			for (auto pos = key.find('.'); pos != std::string::npos; pos = key.find('.', pos + 1)) {
+				mark_all(exact, std::string_view(key).substr(0, pos));
+			}
+			mark_all(exact, key);
+		}
+		return dirty;
+	}
+
+	std::shared_ptr<resolver_map<Value> const> resolvers_;
+	std::size_t max_depth_;
+	std::size_t max_nesting_;
+	resolver_memo<Value> memo_;
+	std::shared_ptr<Value const> resolved_;
+	// the strings of resolved_ as they were before they were resolved, keyed by the hash of their
+	// path; a source whose path differs from the one looked up is a collision and ignored
+	std::unordered_map<std::uint64_t, std::shared_ptr<source const>> sources_;
+	std::vector<frame> frames_;	 // paths of the nodes visited by compare
+	std::size_t strings_resolved_ = 0;
+};
+}  // namespace detail
+
+/// <summary>
+/// Keeps a resolved config up to date with its files. The files are merged in order as by
+/// tomlex::merge, e.g. {"defaults.toml", "site.toml"}. On a change, the changed files are parsed
+/// again and only the strings whose inputs changed are resolved again (see
+/// detail::incremental_resolver). Readers get the current tree with get(), which never waits for
+/// a reload: a reload publishes a new tree, and the trees that readers hold stay valid.
+/// On Linux the directories of the files are watched with inotify, so that editors that replace
+/// a file by renaming are seen as well; elsewhere the modification times are polled.
+/// </summary>
+template <typename Value = toml::value>
+class watcher {
+   public:
+	explicit watcher(std::vector<std::string> filenames,
+					 context<Value> const& ctx = default_context<Value>())
+		: filenames_(std::move(filenames)),
+		  resolver_(ctx.resolvers(), ctx.max_depth(), ctx.max_nesting()) {
+		if (filenames_.empty()) {
+			throw std::runtime_error("tomlex::watcher: no files to watch");
+		}
+		watch();
+		try {
+			for (auto const& filename : filenames_) {
+				layers_.push_back(detail::parse_file<Value>::parse(filename));
+			}
+			publish();
+			pending_.assign(filenames_.size(), false);
+		} catch (...) {
+			unwatch();
+			throw;
+		}
+	}
+	explicit watcher(std::string const& filename,
+					 context<Value> const& ctx = default_context<Value>())
+		: watcher(std::vector<std::string>{filename}, ctx) {}
+	watcher(watcher const&) = delete;
+	watcher& operator=(watcher const&) = delete;
+	~watcher() {
+		stop();
+		unwatch();
+	}
+
+	// the current tree
+	std::shared_ptr<Value const> get() const { return std::atomic_load(&current_); }
+
+	/// <summary>
+	/// Waits up to timeout for a tree other than seen to be published, e.g. by the thread of
+	/// start(), and returns the current tree, which is seen if none was.
+	/// </summary>
+	std::shared_ptr<Value const> wait_for_update(std::shared_ptr<Value const> const& seen,
+												 std::chrono::milliseconds timeout) const {
+		std::unique_lock<std::mutex> lock(published_mutex_);
+		published_.wait_for(lock, timeout, [&] { return get() != seen; });
+		return get();
+	}
+
+	/// <summary>
+	/// Waits up to timeout for a change of the files, and reloads them if there is one. Returns
+	/// true if a new tree was published. If a file cannot be parsed or resolved, e.g. while it
+	/// is being written, the error is thrown and the current tree is kept. None of the files
+	/// changed since the last reload is taken then: they are all read again on the next change.
+	/// </summary>
+	bool poll(std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+		std::vector<bool> changed;
+		{
+			std::lock_guard<std::mutex> lock(wait_mutex_);
+			changed = wait(timeout);
+		}
+		if (std::find(changed.begin(), changed.end(), true) == changed.end()) {
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (std::size_t i = 0; i < filenames_.size(); i++) {
+			pending_[i] = pending_[i] || changed[i];
+		}
+		// parse every changed file before replacing any layer
+		std::vector<std::pair<std::size_t, Value>> parsed;
+		for (std::size_t i = 0; i < filenames_.size(); i++) {
+			if (pending_[i]) {
+				parsed.emplace_back(i, detail::parse_file<Value>::parse(filenames_[i]));
+			}
+		}
+		for (auto& [i, layer] : parsed) {
+			std::swap(layers_[i], layer);
+		}
+		bool published;
+		try {
+			published = publish();
+		} catch (...) {
+			for (auto& [i, layer] : parsed) {
+				std::swap(layers_[i], layer);
+			}
+			throw;
+		}
+		std::fill(pending_.begin(), pending_.end(), false);
+		return published;
+	}
+
+	// polls on a thread until stop(); errors are passed to on_error
+	void start(std::chrono::milliseconds interval = std::chrono::milliseconds(100),
+			   std::function<void(std::exception const&)> on_error = {}) {
+		stop();
+		running_ = true;
+		thread_ = std::thread([this, interval, on_error = std::move(on_error)] {
+			while (running_) {
+				try {
+					poll(interval);
+				} catch (std::exception& e) {
+					if (on_error) {
+						on_error(e);
+					}
+				}
+			}
+		});
+	}
+	void stop() {
+		running_ = false;
+		if (thread_.joinable()) {
+			thread_.join();
+		}
+	}
+
+	// number of "${...}" strings resolved by the last reload; the others were reused
+	std::size_t strings_resolved() const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return resolver_.strings_resolved();
+	}
+
+   private:
+	bool publish() {
+		// only the values that end up in the merged tree are copied from the layers
+		auto next = resolver_.resolve(detail::value_or_throw(
+			detail::merge_layers_copy(layers_, false, array_merge::replace)));
+		if (!next) {
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(published_mutex_);
+			std::atomic_store(&current_, std::move(next));
+		}
+		published_.notify_all();
+		return true;
+	}
+
+#ifdef __linux__
+	void watch() {
+		fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd_ < 0) {
+			throw std::runtime_error(std::string("tomlex::watcher: inotify_init1 failed: ") +
+									 std::strerror(errno));
+		}
+		for (auto const& filename : filenames_) {
+			const auto path = std::filesystem::absolute(filename);
+			const auto dir = path.parent_path().string();
+			const int wd = ::inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (wd < 0) {
+				const auto message = std::string("tomlex::watcher: cannot watch ") + dir + ": " +
+									 std::strerror(errno);
+				unwatch();
+				throw std::runtime_error(message);
+			}
+			files_.emplace_back(wd, path.filename().string());
+		}
+	}
+
+	void unwatch() {
+		if (fd_ >= 0) {
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+
+	// which files were written or replaced
+	std::vector<bool> wait(std::chrono::milliseconds timeout) {
+		std::vector<bool> changed(filenames_.size(), false);
+		pollfd pfd{fd_, POLLIN, 0};
+		if (::poll(&pfd, 1, static_cast<int>(timeout.count())) <= 0) {
+			return changed;
+		}
+		alignas(inotify_event) char buf[4096];
+		ssize_t len;
+		while ((len = ::read(fd_, buf, sizeof(buf))) > 0) {
+			for (char* p = buf; p < buf + len;) {
+				auto const* event = reinterpret_cast<inotify_event const*>(p);
+				if (event->len > 0) {
+					for (std::size_t i = 0; i < files_.size(); i++) {
+						if (files_[i].first == event->wd && files_[i].second == event->name) {
+							changed[i] = true;
+						}
+					}
+				}
+				p += sizeof(inotify_event) + event->len;
+			}
+		}
+		return changed;
+	}
+
+	int fd_ = -1;
+	std::vector<std::pair<int, std::string>> files_;  // watch descriptor and name of each file
+#else
+	void watch() {
+		for (auto const& filename : filenames_) {
+			mtimes_.push_back(std::filesystem::last_write_time(filename));
+		}
+	}
+
+	void unwatch() {}
+
+	// which files have a new modification time
+	std::vector<bool> wait(std::chrono::milliseconds timeout) {
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		std::vector<bool> changed(filenames_.size(), false);
+		while (true) {
+			bool any = false;
+			for (std::size_t i = 0; i < filenames_.size(); i++) {
+				std::error_code ec;
+				const auto mtime = std::filesystem::last_write_time(filenames_[i], ec);
+				if (!ec && mtime != mtimes_[i]) {
+					mtimes_[i] = mtime;
+					changed[i] = any = true;
+				}
+			}
+			const auto now = std::chrono::steady_clock::now();
+			if (any || now >= deadline) {
+				return changed;
+			}
+			std::this_thread::sleep_for(
+				(std::min)(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now),
+						   std::chrono::milliseconds(50)));
+		}
+	}
+
+	std::vector<std::filesystem::file_time_type> mtimes_;
+#endif
+
+	std::vector<std::string> filenames_;
+	std::vector<Value> layers_;	 // the parsed files
+	std::vector<bool> pending_;	 // files changed since the last reload
+	detail::incremental_resolver<Value> resolver_;
+	std::shared_ptr<Value const> current_;
+
+	mutable std::mutex mutex_;	// serializes reloads
+	std::mutex wait_mutex_;		// serializes waits for changes, which do not hold mutex_
+	mutable std::mutex published_mutex_;  // for wait_for_update
+	mutable std::condition_variable published_;
+	std::atomic<bool> running_{false};
+	std::thread thread_;
+};
+
+}  // namespace tomlex
@@ -1,8 +1,26 @@
 // clang-format off
 #include "pch.h"
 
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <random>
+#include <set>
+
 #include <tomlex/tomlex.hpp>
 #include <tomlex/resolvers.hpp>
+#include <tomlex/shared_value.hpp>
+#include <tomlex/snapshot.hpp>
+#include <tomlex/watcher.hpp>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 // clang-format on
 
 using std::string;
@@ -18,6 +36,34 @@ toml::value lt(toml::value&&) {
 	return toml::local_time(std::chrono::hours(8) + std::chrono::minutes(10));
 };
 
+// runs f on a thread whose stack is stack_size bytes
+template <typename F>
+void run_with_stack(std::size_t stack_size, F f) {
+#ifdef _WIN32
+	auto thunk = [](void* p) -> DWORD {
+		(*static_cast<F*>(p))();
+		return 0;
+	};
+	HANDLE th =
+		CreateThread(nullptr, stack_size, thunk, &f, STACK_SIZE_PARAM_IS_A_RESERVATION, nullptr);
+	ASSERT_NE(th, nullptr);
+	WaitForSingleObject(th, INFINITE);
+	CloseHandle(th);
+#else
+	auto thunk = [](void* p) -> void* {
+		(*static_cast<F*>(p))();
+		return nullptr;
+	};
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, stack_size);
+	pthread_t th;
+	ASSERT_EQ(pthread_create(&th, &attr, thunk, &f), 0);
+	pthread_join(th, nullptr);
+	pthread_attr_destroy(&attr);
+#endif
+}
+
 toml::value add(toml::value&& args) {
 	auto& array_ = args.as_array();
 	std::int64_t ret = 0;
@@ -220,15 +266,730 @@ TEST_F(TesttomlextGoodTest, find) {
 	EXPECT_EQ(result.as_string(), "estshorter");
 }
 
+TEST_F(TesttomlextGoodTest, resolve_parallel) {
+	auto serial = tomlex::resolve(toml::value(cfg));
+	auto parallel = tomlex::resolve(toml::value(cfg), tomlex::parallel{4});
+	EXPECT_EQ(tomlex::format(parallel), tomlex::format(serial));
+}
+
 TEST_F(TesttomlextBadTest, bad) {
 	EXPECT_THROW(find_from_root(cfg, "empty_throw"), std::runtime_error);
 	EXPECT_THROW(find_from_root(cfg, "circular1"), std::runtime_error);
 }
 
+TEST_F(TesttomlextBadTest, circular_reference) {
+	auto message = [](auto&& f) {
+		try {
+			f();
+		} catch (std::runtime_error& e) {
+			return std::string(e.what());
+		}
+		return std::string();
+	};
+	auto err = message([&] { find_from_root(cfg, "circular1"); });
+	EXPECT_NE(err.find("circular reference detected: circular1 -> circular2 -> circular3 -> "
+					   "circular1"),
+			  std::string::npos);
+	// the key is built at resolution
+	err = message([] { tomlex::resolve(R"({n="b", a="${${n}}", b="x${a}"})"_toml); });
+	EXPECT_NE(err.find("circular reference detected: b -> a -> b"), std::string::npos);
+	err = message([] { tomlex::resolve(R"({a="${a}"})"_toml); });
+	EXPECT_NE(err.find("circular reference detected: a -> a"), std::string::npos);
+}
+
 TEST(TesttomlextTest, resolve) {
 	auto cfg = R"(d='${no_op:["${concat: ["A","B","C"]}", "D"]}')"_toml;
 	cfg = tomlex::resolve(std::move(cfg));
 	ASSERT_EQ(tomlex::detail::to_string(cfg), R"({d=["ABC","D"]})");
+
+	// a table referenced by many strings, one of which it references back through a chain
+	cfg = R"(
+x = 1
+t = {a = "${x}", b = ["${x}", "${y}"]}
+y = "${t.a}"
+s = ["${t}", "${t}", "${t.b}", {u = "${t}"}]
+)"_toml;
+	cfg = tomlex::resolve(std::move(cfg));
+	auto t = R"({a = 1, b = [1, 1]})"_toml;
+	EXPECT_EQ(cfg.at("t"), t);
+	EXPECT_EQ(cfg.at("s"), toml::value(toml::array{t, t, t.at("b"), toml::table{{"u", t}}}));
+}
+
+TEST(TesttomlextTest, resolve_cache) {
+	int calls = 0;
+	register_resolver("__count__", [&calls](toml::value&&) -> toml::value { return ++calls; });
+	auto cfg = R"(
+counted = "${__count__:}"
+a = "${counted}"
+b = ["${counted}", "${a}"]
+)"_toml;
+
+	tomlex::resolve_cache<> cache;
+	EXPECT_EQ(find_from_root(cache, cfg, "a").as_integer(), 1);
+	EXPECT_EQ(find_from_root(cache, cfg, "b"), R"([1, 1])"_toml);
+	EXPECT_EQ(find_from_root(cache, cfg, "counted").as_integer(), 1);
+	EXPECT_EQ(calls, 1);
+
+	calls = 0;
+	cfg = tomlex::resolve(std::move(cfg));
+	EXPECT_EQ(cfg, R"(counted = 1
+a = 1
+b = [1, 1])"_toml);
+	EXPECT_EQ(calls, 1);
+
+	// each string is evaluated once, whether it is referenced directly, through its table or both
+	calls = 0;
+	cfg = R"(
+c = "${t}"
+t = {x = "${__count__:}", y = ["${t.x}"]}
+d = "${t.y}"
+)"_toml;
+	tomlex::resolve_cache<> cache2;
+	EXPECT_EQ(find_from_root(cache2, cfg, "c"), R"(x = 1
+y = [1])"_toml);
+	EXPECT_EQ(find_from_root(cache2, cfg, "t", "x").as_integer(), 1);
+	EXPECT_EQ(tomlex::resolve(std::move(cfg)), R"(c = {x = 2, y = [2]}
+t = {x = 2, y = [2]}
+d = [2])"_toml);
+	EXPECT_EQ(calls, 2);
+	tomlex::clear_resolver("__count__");
+}
+
+TEST(TesttomlextTest, compile) {
+	auto tmpl = tomlex::compile(R"(
+lr = 0.5
+run = "lr_${lr}"
+out = {dir = "/tmp/${run}", keep = "${lr}"}
+xs = ["${out.dir}", "plain", "${no_op: [1, ${lr}]}"]
+)"_toml);
+	EXPECT_EQ(tmpl.size(), 5);
+	EXPECT_EQ(tmpl.references(), (std::vector<std::string>{"lr", "out.dir", "run"}));
+	EXPECT_FALSE(tmpl.has_dynamic_references());
+
+	EXPECT_EQ(tmpl.resolve(), tomlex::resolve(toml::value(tmpl.root())));
+	for (auto lr : {0.25, 2.0}) {
+		toml::value overrides(toml::table{{"lr", lr}});
+		EXPECT_EQ(tmpl.resolve(overrides),
+				  tomlex::resolve(tomlex::merge(toml::value(tmpl.root()), toml::value(overrides))));
+	}
+	auto cfg = tmpl.resolve(R"(out.dir = "${run}/out")"_toml);
+	EXPECT_EQ(cfg.at("out").at("dir").as_string(), "lr_0.5/out");
+	EXPECT_EQ(cfg.at("xs").at(0).as_string(), "lr_0.5/out");
+	EXPECT_EQ(cfg.at("out").at("keep").as_floating(), 0.5);
+	EXPECT_EQ(tmpl.root().at("run").as_string(), "lr_${lr}");
+	EXPECT_THROW(tmpl.resolve(R"(lr = "${lr}")"_toml), std::runtime_error);
+
+	// strings without nested "${" are evaluated from their text, and resolve as compiled ones
+	auto edges = R"(
+e = ""
+n = 1
+a = "${e}${n}"
+b = "{${n}}}"
+c = "$${n}{"
+d = "[${ ${e}n}]"
+)"_toml;
+	auto resolved = tomlex::resolve(toml::value(edges));
+	EXPECT_EQ(resolved, tomlex::compile(edges).resolve());
+	EXPECT_EQ(resolved.at("a").as_integer(), 1);
+	EXPECT_EQ(resolved.at("b").as_string(), "{1}}");
+	EXPECT_EQ(resolved.at("c").as_string(), "$1{");
+	EXPECT_EQ(resolved.at("d").as_string(), "[1]");
+}
+
+TEST(TesttomlextTest, lazy_config) {
+	std::atomic<int> calls{0};
+	tomlex::context<> ctx;
+	ctx.register_resolver("count", [&](toml::value&&) -> toml::value { return ++calls; });
+	const auto root = R"(a = {x = "${b.y}", z = "${b}"})"
+					  R"(
+b = {y = "${count:}", w = 1})"
+					  R"(
+c = "${c}"
+d = [1, "${b.w}"])"_toml;
+	tomlex::lazy_config<> cfg(root, ctx);
+	EXPECT_EQ(cfg.root(), root);
+	EXPECT_EQ(calls, 0);
+
+	auto const& a = cfg["a"];
+	EXPECT_EQ(a.at("x").as_integer(), 1);
+	EXPECT_EQ(a.at("z").at("y").as_integer(), 1);
+	EXPECT_EQ(calls, 1);
+	// b.y was resolved for a, and a itself is kept
+	EXPECT_EQ(cfg.find("b").at("y").as_integer(), 1);
+	EXPECT_EQ(cfg.find("b", "y").as_integer(), 1);
+	EXPECT_EQ(&cfg["a"], &a);
+	EXPECT_EQ(calls, 1);
+	EXPECT_EQ(cfg.find("d", 1).as_integer(), 1);
+
+	EXPECT_THROW(cfg["c"], tomlex::error);
+	EXPECT_THROW(cfg["c"], tomlex::error);	// failures are not kept
+	EXPECT_THROW(cfg["none"], std::out_of_range);
+	EXPECT_THROW(tomlex::lazy_config<>(toml::value(1)), std::runtime_error);
+
+	// concurrent readers resolve each node once, and see one value of every string
+	std::string text;
+	for (int i = 0; i < 100; i++) {
+		text += "[t" + std::to_string(i) + "]\nv = \"${count:}\"\nr = \"${t" +
+				std::to_string((i + 1) % 100) + ".v}\"\n";
+	}
+	std::istringstream iss(text);
+	tomlex::lazy_config<> shared(toml::parse(iss, "lazy.toml"), ctx);
+	calls = 0;
+	std::vector<std::thread> readers;
+	std::vector<std::vector<toml::value const*>> read(4);
+	for (std::size_t th = 0; th < read.size(); th++) {
+		readers.emplace_back([&, th] {
+			for (int i = 0; i < 100; i++) {
+				read[th].push_back(&shared["t" + std::to_string((i * 7 + th * 13) % 100)]);
+			}
+		});
+	}
+	for (auto& th : readers) {
+		th.join();
+	}
+	for (std::size_t th = 0; th < read.size(); th++) {
+		for (int i = 0; i < 100; i++) {
+			EXPECT_EQ(read[th][i], &shared["t" + std::to_string((i * 7 + th * 13) % 100)]);
+		}
+	}
+	// a string needed by two first accesses at the same time may be evaluated by both, but
+	// they keep the same value
+	EXPECT_GE(calls, 100);
+	std::set<std::int64_t> values;
+	for (int i = 0; i < 100; i++) {
+		auto const& t = shared["t" + std::to_string(i)];
+		EXPECT_EQ(t.at("r"), shared["t" + std::to_string((i + 1) % 100)].at("v"));
+		values.insert(t.at("v").as_integer());
+	}
+	EXPECT_EQ(values.size(), 100u);
+
+	// a resolver may read the same lazy_config on its own thread, also while other threads
+	// resolve the nodes it reads
+	tomlex::lazy_config<>* self = nullptr;
+	tomlex::context<> reentrant(ctx);
+	reentrant.register_resolver("get", [&](toml::value&& key) -> toml::value {
+		return self->find(key.as_string().str);
+	});
+	tomlex::lazy_config<> nested(R"(a = "${get: 'b'}"
+b = "${get: 'c'}"
+c = "${count:}"
+d = "${get: 'e'}"
+e = "${get: 'd'}")"_toml,
+								 reentrant);
+	self = &nested;
+	calls = 0;
+	std::vector<std::thread> nested_readers;
+	for (int th = 0; th < 4; th++) {
+		nested_readers.emplace_back([&, th] {
+			const std::string key(1, "abc"[th % 3]);
+			EXPECT_EQ(nested[key].as_integer(), 1);
+		});
+	}
+	for (auto& th : nested_readers) {
+		th.join();
+	}
+	EXPECT_EQ(calls, 1);
+	// reading the node that is being resolved is a cycle, not a deadlock
+	try {
+		nested["d"];
+		FAIL();
+	} catch (tomlex::error& e) {
+		EXPECT_EQ(e.kind(), tomlex::error::code::circular_reference);
+	}
+
+	// the first access of a section does not wait for a resolver of an unrelated one, which
+	// here waits for it
+	std::promise<void> entered, y_read;
+	auto y_done = y_read.get_future().share();
+	tomlex::context<> blocking(ctx);
+	blocking.register_resolver("block", [&](toml::value&&) -> toml::value {
+		entered.set_value();
+		return y_done.wait_for(std::chrono::seconds(30)) == std::future_status::ready;
+	});
+	tomlex::lazy_config<> sections(R"(x = {v = "${block:}"}
+y = {v = "${count:}", w = "${y.v}"})"_toml,
+								   blocking);
+	calls = 0;
+	std::thread blocked([&] { EXPECT_TRUE(sections["x"].at("v").as_boolean()); });
+	EXPECT_EQ(entered.get_future().wait_for(std::chrono::seconds(30)),
+			  std::future_status::ready);
+	EXPECT_EQ(sections["y"].at("w").as_integer(), 1);
+	y_read.set_value();
+	blocked.join();
+	EXPECT_EQ(calls, 1);
+}
+
+TEST(TesttomlextTest, incremental_resolver) {
+	std::atomic<int> calls{0};
+	tomlex::context<> ctx;
+	ctx.register_resolver("count", [&](toml::value&& args) -> toml::value {
+		++calls;
+		return std::move(args);
+	});
+	tomlex::detail::incremental_resolver<toml::value> resolver(ctx.resolvers(), ctx.max_depth());
+	auto v1 = resolver.resolve(R"({a = {x = 1, y = "${count: ${a.x}}"}, b = "${a}")"
+							   R"(, c = "${count: 'c'}", d = ["${e}", 0], e = 2})"_toml);
+	ASSERT_TRUE(v1);
+	EXPECT_EQ(v1->at("b").at("y").as_integer(), 1);
+	EXPECT_EQ(resolver.strings_resolved(), 4);
+	EXPECT_EQ(calls, 2);
+
+	// a.x changed: a.y and b, which contains it, are resolved again, c and d are reused
+	auto v2 = resolver.resolve(R"({a = {x = 5, y = "${count: ${a.x}}"}, b = "${a}")"
+							   R"(, c = "${count: 'c'}", d = ["${e}", 0], e = 2})"_toml);
+	ASSERT_TRUE(v2);
+	EXPECT_EQ(v2->at("b").at("y").as_integer(), 5);
+	EXPECT_EQ(v2->at("d").at(0).as_integer(), 2);
+	EXPECT_EQ(resolver.strings_resolved(), 2);
+	EXPECT_EQ(calls, 3);
+	EXPECT_EQ(v1->at("b").at("y").as_integer(), 1);  // the last tree is not modified
+
+	// nothing changed
+	EXPECT_FALSE(resolver.resolve(R"({a = {x = 5, y = "${count: ${a.x}}"}, b = "${a}")"
+								  R"(, c = "${count: 'c'}", d = ["${e}", 0], e = 2})"_toml));
+
+	// an element of an array, and a new key
+	auto v3 = resolver.resolve(R"({a = {x = 5, y = "${count: ${a.x}}"}, b = "${a}")"
+							   R"(, c = "${count: 'c'}", d = ["${e}", 0], e = 3, f = "${d}"})"_toml);
+	ASSERT_TRUE(v3);
+	EXPECT_EQ(v3->at("f").at(0).as_integer(), 3);
+	EXPECT_EQ(resolver.strings_resolved(), 2);
+	EXPECT_EQ(calls, 3);
+}
+
+TEST(TesttomlextTest, incremental_resolver_shared_value) {
+	using tomlex::shared_value;
+	int calls = 0;
+	tomlex::context<shared_value> ctx;
+	ctx.register_resolver("count", [&](shared_value&& args) -> shared_value {
+		++calls;
+		return std::move(args);
+	});
+	tomlex::detail::incremental_resolver<shared_value> resolver(ctx.resolvers(), ctx.max_depth());
+	// the trees given to the resolver share their tables with raw
+	shared_value raw = shared_value::table_type{};
+	raw["a"] = shared_value::table_type{{"x", 1}, {"y", "${count: ${a.x}}"}};
+	raw["b"] = "${a}";
+	raw["c"] = "${count: 'c'}";
+	auto v1 = resolver.resolve(raw);
+	ASSERT_TRUE(v1);
+	EXPECT_EQ(v1->at("b").at("y").as_integer(), 1);
+	EXPECT_EQ(calls, 2);
+
+	raw["a"]["x"] = 5;
+	auto v2 = resolver.resolve(raw);
+	ASSERT_TRUE(v2);
+	EXPECT_EQ(v2->at("b").at("y").as_integer(), 5);
+	EXPECT_EQ(v2->at("c").as_string(), "c");
+	EXPECT_EQ(resolver.strings_resolved(), 2);
+	EXPECT_EQ(calls, 3);
+	EXPECT_FALSE(resolver.resolve(raw));
+}
+
+TEST(TesttomlextTest, watcher) {
+	const std::string base = ::testing::TempDir() + "tomlex_watch_base.toml";
+	const std::string site = ::testing::TempDir() + "tomlex_watch_site.toml";
+	auto write = [](std::string const& filename, std::string const& text) {
+		std::ofstream(filename, std::ios::binary) << text;
+	};
+	write(base, "[db]\nhost = \"localhost\"\nport = 5432\nurl = \"${db.host}:${db.port}\"\n");
+	write(site, "[db]\nport = 5433\n");
+	{
+		tomlex::watcher<> w({base, site});
+		auto v1 = w.get();
+		EXPECT_EQ(v1->at("db").at("url").as_string(), "localhost:5433");
+		EXPECT_FALSE(w.poll());
+
+		write(site, "[db]\nport = 6000\n");
+		ASSERT_TRUE(w.poll(std::chrono::seconds(5)));
+		EXPECT_EQ(w.get()->at("db").at("url").as_string(), "localhost:6000");
+		EXPECT_EQ(v1->at("db").at("url").as_string(), "localhost:5433");  // still valid
+
+		// waiting for changes does not block the other members. The poller waits until the
+		// write below, so strings_resolved would time out if it waited for the poller
+		std::thread poller([&] { EXPECT_TRUE(w.poll(std::chrono::seconds(60))); });
+		auto resolved = std::async(std::launch::async, [&] { return w.strings_resolved(); });
+		ASSERT_EQ(resolved.wait_for(std::chrono::seconds(30)), std::future_status::ready);
+		EXPECT_EQ(resolved.get(), 1u);
+		write(site, "[db]\nport = 6001\n");
+		poller.join();
+		EXPECT_EQ(w.get()->at("db").at("url").as_string(), "localhost:6001");
+		write(site, "[db]\nport = 6000\n");
+		ASSERT_TRUE(w.poll(std::chrono::seconds(5)));
+
+		// a broken file keeps the current tree
+		write(base, "[db\n");
+		EXPECT_ANY_THROW(w.poll(std::chrono::seconds(5)));
+		EXPECT_EQ(w.get()->at("db").at("url").as_string(), "localhost:6000");
+		// and the files changed with it are only taken along with its fix
+		write(site, "[db]\nport = 7000\n");
+		EXPECT_ANY_THROW(w.poll(std::chrono::seconds(5)));
+		EXPECT_EQ(w.get()->at("db").at("url").as_string(), "localhost:6000");
+
+		// reloads on a thread
+		std::atomic<int> errors{0};
+		auto current = w.get();
+		w.start(std::chrono::milliseconds(10), [&](std::exception const&) { ++errors; });
+		write(base, "[db]\nhost = \"db1\"\nport = 1\nurl = \"${db.host}:${db.port}\"\n");
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+		while (current->at("db").at("url").as_string() != "db1:7000" &&
+			   std::chrono::steady_clock::now() < deadline) {
+			current = w.wait_for_update(current, std::chrono::seconds(30));
+		}
+		w.stop();
+		EXPECT_EQ(current->at("db").at("url").as_string(), "db1:7000");
+		EXPECT_EQ(errors, 0);
+	}
+	std::remove(base.c_str());
+	std::remove(site.c_str());
+}
+
+TEST(TesttomlextTest, parse_source_regions) {
+	const std::string filename = ::testing::TempDir() + "tomlex_regions.toml";
+	std::ofstream(filename, std::ios::binary)
+		<< "[db]\nhost = \"localhost\"\nport = 5432\nurl = \"${db.host}:${db.port}\"\n"
+		   "ports = [1, 2]";  // no newline at the end
+	const auto expected = tomlex::parse(filename);
+	const auto kept = tomlex::parse(filename, tomlex::source_regions::keep);
+	EXPECT_EQ(kept, expected);
+	EXPECT_EQ(kept.at("db").at("host").location().file_name(), filename);
+
+	const auto dropped = tomlex::parse(filename, tomlex::source_regions::drop);
+	EXPECT_EQ(dropped, expected);
+	EXPECT_EQ(dropped.at("db").at("url").as_string(), "localhost:5432");
+	EXPECT_EQ(dropped.at("db").at("host").location().file_name(), "unknown file");
+	EXPECT_EQ(dropped.at("db").at("ports").at(1).location().file_name(), "unknown file");
+
+	std::ofstream(filename, std::ios::binary) << "[db\n";
+	EXPECT_THROW(tomlex::parse(filename, tomlex::source_regions::drop), toml::syntax_error);
+	std::remove(filename.c_str());
+	EXPECT_THROW(tomlex::parse(filename, tomlex::source_regions::drop), std::runtime_error);
+}
+
+TEST(TesttomlextTest, compact) {
+	using value_type = toml::basic_value<toml::preserve_comments>;
+	const std::string filename = ::testing::TempDir() + "tomlex_compact.toml";
+	const std::string text = "a = 1\nb = \"${a}\"\n[t]\nc = [1, 2]\n";
+	std::ofstream(filename, std::ios::binary) << text;
+	auto raw = toml::parse<toml::preserve_comments>(filename);
+	std::remove(filename.c_str());
+	raw.at("a").comments().push_back(" one");
+	auto cfg = tomlex::resolve(value_type(raw));
+	const auto formatted = tomlex::format(cfg);
+
+	// b is a copy of a, comment included; raw still refers to the text of the file
+	EXPECT_EQ(tomlex::compact(cfg), 8u);
+	EXPECT_TRUE(cfg.at("a").comments().empty());
+	EXPECT_EQ(cfg.at("t").at("c").at(0).location().file_name(), "unknown file");
+	EXPECT_EQ(tomlex::format(cfg), formatted);
+	EXPECT_EQ(tomlex::compact(raw), text.size() + 4);
+	EXPECT_EQ(tomlex::compact(raw), 0u);
+
+	// compacted trees resolve and merge as before
+	EXPECT_EQ(tomlex::resolve(value_type(raw)), cfg);
+	auto merged = tomlex::merge(value_type(cfg), value_type(cfg));
+	EXPECT_EQ(merged, cfg);
+	EXPECT_EQ(tomlex::compact(merged), 0u);
+}
+
+TEST(TesttomlextTest, snapshot) {
+	const std::string source = ::testing::TempDir() + "tomlex_snapshot.toml";
+	const std::string snapshot = ::testing::TempDir() + "tomlex_snapshot.bin";
+	std::ofstream(source, std::ios::binary)
+		<< "a = 1\nb = \"${a}\"\nc = 'lit'\nd = -0.5\ne = true\n"
+		   "dt = 1979-05-27T07:32:00.999999-07:00\nld = 1979-05-27\nlt = 07:32:00.5\n"
+		   "ldt = 1979-05-27T07:32:00\n[t]\narr = [[1, 2], {x = \"a\"}, []]\n";
+	const auto cfg = tomlex::parse(source);
+	tomlex::save_snapshot(cfg, snapshot, 42);
+	const auto loaded = tomlex::load_snapshot(snapshot, 42);
+	ASSERT_TRUE(loaded);
+	EXPECT_EQ(*loaded, cfg);
+	EXPECT_EQ(loaded->at("c").as_string().kind, toml::string_t::literal);
+	EXPECT_EQ(loaded->at("dt").as_offset_datetime().offset.hour, -7);
+	EXPECT_EQ(loaded->at("lt").as_local_time().millisecond, 500);
+	EXPECT_FALSE(tomlex::load_snapshot(snapshot, 43));	// stale
+	EXPECT_FALSE(tomlex::load_snapshot(source));		// not a snapshot
+
+	// corrupted or truncated snapshots are not loaded
+	std::vector<char> bytes;
+	{
+		std::ifstream ifs(snapshot, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+	}
+	for (std::size_t size : {bytes.size() - 1, std::size_t(56), std::size_t(3)}) {
+		std::ofstream(snapshot, std::ios::binary).write(bytes.data(), size);
+		EXPECT_FALSE(tomlex::load_snapshot(snapshot, 42));
+	}
+	// nor are snapshots written in an older version of the format
+	auto old = bytes;
+	const std::uint32_t old_version = tomlex::snapshot_version - 1;
+	std::memcpy(old.data() + offsetof(tomlex::detail::snapshot_header, version), &old_version,
+				sizeof(old_version));
+	std::ofstream(snapshot, std::ios::binary).write(old.data(), old.size());
+	EXPECT_FALSE(tomlex::load_snapshot(snapshot, 42));
+	bytes[bytes.size() / 2] ^= 1;
+	std::ofstream(snapshot, std::ios::binary).write(bytes.data(), bytes.size());
+	EXPECT_FALSE(tomlex::load_snapshot(snapshot, 42));
+	std::remove(snapshot.c_str());
+
+	// the snapshot is used until the source or the resolvers change
+	int calls = 0;
+	tomlex::context<> ctx;
+	ctx.register_resolver("count", [&](toml::value&&) -> toml::value { return ++calls; });
+	std::ofstream(source, std::ios::binary) << "n = \"${count:}\"\n";
+	EXPECT_EQ(tomlex::parse_with_snapshot({source}, snapshot, ctx).at("n").as_integer(), 1);
+	EXPECT_EQ(tomlex::parse_with_snapshot({source}, snapshot, ctx).at("n").as_integer(), 1);
+	std::ofstream(source, std::ios::binary) << "n = \"${count:}\"\nm = 0\n";
+	EXPECT_EQ(tomlex::parse_with_snapshot({source}, snapshot, ctx).at("n").as_integer(), 2);
+	ctx.register_resolver("other", [](toml::value&& v) { return std::move(v); });
+	EXPECT_EQ(tomlex::parse_with_snapshot({source}, snapshot, ctx).at("n").as_integer(), 3);
+	// a new salt stands for resolvers whose implementations changed
+	EXPECT_EQ(tomlex::parse_with_snapshot({source}, snapshot, ctx, "v2").at("n").as_integer(), 4);
+	EXPECT_EQ(tomlex::parse_with_snapshot({source}, snapshot, ctx, "v2").at("n").as_integer(), 4);
+	EXPECT_NE(tomlex::snapshot_key({source}, ctx, "v2"), tomlex::snapshot_key({source}, ctx));
+	EXPECT_EQ(calls, 4);
+	std::remove(snapshot.c_str());
+	std::remove(source.c_str());
+}
+
+TEST(TesttomlextTest, fingerprint) {
+	auto cfg = R"(
+a = 1
+b = [1.0, "x", 1979-05-27T07:32:00-07:00]
+[db]
+host = "localhost"
+port = 5432
+[app]
+"dotted.key" = { x = 1 }
+name = 'app'
+)"_toml;
+	// the order of the members of tables does not matter
+	toml::value reordered(toml::table{});
+	for (auto key : {"app", "db", "b", "a"}) {
+		reordered.as_table().emplace(key, cfg.at(key));
+	}
+	EXPECT_EQ(tomlex::fingerprint(reordered), tomlex::fingerprint(cfg));
+	EXPECT_EQ(tomlex::fingerprint(cfg).str(), "01b94568b9be153cd9f9a176ecbd4d70");
+
+	// types, exact float bits and the order of arrays do
+	const auto single = [](toml::value v) {
+		return tomlex::fingerprint(toml::value(toml::table{{"v", std::move(v)}}));
+	};
+	EXPECT_NE(single(1), single(1.0));
+	EXPECT_NE(single(1), single("1"));
+	EXPECT_NE(single(0.0), single(-0.0));
+	EXPECT_NE(single(toml::array{1, 2}), single(toml::array{2, 1}));
+	EXPECT_NE(single(toml::array{}), single(toml::table{}));
+	EXPECT_NE(single(toml::table{{"a", 1}, {"b", 2}}), single(toml::table{{"a", 2}, {"b", 1}}));
+
+	// sections that did not change keep their fingerprints
+	const tomlex::fingerprints before(cfg);
+	cfg.at("db").at("port") = 5433;
+	const tomlex::fingerprints after(cfg);
+	EXPECT_NE(before.root(), after.root());
+	EXPECT_EQ(after.root(), tomlex::fingerprint(cfg));
+	EXPECT_NE(before.at("db"), after.at("db"));
+	EXPECT_NE(before.at("db.port"), after.at("db.port"));
+	EXPECT_EQ(before.at("db.host"), after.at("db.host"));
+	EXPECT_EQ(before.at("app"), after.at("app"));
+	EXPECT_EQ(before.at("b"), after.at("b"));
+	EXPECT_EQ(before.size(), 7u);  // entries with '.' in their own key are not named
+	EXPECT_FALSE(before.contains("app.dotted.key"));
+	EXPECT_ANY_THROW(before.at("db.user"));
+}
+
+TEST(TesttomlextTest, index) {
+	auto cfg = R"(
+a = {b = {c = 1}, d = [1, 2]}
+"x.y" = 2
+e = "${a.b.c}"
+)"_toml;
+	tomlex::index<> keys(cfg);
+	EXPECT_EQ(keys.size(), 5);
+	EXPECT_EQ(keys.find("a.b.c"), &cfg.at("a").at("b").at("c"));
+	EXPECT_EQ(keys.at("a.d"), R"([1, 2])"_toml);
+	EXPECT_TRUE(keys.contains("a.b"));
+	EXPECT_FALSE(keys.contains("x.y"));
+	EXPECT_FALSE(keys.contains("a.d.0"));
+	EXPECT_THROW(keys.at("a.c"), std::runtime_error);
+
+	tomlex::resolve_cache<> cache;
+	EXPECT_EQ(find_from_root(cache, keys, "e").as_integer(), 1);
+	EXPECT_EQ(find_from_root(cache, keys, "a", "b"), R"(c = 1)"_toml);
+
+	cfg["a"]["f"] = 3;
+	keys.rebuild(cfg);
+	EXPECT_EQ(keys.at("a.f").as_integer(), 3);
+}
+
+TEST(TesttomlextTest, resolve_parallel) {
+	std::atomic<int> calls = 0;
+	register_resolver("__count__", [&calls](toml::value&&) -> toml::value { return ++calls; });
+	// a and b reference each other's keys, so they are resolved in the same task
+	auto cfg = R"(
+a = {x = "${b.y}", w = 1, s = "${__count__:}"}
+b = {y = "${c}_${a.w}", z = ["${a.s}", "${e}"]}
+c = "${d}"
+d = 4
+e = "${a.x}"
+f = {g = "${e}/${c}", h = "${a}"}
+)"_toml;
+	auto serial = tomlex::resolve(toml::value(cfg));
+	EXPECT_EQ(calls, 1);
+	for (unsigned threads : {1u, 2u, 8u}) {
+		calls = 0;
+		auto parallel = tomlex::resolve(toml::value(cfg), tomlex::parallel{threads});
+		EXPECT_EQ(parallel, serial);
+		EXPECT_EQ(tomlex::format(parallel), tomlex::format(serial));
+		EXPECT_EQ(calls, 1);
+	}
+	EXPECT_EQ(serial.at("f").at("g").as_string(), "4_1/4");
+
+	// sections that the graph cannot schedule are resolved on the calling thread, reading the
+	// results of the tasks that succeeded instead of calling their resolvers again
+	auto late = R"(
+a = {s = "${__count__:}"}
+name = "a"
+b = {x = "${${name}.s}", y = "${c.z}"}
+c = {z = "${a.s}"}
+d = {v = "${__count__:}", w = "${e.u}"}
+e = {u = "${d.v}/${e.t}", t = "${__count__:}"}
+)"_toml;
+	calls = 0;
+	serial = tomlex::resolve(toml::value(late));
+	EXPECT_EQ(calls, 3);
+	for (unsigned threads : {2u, 8u}) {
+		calls = 0;
+		auto parallel = tomlex::resolve(toml::value(late), tomlex::parallel{threads});
+		// the tasks call __count__ concurrently, so the numbers may be in another order
+		auto const& s = parallel.at("a").at("s");
+		EXPECT_EQ(parallel.at("b"), toml::value(toml::table{{"x", s}, {"y", s}}));
+		EXPECT_EQ(parallel.at("c").at("z"), s);
+		EXPECT_EQ(parallel.at("d").at("w"), parallel.at("e").at("u"));
+		EXPECT_EQ(parallel.at("e").at("u").as_string(),
+				  std::to_string(parallel.at("d").at("v").as_integer()) + "/" +
+					  std::to_string(parallel.at("e").at("t").as_integer()));
+		EXPECT_EQ(calls, 3);
+	}
+	// a later task that fails on a key only a resolver's result references
+	register_resolver("__ref__", [](toml::value&&) -> toml::value { return "${a.s}"; });
+	auto failing = R"(
+a = {s = "${__count__:}"}
+c = {z = "${a.s}"}
+f = {r = "${__ref__:}", z = "${c.z}"}
+)"_toml;
+	calls = 0;
+	serial = tomlex::resolve(toml::value(failing));
+	EXPECT_EQ(calls, 1);
+	for (unsigned threads : {2u, 8u}) {
+		calls = 0;
+		auto parallel = tomlex::resolve(toml::value(failing), tomlex::parallel{threads});
+		EXPECT_EQ(parallel, serial);
+		EXPECT_EQ(calls, 1);
+	}
+	// the strings that the failed task resolved before it failed are not resolved again
+	auto partly = R"(
+a = {s = "${__count__:}"}
+c = {z = "${a.s}"}
+f = {q = "${__count__:}", r = "${__ref__: ${f.q}}", z = "${c.z}"}
+)"_toml;
+	calls = 0;
+	serial = tomlex::resolve(toml::value(partly));
+	EXPECT_EQ(calls, 2);
+	for (unsigned threads : {2u, 8u}) {
+		calls = 0;
+		auto parallel = tomlex::resolve(toml::value(partly), tomlex::parallel{threads});
+		auto const& s = parallel.at("a").at("s");
+		EXPECT_EQ(parallel.at("f").at("r"), s);
+		EXPECT_EQ(parallel.at("f").at("z"), s);
+		EXPECT_NE(parallel.at("f").at("q"), s);
+		EXPECT_EQ(calls, 2);
+	}
+	tomlex::clear_resolver("__ref__");
+
+	auto error_message = [](auto&& resolve) -> std::string {
+		try {
+			resolve();
+		} catch (std::runtime_error& e) {
+			return e.what();
+		}
+		return "";
+	};
+	for (auto bad : {R"(a = "${b}"
+b = "${c.x}"
+c = {y = 1})"_toml,
+					 R"(a = {x = "${b.y}"}
+b = {y = "${a.x}"})"_toml}) {
+		auto serial_error = error_message([&] { tomlex::resolve(toml::value(bad)); });
+		EXPECT_NE(serial_error, "");
+		EXPECT_EQ(error_message([&] { tomlex::resolve(toml::value(bad), tomlex::parallel{4}); }),
+				  serial_error);
+	}
+	tomlex::clear_resolver("__count__");
+}
+
+TEST(TesttomlextTest, resolver_arguments) {
+	std::size_t size = 0;
+	register_resolver("__size__", [&size](toml::value&& args) -> toml::value {
+		size = args.as_array().size();
+		return std::move(args);
+	});
+	toml::value cfg = R"(
+flt1 = 7.0
+str1 = "7.0"
+word = "abc"
+conv_flt1 = "${no_op: ${flt1}}"
+conv_str1 = "${no_op:${str1} }"
+conv_str2 = '${no_op: "${str1}"}'
+conv_str3 = "${no_op: [${str1}]}"
+decoded = "${decode: ${str1}}"
+word_ = "${no_op: ${word}}"
+nested = "${no_op: ${no_op: ${flt1}}}"
+)"_toml;
+	toml::array big;
+	for (std::int64_t i = 0; i < 20000; i++) {
+		big.push_back(i);
+	}
+	cfg["big"] = big;
+	cfg["big_"] = "${__size__: ${big}}";
+
+	auto resolved = tomlex::resolve(std::move(cfg));
+	EXPECT_EQ(resolved.at("conv_flt1").as_floating(), 7.0);
+	EXPECT_EQ(resolved.at("conv_str1").as_string(), "7.0");
+	EXPECT_EQ(resolved.at("conv_str2").as_string(), "7.0");
+	EXPECT_EQ(resolved.at("conv_str3"), toml::value(toml::array{7.0}));
+	EXPECT_EQ(resolved.at("decoded").as_floating(), 7.0);
+	EXPECT_EQ(resolved.at("word_").as_string(), "abc");
+	EXPECT_EQ(resolved.at("nested").as_floating(), 7.0);
+	EXPECT_EQ(resolved.at("big_"), resolved.at("big"));
+	EXPECT_EQ(size, 20000);
+	tomlex::clear_resolver("__size__");
+}
+
+TEST(TesttomlextTest, reparse_arguments) {
+	register_resolver("__reparse__", [](toml::value&& args) { return std::move(args); },
+					  tomlex::pure | tomlex::reparse_arguments);
+	toml::value cfg = R"(
+flt1 = 7.0
+str1 = "7.0"
+list = "[1, 2]"
+conv_flt1 = "${__reparse__: ${flt1}}"
+conv_str1 = "${__reparse__: ${str1}}"
+conv_list = "${__reparse__:${list} }"
+quoted = '${__reparse__: "${str1}"}'
+)"_toml;
+	auto resolved = tomlex::resolve(std::move(cfg));
+	EXPECT_EQ(resolved.at("conv_flt1").as_floating(), 7.0);
+	EXPECT_EQ(resolved.at("conv_str1").as_floating(), 7.0);
+	EXPECT_EQ(resolved.at("conv_list"), toml::value(toml::array{1, 2}));
+	EXPECT_EQ(resolved.at("quoted").as_string(), "7.0");
+
+	toml::value word = R"(
+word = "abc"
+conv = "${__reparse__: ${word}}"
+)"_toml;
+	EXPECT_THROW(tomlex::resolve(std::move(word)), tomlex::error);
+	tomlex::clear_resolver("__reparse__");
 }
 
 TEST(TesttomlextTest, from_cli) {
@@ -245,6 +1006,239 @@ float=1.2)"_toml.as_table();
 	ASSERT_THROW(tomlex::from_cli(1, keys2, 0).as_table(), std::runtime_error);
 }
 
+TEST(TesttomlextTest, from_dotted_keys) {
+	std::vector<std::string_view> keys = {"a.b = 1", "a.c = [1, 2]", "a = {d = 'x'}",
+										  "a.c = [3]", "e = 1.5  # comment", "\"f.g\".h = true"};
+	auto cfg = tomlex::from_dotted_keys(keys);
+	EXPECT_EQ(cfg, R"(a = {b = 1, c = [3], d = 'x'}
+e = 1.5
+"f.g" = {h = true})"_toml);
+
+	// the error names the argument
+	for (auto bad : {"a.b.c = 1", "a.b = 'str'", "a = [1,", "10"}) {
+		try {
+			tomlex::from_dotted_keys({keys[0], std::string_view(bad)});
+			ADD_FAILURE() << bad;
+		} catch (std::runtime_error& e) {
+			EXPECT_NE(std::string(e.what()).find(std::string("\"") + bad + "\""), std::string::npos)
+				<< e.what();
+		}
+	}
+
+	// many overrides of the same tables
+	std::vector<std::string> many;
+	for (int i = 0; i < 5000; i++) {
+		many.push_back("t" + std::to_string(i % 10) + ".k" + std::to_string(i / 10) + " = " +
+					   std::to_string(i));
+	}
+	auto many_cfg = tomlex::from_dotted_keys(many);
+	EXPECT_EQ(many_cfg.size(), 10);
+	EXPECT_EQ(many_cfg.at("t3").size(), 500);
+	EXPECT_EQ(many_cfg.at("t3").at("k499").as_integer(), 4993);
+
+	const std::string filename = ::testing::TempDir() + "tomlex_overrides.toml";
+	{
+		std::ofstream ofs(filename);
+		ofs << "# overrides\n\na.b = 1\r\n  a.c = 'x'\na.b = 2\n";
+	}
+	EXPECT_EQ(tomlex::from_dotted_keys_file(filename), R"(a = {b = 2, c = 'x'})"_toml);
+	{
+		std::ofstream ofs(filename);
+		ofs << "a.b = 1\na.b.c = 2\n";
+	}
+	try {
+		tomlex::from_dotted_keys_file(filename);
+		ADD_FAILURE();
+	} catch (std::runtime_error& e) {
+		EXPECT_EQ(std::string(e.what()).find(filename + ":2: "), 0) << e.what();
+	}
+	std::remove(filename.c_str());
+	EXPECT_THROW(tomlex::from_dotted_keys_file(filename), std::runtime_error);
+}
+
+TEST(TesttomlextTest, guess_value_type) {
+	using tomlex::detail::all_lexer_steps;
+	using tomlex::detail::guess_number_type_strict;
+	using tomlex::detail::guess_number_type_with;
+	// picking the lexers from the first bytes gives the same result as trying all of them
+	auto check = [](std::string const& str) {
+		toml::detail::location loc(str, str);
+		auto picked = guess_number_type_strict(loc);
+		auto all = guess_number_type_with(loc, all_lexer_steps);
+		ASSERT_EQ(picked.is_ok(), all.is_ok()) << str;
+		if (all.is_ok()) {
+			EXPECT_EQ(picked.unwrap(), all.unwrap()) << str;
+		} else {
+			EXPECT_EQ(picked.unwrap_err(), all.unwrap_err()) << str;
+		}
+	};
+	for (std::string str :
+		 {"10", "-10", "+10", "0x1F", "0o17", "0b101", "1_000", "1.5", "-1.5e3", "1e10", "inf",
+		  "-inf", "nan", "+nan", "true", "false", "tru", "'abc'", "\"abc\"", "\"a\"b",
+		  "1979-05-27", "1979-05-27T07:32:00", "1979-05-27 07:32:00Z", "1979-05-27T00:32:00-07:00",
+		  "07:32:00", "07:32:00.999", "1979-05", "1979-", "12:", "1:00", "10abc", "x", "#", ".5"}) {
+		check(str);
+	}
+	std::mt19937 rng(0);
+	const std::string alphabet = "0123456789-+:.eETZtrufalsnif'\"x_ ";
+	for (int i = 0; i < 20000; i++) {
+		std::string str(1 + rng() % 12, ' ');
+		for (auto& c : str) {
+			c = alphabet[rng() % alphabet.size()];
+		}
+		check(str);
+	}
+}
+
+TEST(TesttomlextTest, parse_scalar) {
+	// the fast path gives bit-identical values to the full parser, and leaves everything it
+	// does not handle to the full parser
+	auto check = [](std::string const& str) -> bool {
+		auto fast = tomlex::detail::parse_scalar<toml::value>(str);
+		toml::detail::location loc(str, str);
+		auto full = tomlex::detail::parse_value_strict<toml::value>(loc);
+		if (!fast) {
+			return false;
+		}
+		EXPECT_TRUE(full.is_ok()) << str;
+		if (full.is_err()) {
+			return true;
+		}
+		auto const& expected = full.unwrap();
+		EXPECT_EQ(fast->type(), expected.type()) << str;
+		if (expected.is_floating()) {
+			const auto a = fast->as_floating(), b = expected.as_floating();
+			EXPECT_EQ(std::memcmp(&a, &b, sizeof(a)), 0) << str;
+		} else {
+			EXPECT_EQ(*fast, expected) << str;
+		}
+		return true;
+	};
+	for (std::string str :
+		 {"0", "10", "-10", "+10", "1_000", "0x1F", "0xdead_BEEF", "0o17", "0b1010", "1.5", "-0.0",
+		  "+1.5e3", "1e-3", "1E+10", "3.141_592", "inf", "+inf", "-inf", "nan", "-nan", "true",
+		  "false", "9223372036854775807", "-9223372036854775808", "1e308", "4.9e-324"}) {
+		EXPECT_TRUE(check(str)) << str;
+	}
+	for (std::string str : {"", "010", "1__0", "_1", "1_", "1.", ".5", "1.e5", "1e", "0x", "+0x1",
+							"0x1G", "9223372036854775808", "1e400", "tru", "'a'", "1979-05-27",
+							"07:32:00", "[1]", "1 "}) {
+		EXPECT_FALSE(check(str)) << str;
+	}
+	std::mt19937 rng(0);
+	const std::string alphabet = "0123456789_.eE+-xob1fFinatrue";
+	int handled = 0;
+	for (int i = 0; i < 100000; i++) {
+		std::string str(1 + rng() % 10, ' ');
+		for (auto& c : str) {
+			c = alphabet[rng() % alphabet.size()];
+		}
+		handled += check(str);
+	}
+	EXPECT_GT(handled, 1000);
+	EXPECT_EQ(tomlex::from_dotted_keys({"a = 1_0 ", "b = -nan # comment"}).at("a").as_integer(),
+			  10);
+}
+
+TEST(TesttomlextTest, has_interpolation) {
+	using tomlex::utils::find_dollar;
+	using tomlex::utils::has_interpolation;
+	// every length and position around the 16 and 32 byte blocks
+	for (std::size_t size = 0; size < 80; size++) {
+		const std::string plain(size, 'a');
+		EXPECT_EQ(find_dollar(plain), std::string_view::npos);
+		EXPECT_FALSE(has_interpolation(plain));
+		for (std::size_t pos = 0; pos < size; pos++) {
+			auto str = plain;
+			str[pos] = '$';
+			EXPECT_EQ(find_dollar(str), pos);
+			EXPECT_FALSE(has_interpolation(str));
+			if (pos + 1 < size) {
+				str[pos + 1] = '{';
+				EXPECT_TRUE(has_interpolation(str));
+			}
+			// the data after the view is not read
+			EXPECT_EQ(find_dollar(std::string_view(str).substr(0, pos)), std::string_view::npos);
+		}
+	}
+	EXPECT_TRUE(has_interpolation("$$${"));
+	EXPECT_FALSE(has_interpolation("{$} $ {}$"));
+}
+
+TEST(TesttomlextTest, deep_chain) {
+	// k0 = 0, k1 = "${k0}", ..., each key references the previous one
+	const int length = 100000;
+	toml::value chain(toml::table{{"k0", 0}});
+	for (int i = 1; i < length; i++) {
+		chain["k" + std::to_string(i)] = "${k" + std::to_string(i - 1) + "}";
+	}
+	auto resolved = tomlex::resolve(toml::value(chain));
+	ASSERT_EQ(resolved.at("k" + std::to_string(length - 1)).as_integer(), 0);
+	ASSERT_EQ(resolved.at("k" + std::to_string(length / 2)).as_integer(), 0);
+
+	tomlex::resolve_cache<> cache;
+	ASSERT_EQ(find_from_root(cache, chain, "k" + std::to_string(length - 1)).as_integer(), 0);
+
+	tomlex::context<> ctx;
+	ctx.set_max_depth(1000);
+	ASSERT_EQ(ctx.max_depth(), 1000u);
+	try {
+		tomlex::resolve(toml::value(chain), ctx);
+		FAIL();
+	} catch (std::runtime_error& e) {
+		ASSERT_NE(std::string(e.what()).find("max_depth (1000)"), std::string::npos);
+	}
+
+	// keys built at resolution, and the results of resolvers, are evaluated on the call stack as
+	// deep as max_nesting; a deeper nesting is an error, also on a thread with a small stack
+	toml::value dynamic(toml::table{{"e", ""}, {"k0", 0}});
+	for (int i = 1; i < 10000; i++) {
+		dynamic["k" + std::to_string(i)] = "${${e}k" + std::to_string(i - 1) + "}";
+	}
+	tomlex::context<> nesting;
+	nesting.register_resolver("down", [](toml::value&& n) -> toml::value {
+		const auto i = n.as_integer();
+		return i == 0 ? toml::value(0) : toml::value("${down: " + std::to_string(i - 1) + "}");
+	});
+	run_with_stack(1 << 20, [&] {
+		EXPECT_EQ(find_from_root(nesting, dynamic, "k50").as_integer(), 0);
+		EXPECT_EQ(tomlex::resolve(R"(x = "${down: 40}")"_toml, nesting).at("x").as_integer(), 0);
+		try {
+			find_from_root(nesting, dynamic, "k9999");
+			FAIL();
+		} catch (tomlex::error& e) {
+			EXPECT_EQ(e.kind(), tomlex::error::code::max_depth_exceeded);
+			EXPECT_NE(std::string(e.what()).find("max_nesting (100)"), std::string::npos);
+		}
+		auto result = tomlex::try_resolve(R"(x = "${down: 10000}")"_toml, nesting);
+		ASSERT_TRUE(result.is_err());
+		EXPECT_EQ(result.unwrap_err().kind(), tomlex::error::code::max_depth_exceeded);
+	});
+	nesting.set_max_nesting(20);
+	ASSERT_EQ(nesting.max_nesting(), 20u);
+	EXPECT_THROW(find_from_root(nesting, dynamic, "k50"), tomlex::error);
+
+	// aliases of tables, and tables nested deeply
+	toml::value nested(toml::table{{"t0", toml::table{{"x", "${k}"}}}, {"k", 1}});
+	for (int i = 1; i < 1000; i++) {
+		nested["t" + std::to_string(i)] = "${t" + std::to_string(i - 1) + "}";
+	}
+	toml::value* inner = &nested["deep"];
+	for (int i = 0; i < 2000; i++) {
+		inner = &(*inner)["d"];
+	}
+	*inner = "${t999.x}";
+	resolved = tomlex::resolve(std::move(nested));
+	ASSERT_EQ(resolved.at("t999").at("x").as_integer(), 1);
+	toml::value const* node = &resolved.at("deep");
+	for (int i = 0; i < 2000; i++) {
+		node = &node->at("d");
+	}
+	ASSERT_EQ(node->as_integer(), 1);
+
+	ASSERT_THROW(tomlex::resolve(R"({a="${b}", b="${c}", c="${a}"})"_toml), std::runtime_error);
+}
+
 TEST(TesttomlextTest, merge) {
 	auto base =
 		tomlex::merge(R"({a.b=-100, a.c=-200, alpha.beta=10})"_toml, R"({a.b=1, a.c=2})"_toml);
@@ -259,18 +1253,363 @@ TEST(TesttomlextTest, merge) {
 	ASSERT_THROW(tomlex::merge(std::move(a), std::move(b), true), std::runtime_error);
 }
 
+TEST(TesttomlextTest, merge_into) {
+	using tomlex::array_merge;
+	auto base = R"({a.b=1, a.c=[1, 2], xs=[{p=1, q=2}, {p=3}], s="s"})"_toml;
+	const auto overlay = R"({a.b=10, a.c=[3], xs=[{q=20}, {p=30}, {p=40}], t=true})"_toml;
+	const auto overlay_copy = overlay;
+
+	auto replaced = base;
+	tomlex::merge_into(replaced, overlay);
+	ASSERT_EQ(overlay, overlay_copy);
+	ASSERT_EQ(replaced,
+			  R"({a.b=10, a.c=[3], xs=[{q=20}, {p=30}, {p=40}], s="s", t=true})"_toml);
+
+	auto appended = base;
+	tomlex::merge_into(appended, overlay, false, array_merge::append);
+	ASSERT_EQ(appended,
+			  R"({a.b=10, a.c=[1, 2, 3], xs=[{p=1, q=2}, {p=3}, {q=20}, {p=30}, {p=40}],)"
+			  R"( s="s", t=true})"_toml);
+
+	auto by_index = base;
+	tomlex::merge_into(by_index, toml::value(overlay), false, array_merge::by_index);
+	ASSERT_EQ(by_index,
+			  R"({a.b=10, a.c=[3, 2], xs=[{p=1, q=20}, {p=30}, {p=40}], s="s", t=true})"_toml);
+
+	// strict: every key and index of the overlay exists in the base
+	auto strict = base;
+	ASSERT_THROW(tomlex::merge_into(strict, R"({a.d=1})"_toml, true), std::runtime_error);
+	strict = base;
+	ASSERT_THROW(
+		tomlex::merge_into(strict, R"({a.c=[1, 2, 3]})"_toml, true, array_merge::by_index),
+		std::runtime_error);
+	strict = base;
+	tomlex::merge_into(strict, R"({a.c=[5, 6]})"_toml, true, array_merge::by_index);
+	ASSERT_EQ(strict.at("a").at("c"), R"({c=[5, 6]})"_toml.at("c"));
+	ASSERT_THROW(
+		tomlex::merge_into(strict, R"({xs=[{p=1.0}]})"_toml, false, array_merge::by_index),
+		std::runtime_error);
+
+	// layers in order: defaults, site, host, cli
+	auto merged = tomlex::merge({R"({a=1, b=1, c.d=1, c.e=1})"_toml, R"({b=2, c.d=2})"_toml,
+								 R"({c.e=3})"_toml, R"({a=4})"_toml});
+	ASSERT_EQ(merged, R"({a=4, b=2, c.d=2, c.e=3})"_toml);
+	ASSERT_EQ(tomlex::merge(std::vector<toml::value>{}), toml::value(toml::table{}));
+	ASSERT_THROW(tomlex::merge({R"({a=1})"_toml, R"({b=1})"_toml}, true), std::runtime_error);
+	merged = tomlex::merge({R"({a=[1], t={}})"_toml, R"({a=[2], t.x=1})"_toml,
+							R"({a=[3], t.x=2, t.y=1})"_toml},
+						   false, array_merge::append);
+	ASSERT_EQ(merged, R"({a=[1, 2, 3], t.x=2, t.y=1})"_toml);
+	ASSERT_THROW(tomlex::merge({R"({a=1})"_toml, R"({a=2})"_toml, R"({a="s"})"_toml}),
+				 std::runtime_error);
+}
+
+// std::unordered_map that counts the lookups and insertions made through it
+template <typename Key, typename T>
+struct counting_map : std::unordered_map<Key, T> {
+	using base = std::unordered_map<Key, T>;
+	using base::base;
+
+	typename base::iterator find(Key const& key) {
+		touched++;
+		return base::find(key);
+	}
+	typename base::const_iterator find(Key const& key) const {
+		touched++;
+		return base::find(key);
+	}
+	template <typename... Args>
+	std::pair<typename base::iterator, bool> emplace(Args&&... args) {
+		touched++;
+		return base::emplace(std::forward<Args>(args)...);
+	}
+
+	mutable std::size_t touched = 0;
+};
+
+TEST(TesttomlextTest, merge_layers) {
+	using counting_value = toml::basic_value<toml::discard_comments, counting_map, std::vector>;
+	std::vector<counting_value> layers;
+	layers.emplace_back(R"({a=1, b=1, t.x=1, t.y=1})"_toml);
+	for (int i = 2; i <= 5; i++) {
+		layers.emplace_back(toml::value(toml::table{
+			{"a", i}, {"b", i}, {"c", i}, {"t", toml::table{{"x", i}, {"z", i}}}}));
+	}
+	layers.front().as_table().touched = 0;
+	layers.front().as_table().at("t").as_table().touched = 0;
+
+	const auto merged = tomlex::merge(std::move(layers));
+	ASSERT_EQ(toml::value(merged), R"({a=5, b=5, c=5, t.x=5, t.y=1, t.z=5})"_toml);
+	// one lookup for each of a, b, c and t, and one insertion for c, instead of one of each for
+	// every layer
+	EXPECT_EQ(merged.as_table().touched, 5);
+	EXPECT_EQ(merged.at("t").as_table().touched, 3);
+}
+
+TEST(TesttomlextTest, error) {
+	using code = tomlex::error::code;
+	try {
+		tomlex::merge(R"({a.b=[{x=1}]})"_toml, R"({a.b=[{x="s"}]})"_toml, false,
+					  tomlex::array_merge::by_index);
+		FAIL();
+	} catch (tomlex::error& e) {
+		EXPECT_EQ(e.kind(), code::type_mismatch);
+		EXPECT_EQ(e.function(), "tomlex::merge");
+		EXPECT_EQ(e.path(), (std::vector<std::string>{"a", "b", "[0]", "x"}));
+		EXPECT_EQ(e.expected(), toml::value_t::integer);
+		EXPECT_EQ(e.actual(), toml::value_t::string);
+		EXPECT_NE(std::string(e.what()).find("at \"a.b[0].x\""), std::string::npos);
+	}
+	try {
+		tomlex::merge(R"({a.b=1})"_toml, R"({a.c=1})"_toml, true);
+		FAIL();
+	} catch (tomlex::error& e) {
+		EXPECT_EQ(e.kind(), code::key_not_found);
+		EXPECT_EQ(e.path(), (std::vector<std::string>{"a", "c"}));
+		EXPECT_FALSE(e.expected());
+	}
+	try {
+		tomlex::resolve(R"({a="${b.c.d}", b.c=1, x="${a}"})"_toml);
+		FAIL();
+	} catch (tomlex::error& e) {
+		EXPECT_EQ(e.kind(), code::key_not_found);
+		EXPECT_EQ(e.path(), (std::vector<std::string>{"b", "c", "d"}));
+		EXPECT_EQ(e.trace().front(), "${b.c.d}");
+		EXPECT_NE(std::string(e.what()).find("error while processing \"${b.c.d}\""),
+				  std::string::npos);
+	}
+	// an exception from a resolver is kept as the message
+	tomlex::context<> ctx;
+	ctx.register_resolver("fail", [](toml::value&&) -> toml::value {
+		throw std::invalid_argument("failed");
+	});
+	try {
+		tomlex::resolve(R"({a="${fail:}"})"_toml, ctx);
+		FAIL();
+	} catch (tomlex::error& e) {
+		EXPECT_EQ(e.kind(), code::other);
+		EXPECT_EQ(e.message(), "failed");
+		EXPECT_EQ(e.trace(), std::vector<std::string>{"${fail:}"});
+	}
+	try {
+		tomlex::resolve(R"({a="${nof: 1}"})"_toml, ctx);
+		FAIL();
+	} catch (tomlex::error& e) {
+		EXPECT_EQ(e.kind(), code::unknown_resolver);
+	}
+}
+
+TEST(TesttomlextTest, try_functions) {
+	using code = tomlex::error::code;
+	auto merged = tomlex::try_merge(R"({a={b=1, c=2}})"_toml, R"({a.b=3})"_toml);
+	ASSERT_TRUE(merged.is_ok());
+	EXPECT_EQ(merged.unwrap(), R"({a={b=3, c=2}})"_toml);
+	merged = tomlex::try_merge(R"({a.b=1})"_toml, R"({a.b="s"})"_toml);
+	ASSERT_TRUE(merged.is_err());
+	EXPECT_EQ(merged.unwrap_err().kind(), code::type_mismatch);
+	EXPECT_EQ(merged.unwrap_err().path(), (std::vector<std::string>{"a", "b"}));
+	merged = tomlex::try_merge(std::vector<toml::value>{R"({a=1})"_toml, R"({b=1})"_toml}, true);
+	ASSERT_TRUE(merged.is_err());
+	EXPECT_EQ(merged.unwrap_err().kind(), code::key_not_found);
+
+	auto overrides = tomlex::try_from_dotted_keys({"a.b = 1", "a.c = 'x'"});
+	ASSERT_TRUE(overrides.is_ok());
+	EXPECT_EQ(overrides.unwrap(), R"({a={b=1, c='x'}})"_toml);
+	overrides = tomlex::try_from_dotted_keys({"a.b = 1", "a.b.c = 1"});
+	ASSERT_TRUE(overrides.is_err());
+	EXPECT_EQ(overrides.unwrap_err().kind(), code::type_mismatch);
+	EXPECT_EQ(std::string(overrides.unwrap_err().what())
+				  .find("tomlex::from_dotted_keys: invalid argument \"a.b.c = 1\": "),
+			  0);
+	overrides = tomlex::try_from_dotted_keys({"a = [1,"});
+	ASSERT_TRUE(overrides.is_err());
+	EXPECT_EQ(overrides.unwrap_err().kind(), code::syntax_error);
+	constexpr char const* const argv[] = {"prog", "a=1"};
+	EXPECT_TRUE(tomlex::try_from_cli(2, argv).is_ok());
+	EXPECT_TRUE(tomlex::try_from_cli(2, argv, 2).is_err());
+
+	tomlex::context<> ctx;
+	ctx.register_resolver("fail", [](toml::value&&) -> toml::value {
+		throw std::invalid_argument("failed");
+	});
+	auto resolved = tomlex::try_resolve(R"({a="${b}", b=1})"_toml, ctx);
+	ASSERT_TRUE(resolved.is_ok());
+	EXPECT_EQ(resolved.unwrap().at("a").as_integer(), 1);
+	resolved = tomlex::try_resolve(R"({a="${fail:}"})"_toml, ctx);
+	ASSERT_TRUE(resolved.is_err());
+	EXPECT_EQ(resolved.unwrap_err().kind(), code::other);
+	EXPECT_EQ(resolved.unwrap_err().message(), "failed");
+	resolved = tomlex::try_resolve(R"({a="${x}", x="${a}"})"_toml, tomlex::parallel{2});
+	ASSERT_TRUE(resolved.is_err());
+	EXPECT_EQ(resolved.unwrap_err().kind(), code::circular_reference);
+	resolved = tomlex::try_resolve(R"({a="${b.c}", b={}})"_toml, ctx);
+	ASSERT_TRUE(resolved.is_err());
+	EXPECT_EQ(resolved.unwrap_err().kind(), code::key_not_found);
+	EXPECT_EQ(resolved.unwrap_err().path(), (std::vector<std::string>{"b", "c"}));
+
+	// a pure resolver that fails is called again by the next resolution
+	int attempts = 0;
+	ctx.register_resolver(
+		"flaky",
+		[&](toml::value&&) -> toml::value {
+			if (attempts++ == 0) {
+				throw std::runtime_error("not yet");
+			}
+			return 1;
+		},
+		tomlex::pure);
+	tomlex::resolver_memo<> memo;
+	EXPECT_TRUE(tomlex::try_resolve(R"({a="${flaky:}"})"_toml, ctx, memo).is_err());
+	EXPECT_EQ(memo.size(), 0);
+	resolved = tomlex::try_resolve(R"({a="${flaky:}"})"_toml, ctx, memo);
+	ASSERT_TRUE(resolved.is_ok());
+	EXPECT_EQ(resolved.unwrap().at("a").as_integer(), 1);
+	EXPECT_EQ(memo.size(), 1);
+
+	const std::string filename = ::testing::TempDir() + "tomlex_try_parse.toml";
+	{
+		std::ofstream ofs(filename);
+		ofs << "a = \n";
+	}
+	auto parsed = tomlex::try_parse(filename);
+	ASSERT_TRUE(parsed.is_err());
+	EXPECT_EQ(parsed.unwrap_err().kind(), code::syntax_error);
+	std::remove(filename.c_str());
+	EXPECT_TRUE(tomlex::try_parse(filename, ctx).is_err());
+}
+
 TEST(TesttomlextTest, clear_resolver) {
 	std::string resolver_name = "__no_op__";
 	register_resolver(resolver_name, no_op);
 
-	auto it = tomlex::resolver_table<>.find(resolver_name);
-	ASSERT_NE(it, tomlex::resolver_table<>.end());
+	auto resolvers = tomlex::default_context<>().resolvers();
+	ASSERT_NE(resolvers->find(resolver_name), resolvers->end());
 	tomlex::clear_resolver(resolver_name);
-	it = tomlex::resolver_table<>.find(resolver_name);
-	ASSERT_EQ(it, tomlex::resolver_table<>.end());
+	ASSERT_NE(resolvers->find(resolver_name), resolvers->end());  // snapshot
+	resolvers = tomlex::default_context<>().resolvers();
+	ASSERT_EQ(resolvers->find(resolver_name), resolvers->end());
 	ASSERT_THROW(tomlex::clear_resolver(resolver_name), std::runtime_error);
 }
 
+TEST(TesttomlextTest, context) {
+	tomlex::context<> ctx1, ctx2;
+	ctx1.register_resolver("f", [](toml::value&&) -> toml::value { return 1; });
+	ctx2.register_resolver("f", [](toml::value&&) -> toml::value { return 2; });
+	ASSERT_THROW(ctx1.register_resolver("f", no_op), std::runtime_error);
+	auto cfg = R"(a = "${f:}"
+b = "${a}")"_toml;
+	EXPECT_EQ(tomlex::resolve(toml::value(cfg), ctx1), R"(a = 1
+b = 1)"_toml);
+	EXPECT_EQ(tomlex::resolve(toml::value(cfg), ctx2, tomlex::parallel{2}), R"(a = 2
+b = 2)"_toml);
+	EXPECT_EQ(find_from_root(ctx2, cfg, "b").as_integer(), 2);
+	EXPECT_EQ(tomlex::compile(toml::value(cfg)).resolve(ctx1).at("b").as_integer(), 1);
+	EXPECT_THROW(tomlex::resolve(toml::value(cfg)), std::runtime_error);  // default context
+
+	auto copied = ctx1;
+	ctx1.clear_resolvers();
+	EXPECT_THROW(tomlex::resolve(toml::value(cfg), ctx1), std::runtime_error);
+	EXPECT_EQ(find_from_root(copied, cfg, "a").as_integer(), 1);
+
+	// registration while other threads resolve with the same context
+	std::vector<std::thread> threads;
+	std::atomic<int> failures = 0;
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([&] {
+			for (int j = 0; j < 50; j++) {
+				if (tomlex::resolve(toml::value(cfg), ctx2).at("b").as_integer() != 2) {
+					failures++;
+				}
+			}
+		});
+	}
+	for (int i = 0; i < 50; i++) {
+		ctx2.register_resolver("g" + std::to_string(i), no_op);
+	}
+	for (auto& th : threads) {
+		th.join();
+	}
+	EXPECT_EQ(failures, 0);
+	EXPECT_EQ(ctx2.resolvers()->size(), 51);
+}
+
+TEST(TesttomlextTest, pure_resolver) {
+	tomlex::context<> ctx;
+	std::atomic<int> calls = 0;
+	auto twice = [&](toml::value&& args) -> toml::value {
+		calls++;
+		return args.as_integer() * 2;
+	};
+	ctx.register_resolver("twice", twice, tomlex::pure);
+	ctx.register_resolver("twice_impure", twice);
+	auto cfg = R"(n = 3
+a = "${twice: 3}"
+b = "${twice:3}"
+c = "${twice: ${n}}"
+d = "${twice: 4}"
+e = ["${twice_impure: 3}", "${twice_impure: 3}"])"_toml;
+	auto resolved = tomlex::resolve(toml::value(cfg), ctx);
+	EXPECT_EQ(resolved, R"(n = 3
+a = 6
+b = 6
+c = 6
+d = 8
+e = [6, 6])"_toml);
+	EXPECT_EQ(calls, 4);  // twice: 3 and 4, twice_impure: 3 twice
+
+	// results are shared across resolutions only through an explicit memo
+	calls = 0;
+	tomlex::resolver_memo<> memo;
+	EXPECT_EQ(tomlex::resolve(toml::value(cfg), ctx, memo), resolved);
+	EXPECT_EQ(memo.misses(), 2);
+	EXPECT_EQ(memo.hits(), 2);
+	EXPECT_EQ(tomlex::resolve(toml::value(cfg), ctx, tomlex::parallel{2}, memo), resolved);
+	EXPECT_EQ(memo.misses(), 2);
+	EXPECT_EQ(memo.hits(), 6);
+	EXPECT_EQ(memo.size(), 2);
+	EXPECT_EQ(calls, 6);
+	memo.clear();
+	EXPECT_EQ(memo.size(), 0);
+	EXPECT_EQ(memo.hits(), 0);
+}
+
+TEST(TesttomlextTest, shared_value) {
+	using tomlex::shared_value;
+	shared_value cfg = shared_value::table_type{};
+	cfg["n"] = 1;
+	cfg["big"] = shared_value::array_type(1000, shared_value(7));
+	cfg["t"] = shared_value::table_type{{"a", "${n}"}, {"b", "${big}"}};
+	cfg["alias1"] = "${big}";
+	cfg["alias2"] = "${t}";
+	cfg["arr"] = shared_value::array_type{"${big}", "${t.a}"};
+	const shared_value resolved = tomlex::resolve(std::move(cfg), tomlex::context<shared_value>());
+
+	auto const& big = resolved.at("big").as_array();
+	EXPECT_EQ(resolved.at("alias1").as_array(), big);
+	EXPECT_EQ(&resolved.at("alias1").as_array().front(), &big.front());	 // shared
+	EXPECT_EQ(&resolved.at("t").at("b").as_array().front(), &big.front());
+	EXPECT_EQ(&resolved.at("alias2").at("b").as_array().front(), &big.front());
+	EXPECT_EQ(&resolved.at("arr").at(0).as_array().front(), &big.front());
+	EXPECT_EQ(resolved.at("alias2").at("a").as_integer(), 1);
+	EXPECT_EQ(resolved.at("arr").at(1).as_integer(), 1);
+	EXPECT_EQ(big.use_count(), 5);
+
+	// modifying a copy does not affect the others
+	shared_value copied = resolved;
+	copied["alias1"].as_array().push_back(8);
+	copied["t"]["b"].as_array()[0] = 0;
+	EXPECT_EQ(copied.at("alias1").size(), 1001);
+	EXPECT_EQ(resolved.at("alias1").size(), 1000);
+	EXPECT_EQ(copied.at("t").at("b").at(0).as_integer(), 0);
+	EXPECT_EQ(resolved.at("t").at("b").at(0).as_integer(), 7);
+	EXPECT_EQ(&std::as_const(copied).at("big").as_array().front(), &big.front());
+
+	// converts to toml::value
+	toml::value converted(resolved);
+	EXPECT_EQ(converted.at("alias2").at("a").as_integer(), 1);
+	EXPECT_EQ(converted.at("alias1").as_array().size(), 1000);
+}
+
 int main(int argc, char* argv[]) {
 	::testing::InitGoogleTest(&argc, argv);
 	filename_good = argv[1];